@@ -0,0 +1,534 @@
+/*****************************************************************/
+/* File: bench.c                                                 */
+/* Benchmark suite of the evaluator on standard lambda calculus  */
+/* workloads, with machine-readable output.                      */
+/* Author: Minjie Zha                                            */
+/*****************************************************************/
+
+#include <time.h>
+#include <stdarg.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "globals.h"
+#include "util.h"
+#include "eval.h"
+#include "pool.h"
+#include "symbol.h"
+#include "parse.h"
+#include "primitive.h"
+#include "hashcons.h"
+
+THREAD_LOCAL FILE* out;
+THREAD_LOCAL FILE* errOut;
+
+#define PLUS "(lambda m (lambda n (lambda f (lambda x m f (n f x)))))"
+#define TIMES "(lambda m (lambda n (lambda f m (n f))))"
+#define PRED "(lambda n (lambda f (lambda x n (lambda g (lambda h h (g f))) (lambda u x) (lambda u u))))"
+/* Converts a Church numeral to a constant. */
+#define TO_INT "(lambda c c (lambda k + k 1) 0)"
+#define FACT "(Y (lambda f (lambda n ((<= n 0) (lambda d 1) (lambda d * n (f (- n 1)))) 0)))"
+#define FIB "(Y (lambda f (lambda n ((< n 2) (lambda d n) (lambda d + (f (- n 1)) (f (- n 2)))) 0)))"
+#define CAPTURE "(lambda y (lambda x y x))"
+
+/*
+ * The stack of the thread running the benchmarks on deep terms, which is
+ * far smaller than they are deep, so they show the traversals don't recurse.
+ */
+#define DEEP_STACK (256*1024)
+
+/* The engine evaluating the benchmarks, selected with -e. */
+static Engine *engine = NULL;
+
+/* A growing string holding the expression of a benchmark. */
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} Text;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+static long peakRss(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;     // in KB on Linux
+}
+
+static void append(Text *text, const char *format, ...) {
+    va_list args;
+    int length;
+    while(1) {
+        va_start(args,format);
+        length = vsnprintf(text->text+text->length,text->capacity-text->length,format,args);
+        va_end(args);
+        if(text->length+length<text->capacity) break;
+        text->capacity = text->capacity==0 ? 1024 : text->capacity*2;
+        while(text->capacity<=text->length+length) {
+            text->capacity *= 2;
+        }
+        text->text = realloc(text->text,text->capacity);
+    }
+    text->length += length;
+}
+
+/* Appends the Church numeral n, with the given names for its binders. */
+static void namedNumeral(Text *text, int n, const char *f, const char *x) {
+    int i;
+    append(text,"(lambda %s (lambda %s ",f,x);
+    for(i=0;i<n;i++) {
+        append(text,"%s (",f);
+    }
+    append(text,"%s",x);
+    for(i=0;i<n;i++) {
+        append(text,")");
+    }
+    append(text,"))");
+}
+
+/* Appends the Church numeral n. */
+static void numeral(Text *text, int n) {
+    namedNumeral(text,n,"f","x");
+}
+
+/* Appends a variable name for i, in letters since identifiers have no digits. */
+static void variable(Text *text, int i) {
+    do {
+        append(text,"%c",'a'+i%26);
+        i /= 26;
+    } while(i>0);
+}
+
+/* Prints a line of the report, for the fastest of the runs. */
+static void report(const char *name, int n, const char *unit, long work,
+        double ns, size_t allocs) {
+    fprintf(out,"%s\t%s\t%d\t%s\t%ld\t%.0f\t%.2f\t%.0f\t%lu\t%ld\n",engine->name,name,n,unit,work,ns,
+            work>0 ? ns/work : 0.0, ns>0 ? work/ns*1e9 : 0.0,
+            (unsigned long)allocs,peakRss());
+}
+
+/*
+ * Evaluates the expression with the engine. The CEK machine counts its
+ * steps, while the other engines only count the evaluation.
+ */
+static void benchEval(const char *name, int n, const char *expr, int runs) {
+    double best = -1;
+    long steps = 0;
+    size_t allocs = 0;
+    int cek = strcmp(engine->name,"cek")==0;
+    int i;
+    for(i=0;i<runs;i++) {
+        PoolStats before, after;
+        TreeNode *tree = parse_expression(expr);
+        TreeNode *result = NULL;
+        if(tree==NULL) return;
+        pool_getStats(&before);
+        double start = now();
+        if(cek) {
+            Evaluation *evaluation = startEvaluation(tree);
+            if(resumeEvaluation(evaluation,NULL)!=EvalDone) {
+                fprintf(errOut,"%s %d: evaluation failed\n",name,n);
+            }
+            result = evaluationResult(evaluation);
+            steps = evaluationSteps(evaluation);
+            deleteEvaluation(evaluation);
+        } else {
+            result = evaluate(tree);
+            if(result==NULL) {
+                fprintf(errOut,"%s %d: evaluation failed\n",name,n);
+            }
+            steps = 1;
+        }
+        double time = now()-start;
+        pool_getStats(&after);
+        deleteTree(result);
+        allocs = after.allocs-before.allocs;
+        if(best<0 || time<best) {
+            best = time;
+        }
+    }
+    report(name,n,cek ? "step" : "eval",steps,best,allocs);
+}
+
+/*
+ * Evaluates the expression with hash-consing, and counts the nodes found
+ * in the store instead of being kept apart.
+ */
+static void benchHashCons(const char *name, int n, const char *expr, int runs) {
+    double best = -1;
+    size_t hits = 0;
+    size_t allocs = 0;
+    int i;
+    setHashConsing(1);
+    for(i=0;i<runs;i++) {
+        PoolStats before, after;
+        HashConsStats shared, stats;
+        TreeNode *tree = parse_expression(expr);
+        if(tree==NULL) break;
+        pool_getStats(&before);
+        hc_getStats(&shared);
+        double start = now();
+        TreeNode *result = evaluate(tree);
+        double time = now()-start;
+        hc_getStats(&stats);
+        pool_getStats(&after);
+        if(result==NULL) {
+            fprintf(errOut,"%s %d: evaluation failed\n",name,n);
+        }
+        deleteTree(result);
+        hits = stats.hits-shared.hits;
+        allocs = after.allocs-before.allocs;
+        if(best<0 || time<best) {
+            best = time;
+        }
+    }
+    setHashConsing(0);
+    report(name,n,"hit",hits,best,allocs);
+}
+
+/* Reduces the expression in normal order by substitution. */
+static void benchNormalOrder(const char *name, int n, const char *expr, int runs) {
+    double best = -1;
+    long steps = 0;
+    size_t allocs = 0;
+    int i;
+    for(i=0;i<runs;i++) {
+        PoolStats before, after;
+        TreeNode *tree = parse_expression(expr);
+        if(tree==NULL) return;
+        pool_getStats(&before);
+        double start = now();
+        tree = normalOrderReduction(tree,-1,&steps);
+        double time = now()-start;
+        pool_getStats(&after);
+        deleteTree(tree);
+        allocs = after.allocs-before.allocs;
+        if(best<0 || time<best) {
+            best = time;
+        }
+    }
+    report(name,n,"step",steps,best,allocs);
+}
+
+/* Parses the expression only. */
+static void benchParse(const char *name, int n, const char *expr, int runs) {
+    double best = -1;
+    size_t allocs = 0;
+    int i;
+    for(i=0;i<runs;i++) {
+        PoolStats before, after;
+        pool_getStats(&before);
+        double start = now();
+        TreeNode *tree = parse_expression(expr);
+        double time = now()-start;
+        pool_getStats(&after);
+        if(tree==NULL) return;
+        deleteTree(tree);
+        allocs = after.allocs-before.allocs;
+        if(best<0 || time<best) {
+            best = time;
+        }
+    }
+    report(name,n,"byte",strlen(expr),best,allocs);
+}
+
+/* Counts the nodes of the tree, or returns -1 if there is not enough memory. */
+static long countNodes(TreeNode *tree) {
+    Stack stack;
+    TreeNode **top;
+    TreeNode **slot;
+    long nodes = 0;
+    int i;
+    initStack(&stack,sizeof(TreeNode*));
+    *(TreeNode**)pushStack(&stack) = tree;
+    while((top = popStack(&stack))!=NULL) {
+        tree = *top;
+        nodes++;
+        for(i=0;i<MAXCHILDREN;i++) {
+            if(tree->children[i]!=NULL) {
+                if((slot = pushStack(&stack))==NULL) {
+                    freeStack(&stack);
+                    return -1;
+                }
+                *slot = tree->children[i];
+            }
+        }
+    }
+    freeStack(&stack);
+    return nodes;
+}
+
+/*
+ * Copies the abstraction, prints it, renames its variable in the whole body
+ * and deletes it, without evaluating it.
+ */
+static void benchTraversal(const char *name, int n, const char *expr, int runs) {
+    double best = -1;
+    size_t allocs = 0;
+    long nodes = 0;
+    int i;
+    FILE *null = fopen("/dev/null","w");
+    TreeNode *tree = parse_expression(expr);
+    if(tree==NULL || null==NULL) {
+        fprintf(errOut,"%s %d: no expression to traverse\n",name,n);
+        deleteTree(tree);
+        if(null!=NULL) fclose(null);
+        return;
+    }
+    nodes = countNodes(tree);
+    for(i=0;i<runs && nodes>=0;i++) {
+        PoolStats before, after;
+        pool_getStats(&before);
+        double start = now();
+        TreeNode *copy = duplicateTree(tree);
+        if(copy!=NULL) {
+            printExpression(copy,null);
+            copy = alphaConversion(copy);
+        }
+        if(copy==NULL) {
+            nodes = -1;
+            break;
+        }
+        deleteTree(copy);
+        double time = now()-start;
+        pool_getStats(&after);
+        allocs = after.allocs-before.allocs;
+        if(best<0 || time<best) {
+            best = time;
+        }
+    }
+    if(nodes<0) {
+        fprintf(errOut,"%s %d: out of memory\n",name,n);
+    } else {
+        report(name,n,"node",nodes,best,allocs);
+    }
+    deleteTree(tree);
+    fclose(null);
+}
+
+/* The streams of the main thread, and the number of runs. */
+typedef struct {
+    FILE *out;
+    FILE *errOut;
+    int runs;
+} DeepArgs;
+
+/* Runs the benchmarks on terms up to a million nodes deep. */
+static void * deepBenchmarks(void *arg) {
+    DeepArgs *args = arg;
+    Text text = {NULL, 0, 0};
+    int i, n;
+    out = args->out;
+    errOut = args->errOut;
+
+    // a numeral is nested as deep as it is large
+    for(n=10000;n<=1000000;n*=10) {
+        text.length = 0;
+        numeral(&text,n);
+        benchTraversal("deep_traversal",n,text.text,args->runs);
+    }
+
+    // identities applied one after the other, a spine of applications
+    for(n=10000;n<=1000000;n*=10) {
+        text.length = 0;
+        for(i=0;i<n;i++) {
+            append(&text,"(lambda x x) ");
+        }
+        append(&text,"1");
+        benchEval("deep_spine",n,text.text,args->runs);
+    }
+
+    // identities around a constant, nested n deep
+    for(n=10000;n<=1000000;n*=10) {
+        text.length = 0;
+        for(i=0;i<n;i++) {
+            append(&text,"(lambda x x) (");
+        }
+        append(&text,"1");
+        for(i=0;i<n;i++) {
+            append(&text,")");
+        }
+        benchEval("deep_nesting",n,text.text,args->runs);
+    }
+
+    free(text.text);
+    releaseSharedConstants();
+    return NULL;
+}
+
+int main(int argc, char* argv[]) {
+    out = stdout;
+    errOut = stderr;
+
+    Text text = {NULL, 0, 0};
+    int runs = 5;
+    int i, n;
+    engine = lookupEngine("cek");
+    if(argc>2 && strcmp(argv[1],"-e")==0) {
+        engine = lookupEngine(argv[2]);
+        argv += 2;
+        argc -= 2;
+    }
+    if(argc>1) {
+        runs = atoi(argv[1]);
+    }
+    if(engine==NULL || runs<1) {
+        fprintf(errOut,"Usage: %s [-e engine] [runs]\n",argv[0]);
+        return 1;
+    }
+    setEngine(engine);
+
+    // the global environment is built once, outside the measures
+    globalEnvironment();
+    fprintf(out,"engine\tbenchmark\tn\tunit\twork\tns\tns_per_unit\tunits_per_s\tallocs\tpeak_rss_kb\n");
+
+    int sizes[] = {10, 100, 1000};
+    for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+        n = sizes[i];
+        text.length = 0;
+        append(&text,"%s (%s ",TO_INT,PLUS);
+        numeral(&text,n);
+        append(&text," ");
+        numeral(&text,n);
+        append(&text,")");
+        benchEval("church_add",n,text.text,runs);
+
+        text.length = 0;
+        append(&text,"%s (%s ",TO_INT,TIMES);
+        numeral(&text,n/10);
+        append(&text," ");
+        numeral(&text,n/10);
+        append(&text,")");
+        benchEval("church_mul",n/10,text.text,runs);
+
+        text.length = 0;
+        append(&text,"%s (%s ",TO_INT,PRED);
+        numeral(&text,n);
+        append(&text,")");
+        benchEval("church_pred",n,text.text,runs);
+
+        // the numerals differ only in bound names, so they share one tree
+        text.length = 0;
+        append(&text,"%s (%s ",TO_INT,PLUS);
+        namedNumeral(&text,n,"f","x");
+        append(&text," ");
+        namedNumeral(&text,n,"g","y");
+        append(&text,")");
+        benchHashCons("church_shared",n,text.text,runs);
+    }
+
+    // the numeral k applied to 2 is 2^k
+    for(n=4;n<=16;n+=4) {
+        text.length = 0;
+        append(&text,"%s (",TO_INT);
+        numeral(&text,n);
+        append(&text," ");
+        numeral(&text,2);
+        append(&text,")");
+        benchEval("church_exp",n,text.text,runs);
+    }
+
+    for(n=4;n<=12;n+=4) {
+        text.length = 0;
+        append(&text,"%s %d",FACT,n);
+        benchEval("factorial",n,text.text,runs);
+    }
+
+    for(n=5;n<=20;n+=5) {
+        text.length = 0;
+        append(&text,"%s %d",FIB,n);
+        benchEval("fibonacci",n,text.text,runs);
+    }
+
+    // an argument never used, which only call-by-name doesn't evaluate
+    for(n=5;n<=20;n+=5) {
+        text.length = 0;
+        append(&text,"(lambda x 1) (%s %d)",FIB,n);
+        benchEval("unused_argument",n,text.text,runs);
+    }
+
+    // an argument used twice, which call-by-name evaluates twice
+    for(n=5;n<=20;n+=5) {
+        text.length = 0;
+        append(&text,"(lambda x + x x) (%s %d)",FIB,n);
+        benchEval("shared_argument",n,text.text,runs);
+    }
+
+    // identities around a constant, nested n deep
+    for(n=10;n<=1000;n*=10) {
+        text.length = 0;
+        for(i=0;i<n;i++) {
+            append(&text,"(lambda x x) (");
+        }
+        append(&text,"1");
+        for(i=0;i<n;i++) {
+            append(&text,")");
+        }
+        benchEval("deep_nesting",n,text.text,runs);
+    }
+
+    // a function of n arguments, applied to all of them
+    for(n=10;n<=1000;n*=10) {
+        text.length = 0;
+        for(i=0;i<n;i++) {
+            append(&text,"(lambda ");
+            variable(&text,i);
+            append(&text," ");
+        }
+        variable(&text,0);
+        for(i=0;i<n;i++) {
+            append(&text,")");
+        }
+        for(i=0;i<n;i++) {
+            append(&text," %d",i);
+        }
+        benchEval("wide_application",n,text.text,runs);
+    }
+
+    // every substitution captures the free x, so binders are renamed
+    for(n=10;n<=100;n*=10) {
+        text.length = 0;
+        for(i=0;i<n;i++) {
+            append(&text,"%s (",CAPTURE);
+        }
+        append(&text,"x");
+        for(i=0;i<n;i++) {
+            append(&text,")");
+        }
+        benchNormalOrder("alpha_conversion",n,text.text,runs);
+    }
+
+    // a long application, which the parser reads without nesting
+    for(n=1000;n<=100000;n*=10) {
+        text.length = 0;
+        append(&text,"(lambda x x)");
+        for(i=0;i<n;i++) {
+            append(&text," (lambda ");
+            variable(&text,i);
+            append(&text," ");
+            variable(&text,i);
+            append(&text,") %d",i);
+        }
+        benchParse("parse",n,text.text,runs);
+    }
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    DeepArgs args = {out, errOut, runs};
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr,DEEP_STACK);
+    if(pthread_create(&thread,&attr,deepBenchmarks,&args)==0) {
+        pthread_join(thread,NULL);
+    } else {
+        fprintf(errOut,"The thread of the deep benchmarks cannot be created.\n");
+    }
+    pthread_attr_destroy(&attr);
+
+    free(text.text);
+    releaseGlobalEnvironment();
+    sym_cleanup();
+    return 0;
+}
@@ -0,0 +1,123 @@
+/*****************************************************************/
+/* File: bench_normalize.c                                       */
+/* Benchmark of the normalization by evaluation engine against   */
+/* normal order reduction with betaReduction.                    */
+/* Author: Minjie Zha                                            */
+/*****************************************************************/
+
+#include <time.h>
+#include "globals.h"
+#include "util.h"
+#include "eval.h"
+#include "cek_machine.h"
+#include "nbe.h"
+#include "debruijn.h"
+#include "symbol.h"
+#include "parse.h"
+#include "bignum.h"
+
+THREAD_LOCAL FILE* out;
+THREAD_LOCAL FILE* errOut;
+
+#define PLUS "(lambda m (lambda n (lambda f (lambda x m f (n f x)))))"
+#define TIMES "(lambda m (lambda n (lambda f m (n f))))"
+#define BUFF_SIZE 65536
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/* Writes the Church numeral n to the buffer. */
+static char * numeral(char *buff, int n) {
+    int i;
+    buff += sprintf(buff,"(lambda f (lambda x ");
+    for(i=0;i<n;i++) {
+        buff += sprintf(buff,"f (");
+    }
+    buff += sprintf(buff,"x");
+    for(i=0;i<n;i++) {
+        buff += sprintf(buff,")");
+    }
+    return buff + sprintf(buff,"))");
+}
+
+/* Compares closed terms up to the names of binders. */
+static int sameTerm(TreeNode *a, TreeNode *b) {
+    if(a==NULL || b==NULL || a->kind!=b->kind) return 0;
+    switch(a->kind) {
+        case IdK:
+            return a->index==b->index;
+        case ConstK:
+            return a->value==b->value && (a->big==b->big || (a->big!=NULL
+                && b->big!=NULL && big_compare(a->big,b->big)==0));
+        case AbsK:
+            return sameTerm(a->children[1],b->children[1]);
+        default:
+            return a->name==b->name
+                && sameTerm(a->children[0],b->children[0])
+                && sameTerm(a->children[1],b->children[1]);
+    }
+}
+
+/* Normalizes the term both ways and prints a line of the report. */
+static void bench(const char *name, int size, const char *expr) {
+    long steps = 0;
+    double start = now();
+    TreeNode *naive = normalOrderReduction(parse_expression(expr),-1,&steps);
+    double naiveTime = now()-start;
+
+    NbeStats before, after;
+    nbe_getStats(&before);
+    start = now();
+    TreeNode *normal = evaluate(parse_expression(expr));
+    double nbeTime = now()-start;
+    nbe_getStats(&after);
+
+    db_resolve(naive,NULL);
+    if(!sameTerm(naive,normal)) {
+        fprintf(errOut,"%s %d: different normal forms\n",name,size);
+    }
+    fprintf(out,"%s\t%d\t%ld\t%.0f\t%lu\t%.0f\n",name,size,steps,naiveTime,
+            (unsigned long)(after.betaSteps-before.betaSteps),nbeTime);
+    deleteTree(naive);
+    deleteTree(normal);
+}
+
+int main(int argc, char* argv[]) {
+    out = stdout;
+    errOut = stderr;
+    setEngine(lookupEngine("nbe"));
+
+    char *buff = malloc(BUFF_SIZE);
+    char *end = NULL;
+    int sizes[] = {2, 4, 8, 16, 32};
+    int i;
+    fprintf(out,"term\tn\tnaive_steps\tnaive_ns\tnbe_steps\tnbe_ns\n");
+    for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+        int n = sizes[i];
+        end = buff + sprintf(buff,"%s ",PLUS);
+        end = numeral(end,n);
+        *end++ = ' ';
+        numeral(end,n);
+        bench("plus",n,buff);
+
+        end = buff + sprintf(buff,"%s ",TIMES);
+        end = numeral(end,n);
+        *end++ = ' ';
+        numeral(end,n);
+        bench("times",n,buff);
+
+        // the numeral k applied to 2 is 2^k
+        end = numeral(buff,n/4+1);
+        *end++ = ' ';
+        numeral(end,2);
+        bench("power",n/4+1,buff);
+    }
+    free(buff);
+
+    releaseGlobalEnvironment();
+    sym_cleanup();
+    return 0;
+}
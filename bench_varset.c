@@ -0,0 +1,166 @@
+/*****************************************************************/
+/* File: bench_varset.c                                          */
+/* Microbenchmark of the free variable set against the previous  */
+/* hash table implementation.                                    */
+/* Author: Minjie Zha                                            */
+/*****************************************************************/
+
+#include <time.h>
+#include "globals.h"
+#include "varset.h"
+#include "symbol.h"
+
+THREAD_LOCAL FILE* out;
+THREAD_LOCAL FILE* errOut;
+
+/*
+ * == The previous implementation: 211 buckets of linked lists holding
+ * copies of the names. The shift in the hash is bounded, since shifting
+ * by the character code overflowed.
+ */
+#define LEGACY_SIZE 211
+#define SHIFT 4
+
+typedef struct legacyBucket {
+    char *name;
+    struct legacyBucket *next;
+} LegacyBucket;
+
+typedef struct {
+    LegacyBucket *hashset[LEGACY_SIZE];
+} LegacySet;
+
+static int legacyHash(const char *str) {
+    unsigned int temp = 0;
+    int i;
+    for(i=0;str[i]!='\0';i++) {
+        temp = (temp << (SHIFT + str[i]%16)) % LEGACY_SIZE;
+    }
+    return temp;
+}
+
+static LegacySet *legacyNew(void) {
+    return calloc(1,sizeof(LegacySet));
+}
+
+static void legacyDelete(LegacySet *set) {
+    int i;
+    for(i=0;i<LEGACY_SIZE;i++) {
+        LegacyBucket *bucket = set->hashset[i];
+        while(bucket!=NULL) {
+            LegacyBucket *tmp = bucket;
+            bucket = bucket->next;
+            free(tmp->name);
+            free(tmp);
+        }
+    }
+    free(set);
+}
+
+static int legacyContains(LegacySet *set, const char *var) {
+    LegacyBucket *bucket = set->hashset[legacyHash(var)];
+    for(;bucket!=NULL;bucket=bucket->next) {
+        if(strcmp(bucket->name,var)==0) return 1;
+    }
+    return 0;
+}
+
+static void legacyAdd(LegacySet *set, const char *var) {
+    if(legacyContains(set,var)) return;
+    int h = legacyHash(var);
+    LegacyBucket *bucket = malloc(sizeof(LegacyBucket));
+    bucket->name = strdup(var);
+    bucket->next = set->hashset[h];
+    set->hashset[h] = bucket;
+}
+
+static void legacyUnion(LegacySet *newSet, LegacySet *set1, LegacySet *set2) {
+    int i;
+    LegacyBucket *bucket;
+    for(i=0;i<LEGACY_SIZE;i++) {
+        for(bucket=set1->hashset[i];bucket!=NULL;bucket=bucket->next) {
+            legacyAdd(newSet,bucket->name);
+        }
+        for(bucket=set2->hashset[i];bucket!=NULL;bucket=bucket->next) {
+            legacyAdd(newSet,bucket->name);
+        }
+    }
+}
+/* == End of the previous implementation. */
+
+#define NAMES 256
+static const char *names[NAMES];
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec*1e9+ts.tv_nsec;
+}
+
+/*
+ * One round builds two sets of the given size, takes their union and
+ * looks up every name, as FV() and substitute() do.
+ */
+static double benchLegacy(int size, int rounds) {
+    int r, i, found = 0;
+    double start = now();
+    for(r=0;r<rounds;r++) {
+        LegacySet *a = legacyNew(), *b = legacyNew(), *u = legacyNew();
+        for(i=0;i<size;i++) {
+            legacyAdd(a,names[i]);
+            legacyAdd(b,names[NAMES-1-i]);
+        }
+        legacyUnion(u,a,b);
+        for(i=0;i<NAMES;i++) {
+            found += legacyContains(u,names[i]);
+        }
+        legacyDelete(a);
+        legacyDelete(b);
+        legacyDelete(u);
+    }
+    if(found!=2*size*rounds) fprintf(errOut,"legacy: wrong result\n");
+    return (now()-start)/rounds;
+}
+
+static double benchVarSet(int size, int rounds) {
+    int r, i, found = 0;
+    double start = now();
+    for(r=0;r<rounds;r++) {
+        VarSet *a = newVarSet(), *b = newVarSet(), *u = newVarSet();
+        for(i=0;i<size;i++) {
+            addVar(a,names[i]);
+            addVar(b,names[NAMES-1-i]);
+        }
+        unionVarSet(u,a,b);
+        for(i=0;i<NAMES;i++) {
+            found += contains(u,names[i]);
+        }
+        deleteVarSet(a);
+        deleteVarSet(b);
+        deleteVarSet(u);
+    }
+    if(found!=2*size*rounds) fprintf(errOut,"varset: wrong result\n");
+    return (now()-start)/rounds;
+}
+
+int main(int argc, char* argv[]) {
+    out = stdout;
+    errOut = stderr;
+
+    char buff[16];
+    int i;
+    for(i=0;i<NAMES;i++) {
+        snprintf(buff,sizeof(buff),"v%d",i);
+        names[i] = sym_intern(buff);
+    }
+
+    int sizes[] = {1, 2, 4, 16, 64, 128};
+    int rounds = argc>1 ? atoi(argv[1]) : 20000;
+    fprintf(out,"impl\tvars\tns_per_round\n");
+    for(i=0;i<sizeof(sizes)/sizeof(sizes[0]);i++) {
+        fprintf(out,"legacy\t%d\t%.1f\n",sizes[i],benchLegacy(sizes[i],rounds));
+        fprintf(out,"varset\t%d\t%.1f\n",sizes[i],benchVarSet(sizes[i],rounds));
+    }
+    sym_cleanup();
+    return 0;
+}
@@ -0,0 +1,418 @@
+/******************************************************************/
+/* File: bignum.c                                                 */
+/* Implementation of the arbitrary-precision integers.            */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include <stdatomic.h>
+#include "globals.h"
+#include "bignum.h"
+
+#define MAX_LIMBS (BIG_MAX_BITS/32)
+#define BASE ((uint64_t)1<<32)
+/* The largest power of 10 in a limb, for printing and parsing. */
+#define DECIMAL_BASE 1000000000u
+#define DECIMAL_DIGITS 9
+
+/* Sign and magnitude, with no leading zero limbs. Zero has no limbs. */
+struct bigNum {
+    atomic_int refCount;
+    int sign;               /* -1, 0 or 1 */
+    int size;               /* limbs in use */
+    uint32_t limbs[];       /* least significant first */
+};
+
+/* Allocates a number of the size, or returns NULL if it is too large. */
+static BigNum * newBig(int size) {
+    if(size>MAX_LIMBS+1) return NULL;
+    BigNum *x = malloc(sizeof(BigNum)+size*sizeof(uint32_t));
+    if(x==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return NULL;
+    }
+    atomic_init(&x->refCount,1);
+    x->sign = 0;
+    x->size = size;
+    return x;
+}
+
+/* Drops the leading zero limbs and sets the sign. */
+static BigNum * normalize(BigNum *x, int sign) {
+    while(x->size>0 && x->limbs[x->size-1]==0) {
+        x->size--;
+    }
+    x->sign = x->size==0 ? 0 : sign;
+    if(big_bits(x)>BIG_MAX_BITS) {
+        free(x);
+        return NULL;
+    }
+    return x;
+}
+
+static BigNum * copyBig(const BigNum *x, int sign) {
+    BigNum *result = newBig(x->size);
+    if(result==NULL) return NULL;
+    memcpy(result->limbs,x->limbs,x->size*sizeof(uint32_t));
+    return normalize(result,sign);
+}
+
+BigNum * big_fromInt(int64_t value) {
+    uint64_t magnitude = value<0 ? -(uint64_t)value : (uint64_t)value;
+    BigNum *x = newBig(2);
+    x->limbs[0] = (uint32_t)magnitude;
+    x->limbs[1] = (uint32_t)(magnitude>>32);
+    return normalize(x,value<0 ? -1 : 1);
+}
+
+/* Multiplies the magnitude by the factor and adds the term, in place. */
+static void multiplyAdd(BigNum *x, uint32_t factor, uint32_t term) {
+    uint64_t carry = term;
+    int i;
+    for(i=0;i<x->size;i++) {
+        uint64_t product = (uint64_t)x->limbs[i]*factor+carry;
+        x->limbs[i] = (uint32_t)product;
+        carry = product>>32;
+    }
+    if(carry>0) {
+        x->limbs[x->size++] = (uint32_t)carry;
+    }
+}
+
+BigNum * big_fromString(const char *digits) {
+    int sign = 1;
+    if(*digits=='+' || *digits=='-') {
+        sign = *digits=='-' ? -1 : 1;
+        digits++;
+    }
+    size_t length = strlen(digits);
+    if(length==0) return NULL;
+    // every group of 9 digits fits in a limb
+    BigNum *x = newBig(length/DECIMAL_DIGITS+2);
+    if(x==NULL) return NULL;
+    x->size = 0;
+    while(*digits!='\0') {
+        uint32_t chunk = 0;
+        uint32_t factor = 1;
+        int i;
+        for(i=0;i<DECIMAL_DIGITS && *digits!='\0';i++,digits++) {
+            if(*digits<'0' || *digits>'9') {
+                free(x);
+                return NULL;
+            }
+            chunk = chunk*10+(*digits-'0');
+            factor *= 10;
+        }
+        multiplyAdd(x,factor,chunk);
+    }
+    return normalize(x,sign);
+}
+
+BigNum * big_retain(BigNum *x) {
+    if(x!=NULL) {
+        atomic_fetch_add(&x->refCount,1);
+    }
+    return x;
+}
+
+void big_release(BigNum *x) {
+    if(x!=NULL && atomic_fetch_sub(&x->refCount,1)==1) {
+        free(x);
+    }
+}
+
+int big_toInt(const BigNum *x, int64_t *value) {
+    if(x->size>2) return 0;
+    uint64_t magnitude = 0;
+    if(x->size>0) magnitude = x->limbs[0];
+    if(x->size>1) magnitude |= (uint64_t)x->limbs[1]<<32;
+    if(x->sign>=0) {
+        if(magnitude>(uint64_t)INT64_MAX) return 0;
+        *value = (int64_t)magnitude;
+    } else {
+        if(magnitude>(uint64_t)INT64_MAX+1) return 0;
+        *value = magnitude==(uint64_t)INT64_MAX+1 ? INT64_MIN : -(int64_t)magnitude;
+    }
+    return 1;
+}
+
+int big_sign(const BigNum *x) {
+    return x->sign;
+}
+
+static int compareMagnitudes(const BigNum *x, const BigNum *y) {
+    int i;
+    if(x->size!=y->size) {
+        return x->size<y->size ? -1 : 1;
+    }
+    for(i=x->size-1;i>=0;i--) {
+        if(x->limbs[i]!=y->limbs[i]) {
+            return x->limbs[i]<y->limbs[i] ? -1 : 1;
+        }
+    }
+    return 0;
+}
+
+int big_compare(const BigNum *x, const BigNum *y) {
+    if(x->sign!=y->sign) {
+        return x->sign<y->sign ? -1 : 1;
+    }
+    return x->sign*compareMagnitudes(x,y);
+}
+
+long big_bits(const BigNum *x) {
+    if(x->size==0) return 0;
+    long bits = (long)(x->size-1)*32;
+    uint32_t top = x->limbs[x->size-1];
+    while(top!=0) {
+        bits++;
+        top >>= 1;
+    }
+    return bits;
+}
+
+static BigNum * addMagnitudes(const BigNum *x, const BigNum *y, int sign) {
+    if(x->size<y->size) {
+        const BigNum *tmp = x;
+        x = y;
+        y = tmp;
+    }
+    BigNum *result = newBig(x->size+1);
+    if(result==NULL) return NULL;
+    uint64_t carry = 0;
+    int i;
+    for(i=0;i<x->size;i++) {
+        uint64_t sum = (uint64_t)x->limbs[i]+(i<y->size ? y->limbs[i] : 0)+carry;
+        result->limbs[i] = (uint32_t)sum;
+        carry = sum>>32;
+    }
+    result->limbs[x->size] = (uint32_t)carry;
+    return normalize(result,sign);
+}
+
+/* Subtracts the magnitude of y from the larger one of x. */
+static BigNum * subtractMagnitudes(const BigNum *x, const BigNum *y, int sign) {
+    BigNum *result = newBig(x->size);
+    if(result==NULL) return NULL;
+    int64_t borrow = 0;
+    int i;
+    for(i=0;i<x->size;i++) {
+        int64_t difference = (int64_t)x->limbs[i]-(i<y->size ? y->limbs[i] : 0)-borrow;
+        borrow = difference<0;
+        result->limbs[i] = (uint32_t)(difference+(borrow ? BASE : 0));
+    }
+    return normalize(result,sign);
+}
+
+/* Adds x to y with the sign, which is the sign of y or its opposite. */
+static BigNum * addSigned(const BigNum *x, const BigNum *y, int sign) {
+    if(y->sign==0) return copyBig(x,x->sign);
+    if(x->sign==0) return copyBig(y,sign);
+    if(x->sign==sign) return addMagnitudes(x,y,sign);
+    if(compareMagnitudes(x,y)>=0) {
+        return subtractMagnitudes(x,y,x->sign);
+    }
+    return subtractMagnitudes(y,x,sign);
+}
+
+BigNum * big_add(const BigNum *x, const BigNum *y) {
+    return addSigned(x,y,y->sign);
+}
+
+BigNum * big_subtract(const BigNum *x, const BigNum *y) {
+    return addSigned(x,y,-y->sign);
+}
+
+BigNum * big_multiply(const BigNum *x, const BigNum *y) {
+    BigNum *result = newBig(x->size+y->size);
+    if(result==NULL) return NULL;
+    int i, j;
+    memset(result->limbs,0,result->size*sizeof(uint32_t));
+    for(i=0;i<x->size;i++) {
+        uint64_t carry = 0;
+        for(j=0;j<y->size;j++) {
+            uint64_t product = (uint64_t)x->limbs[i]*y->limbs[j]+result->limbs[i+j]+carry;
+            result->limbs[i+j] = (uint32_t)product;
+            carry = product>>32;
+        }
+        result->limbs[i+y->size] = (uint32_t)carry;
+    }
+    return normalize(result,x->sign*y->sign);
+}
+
+/* Divides the magnitude by the limb in place, and returns the remainder. */
+static uint32_t divideLimb(BigNum *x, uint32_t divisor) {
+    uint64_t remainder = 0;
+    int i;
+    for(i=x->size-1;i>=0;i--) {
+        uint64_t current = (remainder<<32) | x->limbs[i];
+        x->limbs[i] = (uint32_t)(current/divisor);
+        remainder = current%divisor;
+    }
+    while(x->size>0 && x->limbs[x->size-1]==0) {
+        x->size--;
+    }
+    return (uint32_t)remainder;
+}
+
+/*
+ * Divides the magnitude u of m limbs by v of n limbs, where m>=n>=2, with
+ * Knuth's algorithm D. The quotient has m-n+1 limbs and the remainder n.
+ */
+static void divideMagnitudes(const uint32_t *u, int m, const uint32_t *v, int n,
+        uint32_t *q, uint32_t *r) {
+    uint32_t *un = malloc((m+1)*sizeof(uint32_t));
+    uint32_t *vn = malloc(n*sizeof(uint32_t));
+    int shift = 0;
+    int i, j;
+
+    // shift the divisor so that its top bit is set, and the dividend with it
+    while((v[n-1]<<shift & 0x80000000u)==0) {
+        shift++;
+    }
+    for(i=n-1;i>0;i--) {
+        vn[i] = v[i]<<shift | (shift ? v[i-1]>>(32-shift) : 0);
+    }
+    vn[0] = v[0]<<shift;
+    un[m] = shift ? u[m-1]>>(32-shift) : 0;
+    for(i=m-1;i>0;i--) {
+        un[i] = u[i]<<shift | (shift ? u[i-1]>>(32-shift) : 0);
+    }
+    un[0] = u[0]<<shift;
+
+    for(j=m-n;j>=0;j--) {
+        // estimate the quotient digit from the top two limbs
+        uint64_t numerator = (uint64_t)un[j+n]<<32 | un[j+n-1];
+        uint64_t qhat = numerator/vn[n-1];
+        uint64_t rhat = numerator%vn[n-1];
+        while(qhat>=BASE || qhat*vn[n-2]>(rhat<<32 | un[j+n-2])) {
+            qhat--;
+            rhat += vn[n-1];
+            if(rhat>=BASE) break;
+        }
+
+        // multiply and subtract
+        uint64_t carry = 0;
+        int64_t borrow = 0;
+        int64_t difference;
+        for(i=0;i<n;i++) {
+            uint64_t product = qhat*vn[i]+carry;
+            carry = product>>32;
+            difference = (int64_t)un[i+j]-borrow-(int64_t)(product & 0xFFFFFFFFu);
+            un[i+j] = (uint32_t)difference;
+            borrow = difference<0;
+        }
+        difference = (int64_t)un[j+n]-borrow-(int64_t)carry;
+        un[j+n] = (uint32_t)difference;
+
+        // the estimate was one too large, add back
+        if(difference<0) {
+            qhat--;
+            carry = 0;
+            for(i=0;i<n;i++) {
+                uint64_t sum = (uint64_t)un[i+j]+vn[i]+carry;
+                un[i+j] = (uint32_t)sum;
+                carry = sum>>32;
+            }
+            un[j+n] += (uint32_t)carry;
+        }
+        q[j] = (uint32_t)qhat;
+    }
+
+    for(i=0;i<n;i++) {
+        r[i] = un[i]>>shift | (shift ? un[i+1]<<(32-shift) : 0);
+    }
+    free(un);
+    free(vn);
+}
+
+int big_divide(const BigNum *x, const BigNum *y, BigNum **quotient, BigNum **remainder) {
+    BigNum *q = NULL, *r = NULL;
+    if(y->sign==0) return 0;
+    if(compareMagnitudes(x,y)<0) {
+        q = newBig(0);
+        q = normalize(q,0);
+        r = copyBig(x,x->sign);
+    } else if(y->size==1) {
+        q = copyBig(x,x->sign*y->sign);
+        r = big_fromInt(divideLimb(q,y->limbs[0]));
+        q = normalize(q,x->sign*y->sign);
+        r = normalize(r,x->sign);
+    } else {
+        q = newBig(x->size-y->size+1);
+        r = newBig(y->size);
+        divideMagnitudes(x->limbs,x->size,y->limbs,y->size,q->limbs,r->limbs);
+        q = normalize(q,x->sign*y->sign);
+        r = normalize(r,x->sign);
+    }
+    if(quotient!=NULL) {
+        *quotient = q;
+    } else {
+        big_release(q);
+    }
+    if(remainder!=NULL) {
+        *remainder = r;
+    } else {
+        big_release(r);
+    }
+    return 1;
+}
+
+BigNum * big_power(const BigNum *base, unsigned long exponent) {
+    BigNum *result = big_fromInt(1);
+    BigNum *square = copyBig(base,base->sign);
+    BigNum *tmp = NULL;
+    while(exponent>0 && result!=NULL && square!=NULL) {
+        if(exponent & 1) {
+            tmp = big_multiply(result,square);
+            big_release(result);
+            result = tmp;
+        }
+        exponent >>= 1;
+        if(exponent>0 && result!=NULL) {
+            tmp = big_multiply(square,square);
+            big_release(square);
+            square = tmp;
+        }
+    }
+    if(square==NULL) {
+        big_release(result);
+        return NULL;
+    }
+    big_release(square);
+    return result;
+}
+
+unsigned int big_hash(const BigNum *x) {
+    unsigned int h = x->sign+1;
+    int i;
+    for(i=0;i<x->size;i++) {
+        h = (h^x->limbs[i])*0x9E3779B1u;
+    }
+    return h;
+}
+
+void big_print(const BigNum *x, FILE *stream) {
+    if(x->sign==0) {
+        fprintf(stream,"0");
+        return;
+    }
+    // split the magnitude in groups of 9 digits, least significant first
+    int capacity = x->size*10/9+1;      // a limb has less than 10 digits
+    BigNum *rest = copyBig(x,1);
+    uint32_t *groups = rest==NULL ? NULL : malloc(capacity*sizeof(uint32_t));
+    int count = 0;
+    if(groups==NULL) {
+        if(rest!=NULL) fprintf(errOut,"Out of memory.\n");
+        free(rest);
+        return;
+    }
+    do {
+        groups[count++] = divideLimb(rest,DECIMAL_BASE);
+    } while(rest->size>0 && count<capacity);
+    fprintf(stream,"%s%u",x->sign<0 ? "-" : "",groups[--count]);
+    while(count>0) {
+        fprintf(stream,"%09u",groups[--count]);
+    }
+    free(groups);
+    free(rest);
+}
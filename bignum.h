@@ -0,0 +1,71 @@
+/******************************************************************/
+/* File: bignum.h                                                 */
+/* Definition of the arbitrary-precision integers used for the    */
+/* constants which don't fit in 64 bits.                          */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _BIGNUM_H_
+#define _BIGNUM_H_
+#include <stdint.h>
+
+/*
+ * Big numbers are immutable and reference counted, so trees and values
+ * share them instead of copying. The count is atomic because evaluations
+ * on worker threads share them too. They are allocated with malloc, not
+ * from the pool of the thread, for the same reason.
+ *
+ * Constants are big only if they don't fit in 64 bits, so arithmetic on
+ * small integers never allocates. Operations whose result would have more
+ * than BIG_MAX_BITS bits return NULL.
+ */
+#define BIG_MAX_BITS (1L<<20)
+
+typedef struct bigNum BigNum;
+
+/* Makes the big number of the integer. */
+BigNum * big_fromInt(int64_t value);
+
+/*
+ * Makes the big number of a decimal string, with an optional sign.
+ * Returns NULL if it isn't a number.
+ */
+BigNum * big_fromString(const char *digits);
+
+/* Adds a reference to the number, which may be NULL. */
+BigNum * big_retain(BigNum *x);
+
+/* Drops a reference to the number, which may be NULL. */
+void big_release(BigNum *x);
+
+/* Stores the number in value and returns 1 if it fits in 64 bits. */
+int big_toInt(const BigNum *x, int64_t *value);
+
+/* Returns -1, 0 or 1 as x is negative, zero or positive. */
+int big_sign(const BigNum *x);
+
+/* Compares the numbers, returning -1, 0 or 1 like strcmp. */
+int big_compare(const BigNum *x, const BigNum *y);
+
+/* Returns the number of bits of the absolute value. */
+long big_bits(const BigNum *x);
+
+BigNum * big_add(const BigNum *x, const BigNum *y);
+BigNum * big_subtract(const BigNum *x, const BigNum *y);
+BigNum * big_multiply(const BigNum *x, const BigNum *y);
+
+/*
+ * Divides x by y, truncating toward zero like C does. The quotient and the
+ * remainder are stored if the pointers are not NULL. Returns 0 if y is 0.
+ */
+int big_divide(const BigNum *x, const BigNum *y, BigNum **quotient, BigNum **remainder);
+
+/* Raises the number to the power, by repeated squaring. */
+BigNum * big_power(const BigNum *base, unsigned long exponent);
+
+/* Hashes the value of the number. */
+unsigned int big_hash(const BigNum *x);
+
+/* Prints the number in decimal. */
+void big_print(const BigNum *x, FILE *stream);
+#endif
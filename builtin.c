@@ -5,25 +5,26 @@
 /**********************************************************************/
 #include "globals.h"
 #include "util.h"
+#include "symbol.h"
 #include "builtin.h"
 
 // definitions of expand functions
 static TreeNode* expandByName(const char* name) {
     TreeNode *tree = newTreeNode(AbsK);
     TreeNode *x = newTreeNode(IdK);
-    x->name = stringCopy("x");
+    x->name = sym_intern("x");
     tree->children[0] = x;
 
     TreeNode *body = newTreeNode(AbsK);
     TreeNode *y = newTreeNode(IdK);
-    y->name = stringCopy("y");
+    y->name = sym_intern("y");
     body->children[0] = y;
     TreeNode *primi = newTreeNode(PrimiK);
-    primi->name = stringCopy(name);
+    primi->name = sym_intern(name);
     TreeNode *x1 = newTreeNode(IdK);
-    x1->name = stringCopy("x");
+    x1->name = sym_intern("x");
     TreeNode *y1 = newTreeNode(IdK);
-    y1->name = stringCopy("y");
+    y1->name = sym_intern("y");
     primi->children[0] = x1;
     primi->children[1] = y1;
     body->children[1] = primi;
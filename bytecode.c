@@ -0,0 +1,739 @@
+/******************************************************************/
+/* File: bytecode.c                                               */
+/* Implementation of the bytecode compiler and virtual machine.   */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include "globals.h"
+#include "util.h"
+#include "pool.h"
+#include "primitive.h"
+#include "cek_machine.h"
+#include "debruijn.h"
+#include "eval.h"
+#include "bytecode.h"
+
+typedef enum {
+    ACCESS, CONST, CLOSURE, APPLY, TAILAPPLY, PRIM, RETURN, UNDEF, HALT
+} OpCode;
+
+/* A compiled abstraction. */
+typedef struct {
+    int entry;          /* Offset of the body in the code. */
+    int depth;          /* Number of abstractions around the body. */
+    TreeNode *abs;      /* The abstraction, to read closures back. */
+} Lambda;
+
+/* A compiled expression with all the abstractions it contains. */
+typedef struct {
+    int *code;
+    int size;
+    int capacity;
+    Lambda *lambdas;
+    int lambdaCount;
+    int lambdaCapacity;
+    TreeNode **nodes;       /* Nodes referred to by PRIM and UNDEF. */
+    int nodeCount;
+    int nodeCapacity;
+    Number *numbers;        /* Constants referred to by CONST. */
+    int numberCount;
+    int numberCapacity;
+    Environment *globals;
+    int globalCount;
+    int *globalLambdas;     /* Lambda of each global, or -1. */
+    int trueLambda;
+    int falseLambda;
+    int failed;             /* Out of memory while compiling. */
+} Program;
+
+/* Runtime values: constants and closures. */
+typedef enum { VNumber, VClosure } ValueTag;
+
+struct frameStruct;
+
+typedef struct {
+    ValueTag tag;
+    int64_t number;             /* only for VNumber */
+    BigNum *big;                /* only for VNumber beyond 64 bits */
+    int lambda;                 /* only for VClosure */
+    struct frameStruct *env;    /* only for VClosure */
+} Value;
+
+/* An environment frame binding one argument. */
+typedef struct frameStruct {
+    Value value;
+    struct frameStruct *parent;
+    int refCount;
+} Frame;
+
+/* A saved return address. */
+typedef struct {
+    int pc;
+    Frame *env;
+} Return;
+
+/* == The compiler. */
+
+/*
+ * Returns a copy of the array with twice the capacity, or initial items if
+ * it is empty. Without enough memory, marks the program as failed and
+ * returns NULL, leaving the array as it was.
+ */
+static void * growArray(Program *prog, void *items, int *capacity, int initial,
+        size_t size) {
+    int newCapacity = *capacity==0 ? initial : *capacity*2;
+    void *newItems = prog->failed ? NULL : realloc(items,newCapacity*size);
+    if(newItems==NULL) {
+        if(!prog->failed) fprintf(errOut,"Out of memory.\n");
+        prog->failed = 1;
+        return NULL;
+    }
+    *capacity = newCapacity;
+    return newItems;
+}
+
+/* The functions adding to the program do nothing once it failed. */
+static void emit(Program *prog, int word) {
+    if(prog->size==prog->capacity) {
+        int *code = growArray(prog,prog->code,&prog->capacity,256,sizeof(int));
+        if(code==NULL) return;
+        prog->code = code;
+    }
+    prog->code[prog->size++] = word;
+}
+
+static int addNode(Program *prog, TreeNode *node) {
+    if(prog->nodeCount==prog->nodeCapacity) {
+        TreeNode **nodes = growArray(prog,prog->nodes,&prog->nodeCapacity,16,
+                sizeof(TreeNode*));
+        if(nodes==NULL) return 0;
+        prog->nodes = nodes;
+    }
+    prog->nodes[prog->nodeCount] = retainTree(node);
+    return prog->nodeCount++;
+}
+
+static int addNumber(Program *prog, TreeNode *constant) {
+    if(prog->numberCount==prog->numberCapacity) {
+        Number *numbers = growArray(prog,prog->numbers,&prog->numberCapacity,16,
+                sizeof(Number));
+        if(numbers==NULL) return 0;
+        prog->numbers = numbers;
+    }
+    prog->numbers[prog->numberCount].value = constant->value;
+    prog->numbers[prog->numberCount].big = big_retain(constant->big);
+    return prog->numberCount++;
+}
+
+/* Adds an abstraction whose body is compiled later. */
+static int addLambda(Program *prog, TreeNode *abs, int depth) {
+    if(prog->lambdaCount==prog->lambdaCapacity) {
+        Lambda *lambdas = growArray(prog,prog->lambdas,&prog->lambdaCapacity,16,
+                sizeof(Lambda));
+        if(lambdas==NULL) return 0;
+        prog->lambdas = lambdas;
+    }
+    Lambda *lambda = &prog->lambdas[prog->lambdaCount];
+    lambda->entry = -1;
+    lambda->depth = depth;
+    lambda->abs = retainTree(abs);
+    return prog->lambdaCount++;
+}
+
+/* Compiles a reference to the global at the position. */
+static void compileGlobal(Program *prog, TreeNode *id, int position) {
+    Environment *env = prog->globals;
+    int i;
+    for(i=0;i<position;i++) {
+        env = env->parent;
+    }
+    TreeNode *value = env->closure.expr;
+    if(value->kind==ConstK) {
+        emit(prog,CONST);
+        emit(prog,addNumber(prog,value));
+    } else if(value->kind==AbsK && env->closure.env==NULL) {
+        if(prog->globalLambdas[position]<0) {
+            prog->globalLambdas[position] = addLambda(prog,value,0);
+        }
+        emit(prog,CLOSURE);
+        emit(prog,prog->globalLambdas[position]);
+    } else {
+        emit(prog,UNDEF);
+        emit(prog,addNode(prog,id));
+    }
+}
+
+/* An expression to compile, or one whose operands are compiled. */
+typedef struct {
+    TreeNode *expr;
+    int depth;
+    int tail;
+    int compiled;
+} CompileItem;
+
+static int pushCompile(Stack *stack, TreeNode *expr, int depth, int tail, int compiled) {
+    CompileItem *item = pushStack(stack);
+    if(item==NULL) return 0;
+    item->expr = expr;
+    item->depth = depth;
+    item->tail = tail;
+    item->compiled = compiled;
+    return 1;
+}
+
+/*
+ * Compiles the expression with depth abstractions around it. In tail
+ * position the code leaves the current function. The operands of an
+ * application or a primitive are compiled first, then the instruction
+ * which uses them. Returns 0 if there is not enough memory.
+ */
+static int compile(Program *prog, TreeNode *expr, int depth, int tail) {
+    Stack stack;
+    CompileItem *item;
+    int pushed = 1;
+    initStack(&stack,sizeof(CompileItem));
+    pushCompile(&stack,expr,depth,tail,0);
+    while(pushed && (item = popStack(&stack))!=NULL) {
+        expr = item->expr;
+        depth = item->depth;
+        tail = item->tail;
+        if((expr->kind==AppK || expr->kind==PrimiK) && !item->compiled) {
+            // the first operand is popped first
+            pushed = pushCompile(&stack,expr,depth,tail,1)
+                && pushCompile(&stack,expr->children[1],depth,0,0)
+                && pushCompile(&stack,expr->children[0],depth,0,0);
+            continue;
+        }
+        switch(expr->kind) {
+            case IdK:
+                if(expr->index<0) {
+                    emit(prog,UNDEF);
+                    emit(prog,addNode(prog,expr));
+                } else if(expr->index<depth) {
+                    emit(prog,ACCESS);
+                    emit(prog,expr->index);
+                } else {
+                    compileGlobal(prog,expr,expr->index-depth);
+                }
+                break;
+            case ConstK:
+                emit(prog,CONST);
+                emit(prog,addNumber(prog,expr));
+                break;
+            case AbsK:
+                emit(prog,CLOSURE);
+                emit(prog,addLambda(prog,expr,depth));
+                break;
+            case AppK:
+                emit(prog,tail ? TAILAPPLY : APPLY);
+                continue;
+            case PrimiK:
+                emit(prog,PRIM);
+                emit(prog,lookupPrimitive(expr->name));
+                emit(prog,addNode(prog,expr));
+                break;
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+        }
+        if(tail) {
+            emit(prog,RETURN);
+        }
+    }
+    freeStack(&stack);
+    return pushed && !prog->failed;
+}
+
+static Program * newProgram(Environment *globals) {
+    Program *prog = calloc(1,sizeof(Program));
+    if(prog==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return NULL;
+    }
+    prog->globals = globals;
+    Environment *env;
+    for(env=globals;env!=NULL;env=env->parent) {
+        prog->globalCount++;
+    }
+    prog->globalLambdas = malloc((prog->globalCount+1)*sizeof(int));
+    if(prog->globalLambdas==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        free(prog);
+        return NULL;
+    }
+    int i;
+    for(i=0;i<prog->globalCount;i++) {
+        prog->globalLambdas[i] = -1;
+    }
+    return prog;
+}
+
+static void deleteProgram(Program *prog) {
+    int i;
+    for(i=0;i<prog->lambdaCount;i++) {
+        deleteTree(prog->lambdas[i].abs);
+    }
+    for(i=0;i<prog->nodeCount;i++) {
+        deleteTree(prog->nodes[i]);
+    }
+    for(i=0;i<prog->numberCount;i++) {
+        big_release(prog->numbers[i].big);
+    }
+    free(prog->code);
+    free(prog->lambdas);
+    free(prog->nodes);
+    free(prog->numbers);
+    free(prog->globalLambdas);
+    free(prog);
+}
+
+/* Adds the closed abstraction as a lambda. The tree is consumed. */
+static int addClosedLambda(Program *prog, TreeNode *abs) {
+    db_resolve(abs,NULL);
+    int lambda = addLambda(prog,abs,0);
+    deleteTree(abs);
+    return lambda;
+}
+
+/*
+ * Compiles the expression followed by the bodies of all its lambdas.
+ * Returns NULL if there is not enough memory.
+ */
+static Program * compileProgram(TreeNode *expr, Environment *globals) {
+    Program *prog = newProgram(globals);
+    if(prog==NULL) return NULL;
+    prog->trueLambda = addClosedLambda(prog,booleanNode(1));
+    prog->falseLambda = addClosedLambda(prog,booleanNode(0));
+    int compiled = !prog->failed && compile(prog,expr,0,0);
+    emit(prog,HALT);
+
+    // bodies may add more lambdas
+    int i;
+    for(i=0;compiled && i<prog->lambdaCount;i++) {
+        prog->lambdas[i].entry = prog->size;
+        compiled = compile(prog,prog->lambdas[i].abs->children[1],
+                prog->lambdas[i].depth+1,1);
+    }
+    if(!compiled || prog->failed) {
+        deleteProgram(prog);
+        return NULL;
+    }
+    return prog;
+}
+
+#ifdef DEBUG
+static void printProgram(Program *prog, FILE *stream) {
+    static const char *names[] = {
+        "ACCESS", "CONST", "CLOSURE", "APPLY", "TAILAPPLY", "PRIM",
+        "RETURN", "UNDEF", "HALT"
+    };
+    static const int operands[] = { 1, 1, 1, 0, 0, 2, 0, 1, 0 };
+    int pc = 0;
+    while(pc<prog->size) {
+        int op = prog->code[pc];
+        fprintf(stream,"%4d  %s",pc,names[op]);
+        int i;
+        for(i=1;i<=operands[op];i++) {
+            fprintf(stream," %d",prog->code[pc+i]);
+        }
+        fprintf(stream,"\n");
+        pc += 1+operands[op];
+    }
+}
+#endif
+
+/* == The virtual machine. */
+
+static Frame * retainFrame(Frame *frame) {
+    if(frame!=NULL) {
+        frame->refCount += 1;
+    }
+    return frame;
+}
+
+/*
+ * Releases the frame, and the frames it alone refers to: its parents, and
+ * the environments of the closures they hold, which wait on a stack.
+ */
+static void releaseFrame(Frame *frame) {
+    Stack stack;
+    Frame **top;
+    initStack(&stack,sizeof(Frame*));
+    while(frame!=NULL) {
+        Frame *next = NULL;
+        if(--frame->refCount==0) {
+            next = frame->parent;
+            if(frame->value.tag==VClosure) {
+                // without memory for the stack, the environment is leaked
+                if((top = pushStack(&stack))!=NULL) *top = frame->value.env;
+            } else if(frame->value.big!=NULL) {
+                big_release(frame->value.big);
+            }
+            pool_free(frame,sizeof(Frame));
+        }
+        frame = next;
+        while(frame==NULL && (top = popStack(&stack))!=NULL) {
+            frame = *top;
+        }
+    }
+    freeStack(&stack);
+}
+
+static void releaseValue(Value *value) {
+    if(value->tag==VClosure) {
+        releaseFrame(value->env);
+    } else if(value->big!=NULL) {
+        big_release(value->big);
+    }
+}
+
+/*
+ * Runs the program and stores the final value. Every application is a step
+ * of the meter, and the saved return addresses are its frames. Returns 0 on
+ * errors, once the budget is exhausted, and if there is not enough memory.
+ */
+static int run(Program *prog, Value *result, Meter *meter) {
+    int stackCapacity = 256;
+    Value *stack = malloc(stackCapacity*sizeof(Value));
+    Value *newStack = NULL;
+    int sp = 0;
+    int retCapacity = 256;
+    Return *rets = malloc(retCapacity*sizeof(Return));
+    Return *newRets = NULL;
+    int rp = 0;
+    const int *code = prog->code;
+    int pc = 0;
+    Frame *env = NULL;
+    Frame *frame = NULL;
+    Value fun, arg;
+    Number value;
+    PrimResultKind kind;
+    int ok = 1;
+    int n;
+
+    if(stack==NULL || rets==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        free(stack);
+        free(rets);
+        return 0;
+    }
+
+#if defined(__GNUC__) && !defined(BC_SWITCH_DISPATCH)
+    static void *labels[] = {
+        &&op_ACCESS, &&op_CONST, &&op_CLOSURE, &&op_APPLY, &&op_TAILAPPLY,
+        &&op_PRIM, &&op_RETURN, &&op_UNDEF, &&op_HALT
+    };
+#define CASE(op) op_##op
+#define DISPATCH() goto *labels[code[pc++]]
+    DISPATCH();
+#else
+#define CASE(op) case op
+#define DISPATCH() continue
+    for(;;) switch(code[pc++]) {
+#endif
+
+#define PUSH_CHECK() \
+    if(sp==stackCapacity) { \
+        newStack = realloc(stack,2*stackCapacity*sizeof(Value)); \
+        if(newStack==NULL) goto outOfMemory; \
+        stack = newStack; \
+        stackCapacity *= 2; \
+    }
+
+    CASE(ACCESS):
+        n = code[pc++];
+        for(frame=env;n>0;n--) {
+            frame = frame->parent;
+        }
+        PUSH_CHECK();
+        stack[sp] = frame->value;
+        if(stack[sp].tag==VClosure) {
+            retainFrame(stack[sp].env);
+        } else if(stack[sp].big!=NULL) {
+            big_retain(stack[sp].big);
+        }
+        sp++;
+        DISPATCH();
+
+    CASE(CONST):
+        PUSH_CHECK();
+        stack[sp].tag = VNumber;
+        stack[sp].number = prog->numbers[code[pc]].value;
+        stack[sp].big = big_retain(prog->numbers[code[pc]].big);
+        pc++;
+        sp++;
+        DISPATCH();
+
+    CASE(CLOSURE):
+        PUSH_CHECK();
+        stack[sp].tag = VClosure;
+        stack[sp].lambda = code[pc++];
+        stack[sp].env = retainFrame(env);
+        sp++;
+        DISPATCH();
+
+    CASE(APPLY):
+        if(rp==retCapacity) {
+            newRets = realloc(rets,2*retCapacity*sizeof(Return));
+            if(newRets==NULL) goto outOfMemory;
+            rets = newRets;
+            retCapacity *= 2;
+        }
+        rets[rp].pc = pc;
+        rets[rp].env = env;
+        rp++;
+        env = NULL;
+        // fall through to enter the function
+    CASE(TAILAPPLY):
+        if(!meterStep(meter,rp)) {
+            ok = 0;
+            goto done;
+        }
+        arg = stack[--sp];
+        fun = stack[--sp];
+        if(fun.tag!=VClosure) {
+            fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
+            fprintf(errOut, "Expression:\t");
+            printNumber((Number){fun.number,fun.big},errOut);
+            fprintf(errOut, "\n");
+            releaseValue(&fun);
+            releaseValue(&arg);
+            ok = 0;
+            goto done;
+        }
+        frame = pool_alloc(sizeof(Frame));
+        if(frame==NULL) {
+            releaseValue(&fun);
+            releaseValue(&arg);
+            ok = 0;
+            goto done;
+        }
+        releaseFrame(env);
+        frame->value = arg;
+        frame->parent = fun.env;    // the reference moves to the frame
+        frame->refCount = 1;
+        env = frame;
+        pc = prog->lambdas[fun.lambda].entry;
+        DISPATCH();
+
+    CASE(PRIM):
+        n = code[pc++];
+        if(stack[sp-2].tag!=VNumber || stack[sp-1].tag!=VNumber) {
+            fprintf(errOut, "Error: %s can only be applied on constants.\n",
+                    prog->nodes[code[pc]]->name);
+            ok = 0;
+            goto done;
+        }
+        kind = applyPrimitive(n,(Number){stack[sp-2].number,stack[sp-2].big},
+                (Number){stack[sp-1].number,stack[sp-1].big},&value);
+        if(kind!=PrimNumber && kind!=PrimBoolean) {
+            primitiveError(kind,prog->nodes[code[pc]]->name);
+            ok = 0;
+            goto done;
+        }
+        releaseValue(&stack[sp-2]);
+        releaseValue(&stack[sp-1]);
+        if(kind==PrimNumber) {
+            stack[sp-2].number = value.value;
+            stack[sp-2].big = value.big;
+        } else {
+            stack[sp-2].tag = VClosure;
+            stack[sp-2].lambda = value.value ? prog->trueLambda : prog->falseLambda;
+            stack[sp-2].env = NULL;
+        }
+        pc++;
+        sp--;
+        DISPATCH();
+
+    CASE(RETURN):
+        releaseFrame(env);
+        rp--;
+        pc = rets[rp].pc;
+        env = rets[rp].env;
+        DISPATCH();
+
+    CASE(UNDEF):
+        fprintf(errOut, "Error: %s is not a defined variable or function.\n",
+                prog->nodes[code[pc]]->name);
+        ok = 0;
+        goto done;
+
+    CASE(HALT):
+        *result = stack[--sp];
+        goto done;
+
+#if !defined(__GNUC__) || defined(BC_SWITCH_DISPATCH)
+    }
+#endif
+#undef CASE
+#undef DISPATCH
+#undef PUSH_CHECK
+
+outOfMemory:
+    fprintf(errOut,"Out of memory.\n");
+    ok = 0;
+done:
+    while(sp>0) {
+        releaseValue(&stack[--sp]);
+    }
+    while(rp>0) {
+        releaseFrame(rets[--rp].env);
+    }
+    releaseFrame(env);
+    free(stack);
+    free(rets);
+    return ok;
+}
+
+/* == Reading values back as trees. */
+
+/* A subexpression left to read back, or a node whose children are done. */
+typedef struct {
+    TreeNode *expr;         // NULL once the children are done
+    Frame *env;
+    int depth;
+    TreeNode **place;
+} ReadbackItem;
+
+static int pushReadback(Stack *stack, TreeNode *expr, Frame *env, int depth,
+        TreeNode **place) {
+    ReadbackItem *item = pushStack(stack);
+    if(item==NULL) return 0;
+    item->expr = expr;
+    item->env = env;
+    item->depth = depth;
+    item->place = place;
+    return 1;
+}
+
+/*
+ * Copies the value as a tree: a constant, or the abstraction of a closure
+ * whose identifiers bound outside it are replaced by the values in the
+ * frames or by the globals. Returns NULL on errors.
+ */
+static TreeNode * readbackValue(Program *prog, Value *value) {
+    TreeNode *result = NULL;
+    TreeNode *node = NULL;
+    Stack stack;
+    ReadbackItem *item;
+    int failed = 0;
+    if(value->tag==VNumber) {
+        return constantNode((Number){value->number,big_retain(value->big)});
+    }
+    initStack(&stack,sizeof(ReadbackItem));
+    pushReadback(&stack,prog->lambdas[value->lambda].abs,value->env,0,&result);
+    while(!failed && (item = popStack(&stack))!=NULL) {
+        TreeNode *expr = item->expr;
+        Frame *env = item->env;
+        int depth = item->depth;
+        TreeNode **place = item->place;
+        if(expr==NULL) {
+            node = *place;
+            node->freeDepth = node->kind==AbsK
+                ? db_abstractionDepth(node->children[1]->freeDepth)
+                : db_applicationDepth(node->children[0]->freeDepth,
+                        node->children[1]->freeDepth);
+            continue;
+        }
+        // the value of an identifier is read back in its place
+        while(expr->kind==IdK && expr->freeDepth>depth && expr->index>=0) {
+            int n = expr->index-depth;
+            Frame *frame = env;
+            for(;frame!=NULL && n>0;n--) {
+                frame = frame->parent;
+            }
+            if(frame==NULL) {
+                Environment *global = prog->globals;
+                for(;global!=NULL && n>0;n--) {
+                    global = global->parent;
+                }
+                if(global==NULL) break;
+                *place = retainTree(global->closure.expr);
+                expr = NULL;
+                break;
+            } else if(frame->value.tag==VNumber) {
+                *place = constantNode((Number){frame->value.number,
+                        big_retain(frame->value.big)});
+                expr = NULL;
+                break;
+            } else {
+                expr = prog->lambdas[frame->value.lambda].abs;
+                env = frame->value.env;
+                depth = 0;
+            }
+        }
+        if(expr==NULL) {
+            failed = *place==NULL;
+            continue;
+        }
+        if(expr->freeDepth<=depth || expr->kind==ConstK) {
+            *place = retainTree(expr);
+            continue;
+        }
+        switch(expr->kind) {
+            case AbsK:
+                node = newTreeNode(AbsK);
+                if(node!=NULL) {
+                    node->children[0] = retainTree(expr->children[0]);
+                }
+                break;
+            case AppK:
+            case PrimiK:
+                node = newTreeNode(expr->kind);
+                if(node!=NULL) {
+                    node->name = expr->name;
+                }
+                break;
+            case IdK:
+                fprintf(errOut,"Error: Variable %s is not defined.\n",expr->name);
+                node = NULL;
+                break;
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+                node = NULL;
+        }
+        if(node==NULL) {
+            failed = 1;
+            break;
+        }
+        *place = node;
+        failed = !pushReadback(&stack,NULL,NULL,0,place)
+            || !pushReadback(&stack,expr->children[1],env,
+                    node->kind==AbsK ? depth+1 : depth,&node->children[1])
+            || (node->kind!=AbsK && !pushReadback(&stack,expr->children[0],
+                    env,depth,&node->children[0]));
+    }
+    freeStack(&stack);
+    if(failed) {
+        deleteTree(result);
+        return NULL;
+    }
+    return result;
+}
+
+TreeNode * bc_evaluate(TreeNode *expr, Environment *globals) {
+    if(!db_resolve(expr,globals)) {
+        deleteTree(expr);
+        return NULL;
+    }
+    Program *prog = compileProgram(expr,globals);
+    deleteTree(expr);
+    if(prog==NULL) {
+        return NULL;
+    }
+    #ifdef DEBUG
+        fprintf(errOut,"Bytecode =>\n");
+        printProgram(prog,errOut);
+        fprintf(errOut,"\n");
+    #endif
+
+    TreeNode *result = NULL;
+    Value value;
+    Meter meter;
+    startMeter(&meter);
+    if(run(prog,&value,&meter)) {
+        result = readbackValue(prog,&value);
+        releaseValue(&value);
+    }
+    deleteProgram(prog);
+    return result;
+}
@@ -0,0 +1,42 @@
+/******************************************************************/
+/* File: bytecode.h                                               */
+/* Interfaces of the bytecode compiler and virtual machine.       */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+
+/*
+ * The compiler translates a resolved tree to a flat array of instructions
+ * for a stack machine:
+ *
+ *   ACCESS n      push the value n frames up the environment
+ *   CONST v       push the constant v
+ *   CLOSURE l     push a closure of lambda l and the current environment
+ *   APPLY         pop the argument and the function, save the return
+ *                 address and enter the function body
+ *   TAILAPPLY     the same without saving the return address, used for
+ *                 applications in tail position
+ *   PRIM p i      pop two constants and push the result of primitive p,
+ *                 i is the primitive node for error messages
+ *   RETURN        go back to the saved return address
+ *   UNDEF i       report the undefined identifier node i
+ *   HALT          stop with the value on top of the stack
+ *
+ * Free identifiers refer to the global environment, whose values must be
+ * constants or closed abstractions. They are compiled as CONST or CLOSURE.
+ * Arguments are evaluated before the function is entered, in the same
+ * order as the CEK machine, so both engines give the same results and
+ * errors.
+ */
+
+/*
+ * Compiles and runs the expression in the global environment, and reads
+ * the value back as a tree. Returns NULL on errors. The expression is
+ * consumed. The machine spends the budget of the context (see
+ * setBudget()): every application is a step, and the saved return
+ * addresses are its frames. Exhausting it fails the evaluation.
+ */
+TreeNode * bc_evaluate(TreeNode *expr, Environment *globals);
+#endif
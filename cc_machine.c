@@ -6,56 +6,132 @@
 
 #include "globals.h"
 #include "util.h"
+#include "pool.h"
+#include "primitive.h"
+#include "cek_machine.h"
+#include "eval.h"
 #include "cc_machine.h"
 
-State* cc_newState(void) {
-    State* st = (State*) malloc(sizeof(State));
+CcState* cc_newState(void) {
+    CcState* st = (CcState*) pool_alloc(sizeof(CcState));
     st->controlStr = NULL;
     st->context = NULL;
+    st->depth = 0;
     return st;
 }
 
-void cc_deleteState(State* state) {
-    free(state);
+void cc_deleteState(CcState* state) {
+    pool_free(state,sizeof(CcState));
 }
 
 Context* cc_newContext(void) {
-    Context* ctx = (Context*) malloc(sizeof(Context));
+    Context* ctx = (Context*) pool_alloc(sizeof(Context));
     ctx->expr = NULL;
     ctx->next = NULL;
     return ctx;
 }
 
 void cc_deleteContext(Context* context) {
-    free(context);
+    pool_free(context,sizeof(Context));
 }
 
-void cc_cleanup(State* state) {
-    // delete the expression tree first
-    deleteTree(cc_getProgram(state));
-    // delete all contexts
+void cc_cleanup(CcState* state) {
+    // delete the control string first
+    deleteTree(state->controlStr);
+    // delete all contexts, whose holes are empty
     Context* ctx = NULL;
     while((ctx=state->context)!=NULL) {
         state->context = ctx->next;
+        deleteTree(ctx->expr);
         cc_deleteContext(ctx);
     }
     // delete the state
     cc_deleteState(state);
 }
 
-TreeNode* cc_getProgram(State* state) {
-    if(state->context==NULL) {
-        return state->controlStr;
+int cc_run(CcState* state, Environment *globals, Meter *meter) {
+    Context *ctx = NULL;
+    Environment *global = NULL;
+    TreeNode *node = NULL;
+    TreeNode *tmp = NULL;
+    int hole = 0;
+    while(!cc_canTerminate(state)) {
+        if(!meterStep(meter,state->depth)) {
+            return 0;
+        }
+        node = state->controlStr;
+        if(node->kind==IdK) {
+            // bound identifiers are substituted away, so it is a global
+            EVAL_COUNT(lookups);
+            global = cek_lookupName(globals,node->name);
+            if(global==NULL) {
+                fprintf(errOut, "Error: %s is not a defined variable or function.\n", node->name);
+                return 0;
+            }
+            // the tree is changed by the reductions, so it is copied
+            state->controlStr = duplicateTree(global->closure.expr);
+            deleteTree(node);
+            if(state->controlStr==NULL) {
+                return 0;
+            }
+        } else if(isValue(node)) {
+            // plug the value in the hole, and search the node again
+            ctx = state->context;
+            state->context = ctx->next;
+            state->depth--;
+            tmp = ctx->expr;
+            cc_deleteContext(ctx);
+            tmp->children[tmp->children[0]==NULL ? 0 : 1] = node;
+            state->controlStr = tmp;
+        } else if(!isValue(node->children[0]) || !isValue(node->children[1])) {
+            // evaluate the leftmost child which is not a value
+            hole = isValue(node->children[0]) ? 1 : 0;
+            ctx = cc_newContext();
+            ctx->expr = node;
+            ctx->next = state->context;
+            state->context = ctx;
+            state->depth++;
+            state->controlStr = node->children[hole];
+            node->children[hole] = NULL;
+        } else if(node->kind==AppK) {
+            EVAL_COUNT(betas);
+            if(node->children[0]->kind==ConstK) {
+                fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
+                fprintf(errOut, "Expression:\t");
+                printExpression(node->children[0],errOut);
+                fprintf(errOut,"\n");
+                return 0;
+            }
+            state->controlStr = betaReduction(node);
+            if(state->controlStr==NULL) {
+                return 0;
+            }
+        } else {
+            if(node->children[0]->kind!=ConstK || node->children[1]->kind!=ConstK) {
+                fprintf(errOut, "Error: %s can only be applied on constants.\n", node->name);
+                return 0;
+            }
+            EVAL_COUNT(primitives);
+            tmp = evalPrimitive(node->name,node->children[0],node->children[1]);
+            if(tmp==NULL) {
+                return 0;
+            }
+            if(tmp->refCount>1 && tmp->kind!=ConstK) {
+                // a shared boolean is changed by the reductions, so it is copied
+                TreeNode *copy = duplicateTree(tmp);
+                deleteTree(tmp);
+                tmp = copy;
+            }
+            deleteTree(node);
+            state->controlStr = tmp;
+            if(tmp==NULL) {
+                return 0;
+            }
+        }
     }
-
-    Context* ctx = state->context;
-    // Find the last context, which should contain the root node.
-    while(ctx->next!=NULL) {
-        ctx = ctx->next;
-    }
-    return ctx->expr;
+    return 1;
 }
 
-int cc_canTerminate(State* state) {
+int cc_canTerminate(CcState* state) {
     return isValue(state->controlStr) && state->context==NULL;
 }
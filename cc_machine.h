@@ -7,22 +7,33 @@
 #ifndef _CC_MACHINE_H_
 #define _CC_MACHINE_H_
 
+/*
+ * The CC machine evaluates by substitution, under call-by-value, and
+ * doesn't reduce under abstractions. The control string is the subterm in
+ * evaluation, and the context is the path from the root of the program to
+ * it: every node on the path has a hole, a NULL child, where the subterm
+ * goes back once it is a value. The node is then the control string again,
+ * and the machine searches it for its next redex. Trees are changed in
+ * place, so the program must not share them with anyone else.
+ */
+
 /* Use a LIFO list to represent the context. */
 typedef struct contextStruct {
-    TreeNode * expr;
+    TreeNode * expr;    /* A node with a hole, see above. */
     struct contextStruct * next;
 } Context;
 
 /* Machine state is a pair of control string and the context. */
-typedef struct stateStruct {
+typedef struct ccStateStruct {
     TreeNode * controlStr;
     Context * context;
-} State;
+    long depth;     /* Number of contexts. */
+} CcState;
 
 /* Allocates a new state. */
-State* cc_newState(void);
+CcState* cc_newState(void);
 /* Free a state. */
-void cc_deleteState(State* state);
+void cc_deleteState(CcState* state);
 
 /* Allocates a new context. */
 Context* cc_newContext(void);
@@ -30,11 +41,16 @@ Context* cc_newContext(void);
 void cc_deleteContext(Context* context);
 
 /* Free all memory used by this machine. */
-void cc_cleanup(State* state);
+void cc_cleanup(CcState* state);
 
-/* Get the complete program that is currently evaluated in this machine. */
-TreeNode* cc_getProgram(State* state);
+/*
+ * Runs the machine until it terminates. Free identifiers are replaced by
+ * a copy of their value in the global environment. Every transition is a
+ * step of the meter, and the contexts are its frames. Returns 0 on errors
+ * and once the budget is exhausted.
+ */
+int cc_run(CcState* state, Environment *globals, Meter *meter);
 
 /* Return if the machine reaches a terminate state. */
-int cc_canTerminate(State* state);
+int cc_canTerminate(CcState* state);
 #endif
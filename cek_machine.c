@@ -4,115 +4,318 @@
 /* Author: Minjie Zha                                            */
 /*****************************************************************/
 
+#include <time.h>
 #include "globals.h"
 #include "util.h"
+#include "pool.h"
 #include "cek_machine.h"
 
 /*
  * Some design notes:
- *  - Expression is splitted into pieces and  kept in continuations, so 
- *    don't need to worry about the parent/child relationships when deleting
- *    or adding an expressioin.
- *  - Deleting a closure won't delete the expression in it. It is the 
- *    programmer's responsibility to delete it.
+ *  - Expressions are shared and never changed. A closure or continuation
+ *    holds a reference to a subtree instead of splitting the expression,
+ *    so binding or looking up a variable doesn't copy any tree.
  *  - Environment is shared among closures, while closures are not shared. 
- *    So after each step, the closure should be deleted explicitly, but
- *    an environment is only deleted when its refCount is 0.
+ *    Closures are kept inline in the state, the frames of the continuation
+ *    and the environments, and a closure which is dropped must be cleared
+ *    explicitly, but an environment is only deleted when its refCount is 0.
+ *  - Under call-by-need a binding starts as a thunk, and its closure is
+ *    replaced by the value once it is evaluated. The update continuation
+ *    holds a reference to the binding until then.
+ *  - With a heap in use, the environments are not counted but collected,
+ *    see cek_collect(). Closures are still cleared explicitly.
  */
 
+/* The heap of the new environments of the thread, see cek_useHeap(). */
+static THREAD_LOCAL Heap *currentHeap = NULL;
+
+/* The statistics of all the heaps of the thread. */
+static THREAD_LOCAL GcStats gcStats;
+
 State* cek_newState(void) {
-    State* st = (State*) malloc(sizeof(State));
-    st->closure = NULL;
-    st->continuation = NULL;
+    State* st = (State*) pool_alloc(sizeof(State));
+    st->closure.expr = NULL;
+    st->closure.env = NULL;
+    st->frames = NULL;
+    st->depth = 0;
+    st->capacity = 0;
     return st;
 }
 
 void cek_deleteState(State* state) {
     if(state==NULL) return;
-    free(state);
+    free(state->frames);
+    pool_free(state,sizeof(State));
 }
 
-Environment* cek_newEnvironment(const char *name, Closure *closure, Environment *parent) {
-    Environment *env = malloc(sizeof(Environment));
-    env->name = NULL;
-    if(name!=NULL) {
-        env->name = strdup(name);
+int cek_growState(State *state) {
+    int capacity = state->capacity==0 ? 16 : state->capacity*2;
+    Continuation *frames = realloc(state->frames,capacity*sizeof(Continuation));
+    if(frames==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return 0;
     }
+    state->frames = frames;
+    state->capacity = capacity;
+    return 1;
+}
+
+Environment* cek_newEnvironment(const char *name, Closure closure, Environment *parent) {
+    Environment *env = pool_alloc(sizeof(Environment));
+    env->name = name;
+    env->kind = BoundValue;
     env->closure = closure;
     env->parent = parent;
     env->refCount = 0;
-    if(parent!=NULL) {
+    env->heap = currentHeap;
+    env->marked = 0;
+    env->next = NULL;
+    if(parent!=NULL && parent->heap==NULL) {
         parent->refCount += 1;
     }
+    if(currentHeap!=NULL) {
+        env->next = currentHeap->objects;
+        currentHeap->objects = env;
+        currentHeap->size += 1;
+        if(currentHeap->size>currentHeap->stats.peakSize) {
+            currentHeap->stats.peakSize = currentHeap->size;
+        }
+    }
     return env;
 }
 
 void cek_deleteEnvironment(Environment *env) {
+    Stack dead;
+    Environment **top;
     if(env==NULL) return;
 
-    free(env->name);
-    // delete closure
-    deleteTree(env->closure->expr);
-    cek_deleteClosure(env->closure);
-    Environment *parent = env->parent;
-    free(env);
-    if(parent!=NULL) {
-        parent->refCount -= 1;
-        if(parent->refCount==0) {
-            cek_deleteEnvironment(parent);
+    // the environments freed with this one wait on the stack, since the
+    // chains of parents can be as long as the evaluation
+    initStack(&dead,sizeof(Environment*));
+    while(env!=NULL) {
+        Environment *next = NULL;
+        Environment *drop[2] = {env->closure.env, env->parent};
+        int i;
+        // delete closure
+        deleteTree(env->closure.expr);
+        pool_free(env,sizeof(Environment));
+        for(i=0;i<2;i++) {
+            if(drop[i]!=NULL && drop[i]->heap==NULL && --drop[i]->refCount==0) {
+                Environment **slot;
+                if(next!=NULL && (slot = pushStack(&dead))!=NULL) {
+                    // without memory for the stack, the other one is leaked
+                    *slot = next;
+                }
+                next = drop[i];
+            }
         }
+        if(next==NULL && (top = popStack(&dead))!=NULL) {
+            next = *top;
+        }
+        env = next;
+    }
+    freeStack(&dead);
+}
+
+Environment* cek_lookupName(Environment *env, const char *name) {
+    while(env!=NULL && env->name!=name) {
+        env = env->parent;
+    }
+    return env;
+}
+
+void cek_releaseEnvironment(Environment *env) {
+    if(env==NULL || env->heap!=NULL) return;
+    env->refCount -= 1;
+    if(env->refCount==0) {
+        cek_deleteEnvironment(env);
     }
 }
 
-Closure* cek_newClosure(TreeNode *expr, Environment *env) {
-    Closure *closure = malloc(sizeof(Closure));
+void cek_setClosure(Closure *closure, TreeNode *expr, Environment *env) {
     closure->expr = expr;
     closure->env = env;
-    if(env!=NULL) {
+    if(env!=NULL && env->heap==NULL) {
         env->refCount += 1;
     }
-    return closure;
 }
 
-void cek_deleteClosure(Closure *closure) {
-    if(closure->env!=NULL) {
-        closure->env->refCount -= 1;
-        if(closure->env->refCount==0) {
-            cek_deleteEnvironment(closure->env);
+void cek_clearClosure(Closure *closure) {
+    deleteTree(closure->expr);
+    cek_releaseEnvironment(closure->env);
+    closure->expr = NULL;
+    closure->env = NULL;
+}
+
+Heap * cek_newHeap(size_t size) {
+    Heap *heap = malloc(sizeof(Heap));
+    heap->objects = NULL;
+    heap->size = 0;
+    heap->limit = size>0 ? size : 1;
+    heap->minLimit = heap->limit;
+    memset(&heap->stats,0,sizeof(GcStats));
+    return heap;
+}
+
+/*
+ * Frees the environments of the heap linked from the first one, and their
+ * closures. They may refer to each other, so the references to the counted
+ * environments are dropped before any of them is freed.
+ */
+static void freeCollected(Environment *env) {
+    Environment *dead;
+    for(dead=env;dead!=NULL;dead=dead->next) {
+        cek_releaseEnvironment(dead->closure.env);
+        cek_releaseEnvironment(dead->parent);
+    }
+    while(env!=NULL) {
+        dead = env;
+        env = env->next;
+        deleteTree(dead->closure.expr);
+        pool_free(dead,sizeof(Environment));
+    }
+}
+
+void cek_deleteHeap(Heap *heap) {
+    if(heap==NULL) return;
+    freeCollected(heap->objects);
+    if(heap->stats.peakSize>gcStats.peakSize) {
+        gcStats.peakSize = heap->stats.peakSize;
+    }
+    if(currentHeap==heap) {
+        currentHeap = NULL;
+    }
+    free(heap);
+}
+
+Heap * cek_useHeap(Heap *heap) {
+    Heap *previous = currentHeap;
+    currentHeap = heap;
+    return previous;
+}
+
+/*
+ * Marks the environment and the ones it refers to, if they are in the heap.
+ * Returns 0 if there is not enough memory to mark them all.
+ */
+static int markEnvironment(Heap *heap, Environment *env, Stack *stack) {
+    Environment **top;
+    while(1) {
+        if(env!=NULL && env->heap==heap && !env->marked) {
+            env->marked = 1;
+            if(env->closure.env!=NULL) {
+                if((top = pushStack(stack))==NULL) return 0;
+                *top = env->closure.env;
+            }
+            env = env->parent;
+            continue;
+        }
+        top = popStack(stack);
+        if(top==NULL) break;
+        env = *top;
+    }
+    return 1;
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void cek_collect(Heap *heap, State *state) {
+    double start = seconds();
+    Stack stack;
+    int i;
+    Environment **link;
+    Environment *dead = NULL;
+    unsigned long freed = 0;
+    int marked;
+
+    // mark what the state reaches
+    initStack(&stack,sizeof(Environment*));
+    marked = markEnvironment(heap,state->closure.env,&stack);
+    for(i=0;i<state->depth && marked;i++) {
+        Continuation *ctn = &state->frames[i];
+        marked = markEnvironment(heap,ctn->closure.env,&stack)
+            && markEnvironment(heap,ctn->value.env,&stack)
+            && markEnvironment(heap,ctn->binding,&stack);
+    }
+    freeStack(&stack);
+
+    // sweep the rest, or nothing if some are not marked for lack of memory
+    link = &heap->objects;
+    while(*link!=NULL) {
+        Environment *env = *link;
+        if(env->marked || !marked) {
+            env->marked = 0;
+            link = &env->next;
+        } else {
+            *link = env->next;
+            env->next = dead;
+            dead = env;
+            freed++;
         }
     }
-    free(closure);
+    freeCollected(dead);
+    heap->size -= freed;
+    heap->limit = heap->size*2>heap->minLimit ? heap->size*2 : heap->minLimit;
+
+    double pause = seconds()-start;
+    heap->stats.collections += 1;
+    heap->stats.freed += freed;
+    heap->stats.seconds += pause;
+    if(pause>heap->stats.maxPause) {
+        heap->stats.maxPause = pause;
+    }
+    gcStats.collections += 1;
+    gcStats.freed += freed;
+    gcStats.seconds += pause;
+    if(pause>gcStats.maxPause) {
+        gcStats.maxPause = pause;
+    }
+}
+
+void cek_getGcStats(GcStats *stats) {
+    *stats = gcStats;
 }
 
-Continuation* cek_newContinuation(ContinuationKind tag) {
-    Continuation* ctn = (Continuation*) malloc(sizeof(Continuation));
-    ctn->tag = tag;
-    ctn->closure = NULL;
-    ctn->next = NULL;
-    return ctn;
+void cek_addGcStats(GcStats *total, const GcStats *stats) {
+    total->collections += stats->collections;
+    total->freed += stats->freed;
+    if(stats->peakSize>total->peakSize) {
+        total->peakSize = stats->peakSize;
+    }
+    total->seconds += stats->seconds;
+    if(stats->maxPause>total->maxPause) {
+        total->maxPause = stats->maxPause;
+    }
 }
 
-void cek_deleteContinuation(Continuation* continuation) {
-    free(continuation);
+void cek_printGcStats(const GcStats *stats, FILE *stream) {
+    fprintf(stream,"gc_collections\t%lu\n",stats->collections);
+    fprintf(stream,"gc_freed\t%lu\n",stats->freed);
+    fprintf(stream,"gc_peak_size\t%lu\n",(unsigned long)stats->peakSize);
+    fprintf(stream,"gc_seconds\t%.6f\n",stats->seconds);
+    fprintf(stream,"gc_max_pause\t%.6f\n",stats->maxPause);
 }
 
 void cek_cleanup(State* state) {
     // delete the current closure
-    deleteTree(state->closure->expr);
-    cek_deleteClosure(state->closure);
+    cek_clearClosure(&state->closure);
     // delete all continuations
-    Continuation* ctn = NULL;
-    while((ctn=state->continuation)!=NULL) {
-        state->continuation = ctn->next;
-        deleteTree(ctn->closure->expr);
-        cek_deleteClosure(ctn->closure);
-        cek_deleteContinuation(ctn);
+    while(state->depth>0) {
+        Continuation *ctn = cek_top(state);
+        cek_clearClosure(&ctn->closure);
+        cek_releaseEnvironment(ctn->binding);
+        cek_clearClosure(&ctn->value);
+        cek_pop(state);
     }
     // delete the state
     cek_deleteState(state);
 }
 
 int cek_canTerminate(State* state) {
-    return isValue(state->closure->expr) && state->continuation==NULL
-        && (state->closure->expr->kind==ConstK || state->closure->env==NULL);
+    return isValue(state->closure.expr) && state->depth==0
+        && (state->closure.expr->kind==ConstK || state->closure.env==NULL);
 }
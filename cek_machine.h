@@ -11,65 +11,189 @@
 struct envStruct;
 struct closureStruct;
 
-struct envStruct {
-    char *name;
-    struct closureStruct *closure;
-    struct envStruct *parent;
-    int refCount;   /* Number of references. Just for memory management. */
-};
+/* How a variable is bound, see the call-by-need strategy in eval.h. */
+typedef enum {
+    BoundValue,     /* closure is a value */
+    BoundThunk      /* closure is an argument not evaluated yet */
+} BindingKind;
 
 struct closureStruct {
     TreeNode *expr;
     struct envStruct *env;
 };
 
+struct envStruct {
+    const char *name;   /* Interned name of the bound variable. */
+    BindingKind kind;
+    struct closureStruct closure;
+    struct envStruct *parent;
+    int refCount;   /* Number of references. Just for memory management. */
+    /* The heap collecting it, or NULL if it is reference counted. */
+    struct heapStruct *heap;
+    struct envStruct *next;     /* The next environment of the heap. */
+    int marked;
+};
+
 typedef struct envStruct Environment;
 typedef struct closureStruct Closure;
 
 /* Kind of each continuation. */
 typedef enum {
-    FunKK, ArgKK, OprKK, OpdKK
+    FunKK, ArgKK, OprKK, OpdKK, UpdKK,
+    ForceKK,    /* evaluates the thunk in binding before the result is read back */
+    ReadKK      /* reads back the result in closure, once the thunks are evaluated */
 } ContinuationKind;
 
-/* Use a LIFO list to represent the continuation. */
+/*
+ * A frame of the continuation. The frames are kept in a stack in the state,
+ * with their closures inline, so pushing and popping them don't allocate.
+ */
 typedef struct continuationStruct {
     ContinuationKind tag;
-    Closure * closure;
-    struct continuationStruct * next;
+    Closure closure;
+    Closure value;      /* The evaluated first operand, only for OprKK. */
+    struct envStruct * binding; /* The thunk, only for UpdKK and ForceKK. */
+    /* The argument evaluated on a worker, if any. */
+    struct speculationStruct * speculation;
 } Continuation;
 
 /* 
- * Machine state is a pair of closure and continuation. 
+ * Machine state is a pair of closure and continuation. The continuation
+ * is the stack of frames, the top one last.
  */
 typedef struct stateStruct {
-    Closure *closure;
-    Continuation * continuation;
+    Closure closure;
+    Continuation *frames;
+    int depth;          /* Number of frames. */
+    int capacity;
 } State;
 
-/* Allocates a new state. */
+/* Allocates a new state, with an empty closure and continuation. */
 State* cek_newState(void);
 /* Free a state. */
 void cek_deleteState(State* state);
 
+/*
+ * Makes room for one more frame. Returns 0 if there is not enough memory,
+ * leaving the state as it was.
+ */
+int cek_growState(State *state);
+
+/*
+ * Pushes a frame with the tag and returns it, with the other fields empty.
+ * It is valid until the next push. Returns NULL if there is not enough
+ * memory, so the machine must stop with an error.
+ */
+static inline Continuation * cek_push(State *state, ContinuationKind tag) {
+    if(state->depth==state->capacity && !cek_growState(state)) {
+        return NULL;
+    }
+    Continuation *ctn = &state->frames[state->depth++];
+    ctn->tag = tag;
+    ctn->closure.expr = NULL;
+    ctn->closure.env = NULL;
+    ctn->value.expr = NULL;
+    ctn->value.env = NULL;
+    ctn->binding = NULL;
+    ctn->speculation = NULL;
+    return ctn;
+}
+
+/* Returns the top frame, or NULL if the continuation is empty. */
+static inline Continuation * cek_top(State *state) {
+    return state->depth>0 ? &state->frames[state->depth-1] : NULL;
+}
+
+/* Pops the top frame, whose references must have been taken or dropped. */
+static inline void cek_pop(State *state) {
+    state->depth--;
+}
+
 /* 
  * Allocates a new environment with parent environment specified. 
- * The name will be copied.
+ * The name must be interned, it is not copied. The variable is bound to
+ * the closure, whose references are taken over by the environment.
  */
-Environment* cek_newEnvironment(const char *name, Closure *closure, Environment *parent);
+Environment* cek_newEnvironment(const char *name, Closure closure, Environment *parent);
 /* Free an environment. */
 void cek_deleteEnvironment(Environment *env);
+/* Drops a reference to the environment, freeing it if it is unused. */
+void cek_releaseEnvironment(Environment *env);
+/*
+ * Looks for the binding of the interned name in the environment and its
+ * parents. Returns NULL if the name is not bound.
+ */
+Environment* cek_lookupName(Environment *env, const char *name);
 
-/* Allocates a new closure. */
-Closure* cek_newClosure(TreeNode* expr, Environment *env);
-/* 
- * Free a closure, and the expression and environment in it are also freed. 
+/*
+ * Sets the closure to the expression and the environment, adding a
+ * reference to the environment. The expression is taken over.
+ */
+void cek_setClosure(Closure *closure, TreeNode *expr, Environment *env);
+/* Drops the expression and the environment of the closure, and clears it. */
+void cek_clearClosure(Closure *closure);
+
+/*
+ * Environments can be collected by mark-sweep instead of being counted.
+ * The environments allocated while a heap is in use belong to it: their
+ * references are not counted, and cek_releaseEnvironment() ignores them,
+ * so nothing is freed on the hot path, and cycles made by updated thunks
+ * are freed too. Environments outside the heap, such as the global one, are still counted.
+ */
+typedef struct {
+    unsigned long collections;
+    unsigned long freed;        /* environments freed by collections */
+    size_t peakSize;            /* most environments in a heap */
+    double seconds;             /* pauses of the collections */
+    double maxPause;
+} GcStats;
+
+typedef struct heapStruct {
+    Environment *objects;   /* All environments, linked by next. */
+    size_t size;
+    size_t limit;           /* The size which calls for a collection. */
+    size_t minLimit;
+    GcStats stats;
+} Heap;
+
+/*
+ * Creates a heap which is collected once it holds size environments. Its
+ * limit grows to twice what survives a collection, if that is more.
+ */
+Heap * cek_newHeap(size_t size);
+
+/* Frees the heap and all the environments in it. */
+void cek_deleteHeap(Heap *heap);
+
+/*
+ * Makes the heap the one of the new environments of the thread. NULL
+ * selects reference counting again. Returns the previous heap.
+ */
+Heap * cek_useHeap(Heap *heap);
+
+/* Tests if the heap is full, so the machine should collect it. */
+static inline int cek_heapFull(Heap *heap) {
+    return heap!=NULL && heap->size>=heap->limit;
+}
+
+/*
+ * Frees the environments of the heap which can't be reached from the
+ * state. It must be called between two steps of the machine, when all
+ * the environments in use are reachable from the state.
+ */
+void cek_collect(Heap *heap, State *state);
+
+/* Gets the statistics of all the heaps used by the thread. */
+void cek_getGcStats(GcStats *stats);
+
+/*
+ * Adds the statistics to the total, such as those of another thread. The
+ * peak size and the longest pause are the larger ones.
  */
-void cek_deleteClosure(Closure *closure);
+void cek_addGcStats(GcStats *total, const GcStats *stats);
 
-/* Allocates a new continuation. */
-Continuation* cek_newContinuation(ContinuationKind tag);
-/* Free a continuation. */
-void cek_deleteContinuation(Continuation* continuation);
+/* Prints the statistics, one per line. */
+void cek_printGcStats(const GcStats *stats, FILE *stream);
 
 /* Free all memory used by this machine. */
 void cek_cleanup(State* state);
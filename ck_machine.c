@@ -6,57 +6,158 @@
 
 #include "globals.h"
 #include "util.h"
+#include "pool.h"
+#include "primitive.h"
+#include "cek_machine.h"
+#include "eval.h"
 #include "ck_machine.h"
 
-State* ck_newState(void) {
-    State* st = (State*) malloc(sizeof(State));
+CkState* ck_newState(void) {
+    CkState* st = (CkState*) pool_alloc(sizeof(CkState));
     st->controlStr = NULL;
     st->continuation = NULL;
+    st->depth = 0;
     return st;
 }
 
-void ck_deleteState(State* state) {
-    free(state);
+void ck_deleteState(CkState* state) {
+    pool_free(state,sizeof(CkState));
 }
 
-Continuation* ck_newContinuation(ContinuationKind tag) {
-    Continuation* ctn = (Continuation*) malloc(sizeof(Continuation));
+CkContinuation* ck_newContinuation(ContinuationKind tag) {
+    CkContinuation* ctn = (CkContinuation*) pool_alloc(sizeof(CkContinuation));
     ctn->tag = tag;
     ctn->expr = NULL;
     ctn->next = NULL;
     return ctn;
 }
 
-void ck_deleteContinuation(Continuation* continuation) {
-    free(continuation);
+void ck_deleteContinuation(CkContinuation* continuation) {
+    pool_free(continuation,sizeof(CkContinuation));
 }
 
-void ck_cleanup(State* state) {
-    // delete the expression tree first
-    deleteTree(ck_getProgram(state));
-    // delete all continuations
-    Continuation* ctn = NULL;
+void ck_cleanup(CkState* state) {
+    // delete the control string first
+    deleteTree(state->controlStr);
+    // delete all continuations, whose holes are empty
+    CkContinuation* ctn = NULL;
     while((ctn=state->continuation)!=NULL) {
         state->continuation = ctn->next;
+        deleteTree(ctn->expr);
         ck_deleteContinuation(ctn);
     }
     // delete the state
     ck_deleteState(state);
 }
 
-TreeNode* ck_getProgram(State* state) {
-    if(state->continuation==NULL) {
-        return state->controlStr;
-    }
+/* Pushes a continuation for the node, and evaluates its first child. */
+static void pushNode(CkState *state, ContinuationKind tag, TreeNode *node) {
+    CkContinuation *ctn = ck_newContinuation(tag);
+    ctn->expr = node;
+    ctn->next = state->continuation;
+    state->continuation = ctn;
+    state->depth++;
+    state->controlStr = node->children[0];
+    node->children[0] = NULL;
+}
+
+/* Pops the continuation, and returns its node. */
+static TreeNode * popNode(CkState *state) {
+    CkContinuation *ctn = state->continuation;
+    TreeNode *node = ctn->expr;
+    state->continuation = ctn->next;
+    state->depth--;
+    ck_deleteContinuation(ctn);
+    return node;
+}
 
-    Continuation* ctn = state->continuation;
-    // Find the last continuation, which should contain the root node.
-    while(ctn->next!=NULL) {
-        ctn = ctn->next;
+int ck_run(CkState* state, Environment *globals, Meter *meter) {
+    CkContinuation *ctn = NULL;
+    Environment *global = NULL;
+    TreeNode *node = NULL;
+    TreeNode *tmp = NULL;
+    while(!ck_canTerminate(state)) {
+        if(!meterStep(meter,state->depth)) {
+            return 0;
+        }
+        node = state->controlStr;
+        ctn = state->continuation;
+        if(node->kind==IdK) {
+            // bound identifiers are substituted away, so it is a global
+            EVAL_COUNT(lookups);
+            global = cek_lookupName(globals,node->name);
+            if(global==NULL) {
+                fprintf(errOut, "Error: %s is not a defined variable or function.\n", node->name);
+                return 0;
+            }
+            // the tree is changed by the reductions, so it is copied
+            state->controlStr = duplicateTree(global->closure.expr);
+            deleteTree(node);
+            if(state->controlStr==NULL) {
+                return 0;
+            }
+        } else if(node->kind==AppK) {
+            pushNode(state,ArgKK,node);
+        } else if(node->kind==PrimiK) {
+            pushNode(state,OpdKK,node);
+        } else if(ctn->tag==ArgKK || ctn->tag==OpdKK) {
+            // keep the value, and evaluate the second child
+            if(ctn->tag==ArgKK) {
+                EVAL_COUNT(swaps);
+                ctn->tag = FunKK;
+            } else {
+                EVAL_COUNT(operands);
+                ctn->tag = OprKK;
+            }
+            ctn->expr->children[0] = node;
+            state->controlStr = ctn->expr->children[1];
+            ctn->expr->children[1] = NULL;
+        } else if(ctn->tag==FunKK) {
+            EVAL_COUNT(betas);
+            ctn->expr->children[1] = node;
+            state->controlStr = NULL;
+            if(ctn->expr->children[0]->kind==ConstK) {
+                fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
+                fprintf(errOut, "Expression:\t");
+                printExpression(ctn->expr->children[0],errOut);
+                fprintf(errOut,"\n");
+                return 0;
+            }
+            state->controlStr = betaReduction(popNode(state));
+            if(state->controlStr==NULL) {
+                return 0;
+            }
+        } else if(ctn->tag==OprKK) {
+            ctn->expr->children[1] = node;
+            state->controlStr = NULL;
+            if(ctn->expr->children[0]->kind!=ConstK || node->kind!=ConstK) {
+                fprintf(errOut, "Error: %s can only be applied on constants.\n", ctn->expr->name);
+                return 0;
+            }
+            EVAL_COUNT(primitives);
+            tmp = evalPrimitive(ctn->expr->name,ctn->expr->children[0],node);
+            if(tmp==NULL) {
+                return 0;
+            }
+            if(tmp->refCount>1 && tmp->kind!=ConstK) {
+                // a shared boolean is changed by the reductions, so it is copied
+                TreeNode *copy = duplicateTree(tmp);
+                deleteTree(tmp);
+                tmp = copy;
+            }
+            deleteTree(popNode(state));
+            state->controlStr = tmp;
+            if(tmp==NULL) {
+                return 0;
+            }
+        } else {
+            fprintf(errOut,"Error: Unknown continuation tag.\n");
+            return 0;
+        }
     }
-    return ctn->expr;
+    return 1;
 }
 
-int ck_canTerminate(State* state) {
+int ck_canTerminate(CkState* state) {
     return isValue(state->controlStr) && state->continuation==NULL;
 }
@@ -7,40 +7,55 @@
 #ifndef _CK_MACHINE_H_
 #define _CK_MACHINE_H_
 
-/* Kind of each continuation. */
-typedef enum {
-    FunKK, ArgKK, OprKK, OpdKK
-} ContinuationKind;
+/*
+ * The CK machine evaluates by substitution like the CC machine, but its
+ * continuation tells what to do with a value, so the node a value goes
+ * back to is not searched again. A continuation holds the node of the
+ * application or the primitive in evaluation, with a hole, a NULL child,
+ * where the value goes. Its kinds are those of the CEK machine:
+ *  - ArgKK: the function is evaluated, the argument is the second child;
+ *  - FunKK: the argument is evaluated, the function is the first child;
+ *  - OpdKK: the first operand is evaluated;
+ *  - OprKK: the second operand is evaluated, the first is a constant.
+ * Trees are changed in place, so the program must not share them with
+ * anyone else.
+ */
 
 /* Use a LIFO list to represent the continuation. */
-typedef struct continuationStruct {
+typedef struct ckContinuationStruct {
     ContinuationKind tag;
     TreeNode * expr;
-    struct continuationStruct * next;
-} Continuation;
+    struct ckContinuationStruct * next;
+} CkContinuation;
 
-/* Machine state is a pair of control string and the context. */
-typedef struct stateStruct {
+/* Machine state is a pair of control string and the continuation. */
+typedef struct ckStateStruct {
     TreeNode * controlStr;
-    Continuation * continuation;
-} State;
+    CkContinuation * continuation;
+    long depth;     /* Number of continuations. */
+} CkState;
 
 /* Allocates a new state. */
-State* ck_newState(void);
+CkState* ck_newState(void);
 /* Free a state. */
-void ck_deleteState(State* state);
+void ck_deleteState(CkState* state);
 
 /* Allocates a new continuation. */
-Continuation* ck_newContinuation(ContinuationKind tag);
+CkContinuation* ck_newContinuation(ContinuationKind tag);
 /* Free a continuation. */
-void ck_deleteContinuation(Continuation* continuation);
+void ck_deleteContinuation(CkContinuation* continuation);
 
 /* Free all memory used by this machine. */
-void ck_cleanup(State* state);
+void ck_cleanup(CkState* state);
 
-/* Get the complete program that is currently evaluated in this machine. */
-TreeNode* ck_getProgram(State* state);
+/*
+ * Runs the machine until it terminates. Free identifiers are replaced by
+ * a copy of their value in the global environment. Every transition is a
+ * step of the meter, and the continuations are its frames. Returns 0 on
+ * errors and once the budget is exhausted.
+ */
+int ck_run(CkState* state, Environment *globals, Meter *meter);
 
 /* Return if the machine reaches a terminate state. */
-int ck_canTerminate(State* state);
+int ck_canTerminate(CkState* state);
 #endif
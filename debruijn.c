@@ -0,0 +1,103 @@
+/******************************************************************/
+/* File: debruijn.c                                               */
+/* Implementation of the de Bruijn index resolution.              */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include "globals.h"
+#include "util.h"
+#include "cek_machine.h"
+#include "debruijn.h"
+
+/*
+ * Names bound by the enclosing abstractions, innermost last. It is a
+ * stack of names, which grows and shrinks with the traversal.
+ */
+static int lookupIndex(const char *name, Stack *scope, Environment *env) {
+    const char **names = (const char **)scope->items;
+    int i = 0;
+    for(;i<scope->size;i++) {
+        if(name==names[scope->size-1-i]) {
+            return i;
+        }
+    }
+    for(;env!=NULL;env=env->parent,i++) {
+        if(name==env->name) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* A node to resolve, or whose children are resolved. */
+typedef struct {
+    TreeNode *expr;
+    int resolved;
+} ResolveItem;
+
+static int pushResolve(Stack *stack, TreeNode *expr, int resolved) {
+    ResolveItem *item = pushStack(stack);
+    if(item==NULL) return 0;
+    item->expr = expr;
+    item->resolved = resolved;
+    return 1;
+}
+
+static int resolve(TreeNode *expr, Environment *env) {
+    Stack stack, scope;
+    ResolveItem *item;
+    const char **name;
+    int pushed = 1;
+    if(expr==NULL) return 1;
+
+    initStack(&stack,sizeof(ResolveItem));
+    initStack(&scope,sizeof(const char *));
+    pushResolve(&stack,expr,0);
+    while(pushed && (item = popStack(&stack))!=NULL) {
+        int resolved = item->resolved;
+        expr = item->expr;
+        switch(expr->kind) {
+            case IdK:
+                expr->index = lookupIndex(expr->name,&scope,env);
+                expr->freeDepth = expr->index<0 ? INT_MAX : expr->index+1;
+                break;
+            case ConstK:
+                expr->freeDepth = 0;
+                break;
+            case AbsK:
+                if(!resolved) {
+                    if((name = pushStack(&scope))==NULL) {
+                        pushed = 0;
+                        break;
+                    }
+                    *name = expr->children[0]->name;
+                    pushed = pushResolve(&stack,expr,1)
+                        && pushResolve(&stack,expr->children[1],0);
+                    break;
+                }
+                popStack(&scope);
+                expr->freeDepth = db_abstractionDepth(expr->children[1]->freeDepth);
+                break;
+            case AppK:
+            case PrimiK:
+                if(!resolved) {
+                    pushed = pushResolve(&stack,expr,1)
+                        && pushResolve(&stack,expr->children[1],0)
+                        && pushResolve(&stack,expr->children[0],0);
+                    break;
+                }
+                expr->freeDepth = db_applicationDepth(expr->children[0]->freeDepth,
+                        expr->children[1]->freeDepth);
+                break;
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+        }
+    }
+    freeStack(&scope);
+    freeStack(&stack);
+    return pushed;
+}
+
+int db_resolve(TreeNode *expr, Environment *env) {
+    return resolve(expr,env);
+}
@@ -0,0 +1,33 @@
+/******************************************************************/
+/* File: debruijn.h                                               */
+/* Resolution of identifiers to de Bruijn indices.                */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _DEBRUIJN_H_
+#define _DEBRUIJN_H_
+
+/*
+ * Resolves every identifier in the expression to a de Bruijn index, i.e.
+ * the number of environment frames to skip to reach its binding. Bound
+ * identifiers count the abstractions between them and their binder; free
+ * identifiers are looked up by interned name in the environment and
+ * continue the count past the enclosing abstractions. Identifiers that
+ * cannot be resolved get index -1. Names are kept for printing.
+ *
+ * Every node also gets its freeDepth, the number of frames outside the
+ * node it refers to. A node with freeDepth 0 is closed. Nodes containing
+ * an unresolved identifier get INT_MAX.
+ *
+ * Returns 0 if there is not enough memory, and the expression must not
+ * be evaluated then.
+ */
+int db_resolve(TreeNode *expr, Environment *env);
+
+/* Gets the freeDepth of an abstraction from that of its body. */
+#define db_abstractionDepth(body) \
+    ((body)==INT_MAX ? INT_MAX : (body)>0 ? (body)-1 : 0)
+
+/* Gets the freeDepth of an application from those of its children. */
+#define db_applicationDepth(left,right) ((left)>(right) ? (left) : (right))
+#endif
@@ -3,148 +3,780 @@
 /* Implementation of evaluation the expression.                */
 /* Author: Minjie Zha                                          */
 /***************************************************************/
+#include <time.h>
 #include "globals.h"
 #include "util.h"
+#include "pool.h"
+#include "symbol.h"
 #include "varset.h"
 #include "builtin.h"
 #include "primitive.h"
 #include "stdlib.h" // standard library
 #include "cek_machine.h"
 #include "eval.h"
+#include "cc_machine.h"
+#include "ck_machine.h"
+#include "debruijn.h"
+#include "hashcons.h"
+#include "bytecode.h"
+#include "nbe.h"
+#include "parallel.h"
 
-static Closure* lookupVariable(const char *name, Environment *env);
-static TreeNode* resolveFreeVariables(TreeNode *expr, Environment *env);
+/*
+ * Steps between checks of the clock, the memory in use and the
+ * cancellation of a worker, minus one.
+ */
+#define CHECK_MASK 1023
+
+#ifdef EVAL_STATS
+/* Tracks the peak of the continuation depth, after a push. */
+#define PUSHED(state) ((unsigned long)(state)->depth>evalStats.peakDepth \
+    ? evalStats.peakDepth = (state)->depth : 0)
+#else
+#define PUSHED(state) ((void)0)
+#endif
+
+/* An evaluation with the CEK machine, see startEvaluation(). */
+struct evaluationStruct {
+    State *state;
+    EvalStatus status;
+    EvalStrategy strategy;
+    int hashConsing;
+    long steps;             /* steps done so far */
+    size_t baseBytes;       /* bytes in use in the pool when it started */
+    const char *exhausted;  /* the budget which suspended it */
+    Heap *heap;             /* of the environments, NULL if counted */
+};
+
+/* A closed tree copied out of the pool of its thread, in preorder. */
+typedef struct {
+    ExprKind kind;
+    const char *name;
+    int64_t value;
+    BigNum *big;        /* shared, the count is atomic */
+} FlatNode;
+
+typedef struct {
+    FlatNode *nodes;
+    int size;
+    int capacity;
+} FlatTerm;
+
+/* A subterm evaluated on a worker while the machine goes on. */
+typedef struct speculationStruct {
+    FlatTerm input;
+    FlatTerm result;    /* empty if the evaluation failed */
+    EvalStrategy strategy;
+    int threshold;
+    Budget budget;      /* left to the machine, but the time */
+    double deadline;    /* of the machine, 0 if unlimited */
+    long steps;         /* done by the worker */
+    ParTask *task;
+} Speculation;
+
+static Environment* lookupBinding(int index, Environment *env);
+static Closure* lookupVariable(int index, Environment *env);
+static int applyClosure(Closure *fun, Closure *arg, BindingKind kind, Closure *body);
+static TreeNode* readback(TreeNode *expr, Environment *env, int depth);
+static int pushThunks(State *state, TreeNode *expr, Environment *env);
 static VarSet * FV(TreeNode *expr);
+static void forgetFV(TreeNode *expr);
 static TreeNode *substitute(TreeNode *expr, TreeNode *var, TreeNode *sub);
+static int reduceStep(TreeNode **expr);
 static Environment *buildGlobalEnvironment();
+static TreeNode * cekEvaluate(TreeNode *expr, Environment *globals);
+static TreeNode * ccEvaluate(TreeNode *expr, Environment *globals);
+static TreeNode * ckEvaluate(TreeNode *expr, Environment *globals);
+static TreeNode * substitutionResult(TreeNode *value, Environment *globals);
+static TreeNode * krivineEvaluate(TreeNode *expr, Environment *globals);
+static int runKrivine(State *state, Meter *meter);
+static double seconds(void);
+static Evaluation * newEvaluation(TreeNode *expr, Environment *globals);
+static EvalStatus runMachine(Evaluation *evaluation, const Budget *budget);
+static int budgetLeft(Evaluation *evaluation, const Budget *budget, long fuel,
+        Budget *left);
+static Speculation * speculate(TreeNode *expr, Environment *env, int threshold,
+        const Budget *left, double deadline);
+static long joinSpeculation(Continuation *ctn, int hashConsing, Closure *closure);
+static void cancelSpeculations(State *state);
+static void releaseWorkerContext(void);
+
+#define ENGINE_NUM 6
+static Engine engineList[ENGINE_NUM] = {
+    {"cek",cekEvaluate},{"bytecode",bc_evaluate},{"nbe",nbe_evaluate},
+    {"cc",ccEvaluate},{"ck",ckEvaluate},{"krivine",krivineEvaluate}
+};
+
+/* The context of the threads that don't use one of their own. */
+static EvalContext defaultContext = {
+    NULL, NULL, &engineList[0], CallByValue, 0, 0, {0, 0, 0.0, 0}, 0, NULL
+};
+
+static const Budget unlimited = {0, 0, 0.0, 0};
+
+/* The context of the thread, see useEvalContext(). */
+static THREAD_LOCAL EvalContext *currentContext = NULL;
+
+static EvalContext * context(void) {
+    return currentContext!=NULL ? currentContext : &defaultContext;
+}
+
+EvalContext * newEvalContext(FILE *outStream, FILE *errStream) {
+    EvalContext *ctx = malloc(sizeof(EvalContext));
+    *ctx = *context();
+    ctx->out = outStream;
+    ctx->errOut = errStream;
+    ctx->globals = NULL;
+    return ctx;
+}
+
+void deleteEvalContext(EvalContext *ctx) {
+    EvalContext *previous = useEvalContext(ctx);
+    releaseGlobalEnvironment();
+    useEvalContext(previous==ctx ? NULL : previous);
+    free(ctx);
+}
+
+EvalContext * useEvalContext(EvalContext *ctx) {
+    EvalContext *previous = currentContext;
+    currentContext = ctx;
+    if(ctx!=NULL) {
+        if(ctx->out!=NULL) out = ctx->out;
+        if(ctx->errOut!=NULL) errOut = ctx->errOut;
+    }
+    return previous;
+}
+
+void setHashConsing(int enabled) {
+    context()->hashConsing = enabled;
+}
+
+void setStrategy(EvalStrategy strategy) {
+    context()->strategy = strategy;
+}
+
+void setBudget(const Budget *budget) {
+    context()->budget = budget!=NULL ? *budget : unlimited;
+}
+
+void setHeapSize(size_t environments) {
+    context()->heapSize = environments;
+}
+
+void setParallel(int workers, int threshold) {
+    if(workers!=par_workers()) {
+        if(workers>0) {
+            par_start(workers,releaseWorkerContext);
+        } else {
+            par_stop();
+        }
+    }
+    context()->parallelThreshold = par_workers()>0 ? threshold : 0;
+}
+
+Engine * lookupEngine(const char *name) {
+    int i;
+    for(i=0;i<ENGINE_NUM;i++) {
+        if(strcmp(name,engineList[i].name)==0) {
+            return &engineList[i];
+        }
+    }
+    return NULL;
+}
+
+Engine * engines(int *size) {
+    *size = ENGINE_NUM;
+    return engineList;
+}
+
+void setEngine(Engine *engine) {
+    context()->engine = engine;
+}
 
 TreeNode * evaluate(TreeNode *expr) {
-    State * state = cek_newState();
-    state->closure = cek_newClosure(expr,buildGlobalEnvironment());
+    return evaluateIn(expr,globalEnvironment());
+}
+
+TreeNode * evaluateIn(TreeNode *expr, Environment *globals) {
+#ifdef EVAL_STATS
+    double start = seconds();
+    TreeNode *result = context()->engine->evaluate(expr,globals);
+    evalStats.evaluations++;
+    evalStats.seconds += seconds()-start;
+    return result;
+#else
+    return context()->engine->evaluate(expr,globals);
+#endif
+}
+
+#ifdef EVAL_STATS
+THREAD_LOCAL EvalStats evalStats;
+#endif
+
+void getEvalStats(EvalStats *stats) {
+#ifdef EVAL_STATS
+    *stats = evalStats;
+#else
+    memset(stats,0,sizeof(EvalStats));
+#endif
+}
+
+void resetEvalStats(void) {
+#ifdef EVAL_STATS
+    memset(&evalStats,0,sizeof(EvalStats));
+#endif
+}
+
+void addEvalStats(EvalStats *total, const EvalStats *stats) {
+    total->evaluations += stats->evaluations;
+    total->lookups += stats->lookups;
+    total->swaps += stats->swaps;
+    total->betas += stats->betas;
+    total->operands += stats->operands;
+    total->primitives += stats->primitives;
+    total->updates += stats->updates;
+    total->links += stats->links;
+    total->nodesAllocated += stats->nodesAllocated;
+    total->nodesFreed += stats->nodesFreed;
+    total->alphaConversions += stats->alphaConversions;
+    if(stats->peakDepth>total->peakDepth) {
+        total->peakDepth = stats->peakDepth;
+    }
+    total->seconds += stats->seconds;
+}
+
+void printEvalStats(const EvalStats *stats, FILE *stream) {
+    fprintf(stream,"evaluations\t%lu\n",stats->evaluations);
+    fprintf(stream,"lookups\t%lu\n",stats->lookups);
+    fprintf(stream,"swaps\t%lu\n",stats->swaps);
+    fprintf(stream,"betas\t%lu\n",stats->betas);
+    fprintf(stream,"operands\t%lu\n",stats->operands);
+    fprintf(stream,"primitives\t%lu\n",stats->primitives);
+    fprintf(stream,"updates\t%lu\n",stats->updates);
+    fprintf(stream,"links\t%lu\n",stats->links);
+    fprintf(stream,"nodes_allocated\t%lu\n",stats->nodesAllocated);
+    fprintf(stream,"nodes_freed\t%lu\n",stats->nodesFreed);
+    fprintf(stream,"alpha_conversions\t%lu\n",stats->alphaConversions);
+    fprintf(stream,"peak_depth\t%lu\n",stats->peakDepth);
+    fprintf(stream,"seconds\t%.6f\n",stats->seconds);
+}
+
+/*
+ * Evaluates the expression with the CEK machine, within the budget of the
+ * context.
+ */
+static TreeNode * cekEvaluate(TreeNode *expr, Environment *globals) {
+    Evaluation *evaluation = newEvaluation(expr,globals);
+    TreeNode *result = NULL;
+    if(resumeEvaluation(evaluation,&context()->budget)==EvalSuspended) {
+        fprintf(errOut,"Error: evaluation stopped after %ld steps, out of %s.\n",
+                evaluation->steps,evaluation->exhausted);
+    } else {
+        result = evaluationResult(evaluation);
+    }
+    deleteEvaluation(evaluation);
+    return result;
+}
+
+/* Evaluates the expression by substitution with the CC machine. */
+static TreeNode * ccEvaluate(TreeNode *expr, Environment *globals) {
+    CcState *state = cc_newState();
+    TreeNode *result = NULL;
+    Meter meter;
+    startMeter(&meter);
+    // the machine changes the tree in place, so it needs a copy of its own
+    state->controlStr = duplicateTree(expr);
+    deleteTree(expr);
+    if(state->controlStr!=NULL && cc_run(state,globals,&meter)) {
+        result = substitutionResult(state->controlStr,globals);
+    }
+    cc_cleanup(state);
+    return result;
+}
+
+/* Evaluates the expression by substitution with the CK machine. */
+static TreeNode * ckEvaluate(TreeNode *expr, Environment *globals) {
+    CkState *state = ck_newState();
+    TreeNode *result = NULL;
+    Meter meter;
+    startMeter(&meter);
+    state->controlStr = duplicateTree(expr);
+    deleteTree(expr);
+    if(state->controlStr!=NULL && ck_run(state,globals,&meter)) {
+        result = substitutionResult(state->controlStr,globals);
+    }
+    ck_cleanup(state);
+    return result;
+}
+
+/*
+ * Reads back the value of a substitution machine, replacing the globals
+ * still free in it like the CEK machine does. The value is not consumed.
+ */
+static TreeNode * substitutionResult(TreeNode *value, Environment *globals) {
+    if(!db_resolve(value,globals)) return NULL;
+    TreeNode *result = readback(value,globals,0);
+    if(result!=NULL && context()->hashConsing) {
+        result = hc_shareTree(result);
+    }
+    return result;
+}
+
+/*
+ * Evaluates the expression by name with the Krivine machine, which uses the
+ * state, the frames and the environments of the CEK machine.
+ */
+static TreeNode * krivineEvaluate(TreeNode *expr, Environment *globals) {
+    State *state = cek_newState();
+    TreeNode *result = NULL;
+    Meter meter;
+    int resolved = db_resolve(expr,globals);
+    startMeter(&meter);
+    cek_setClosure(&state->closure,expr,globals);
+    if(resolved && runKrivine(state,&meter)) {
+        // the bindings are the arguments, read back without evaluating them
+        result = readback(state->closure.expr,state->closure.env,0);
+        if(result!=NULL && context()->hashConsing) {
+            result = hc_shareTree(result);
+        }
+    }
+    cek_cleanup(state);
+    return result;
+}
+
+/*
+ * Runs the Krivine machine until the closure is a value applied to nothing.
+ * The continuation is the stack of the arguments, in ArgKK frames, which
+ * are bound as they are, and a variable enters the closure it is bound to
+ * on every lookup. Primitives are strict: their operands are evaluated in
+ * OpdKK and OprKK frames, like the CEK machine does. Every transition is
+ * a step of the meter. Returns 0 on errors and once the budget is
+ * exhausted.
+ */
+static int runKrivine(State *state, Meter *meter) {
+    Continuation * ctn = NULL;
+    Closure closure;
+    Environment *binding = NULL;
+    TreeNode *node = NULL;
+    while(1) {
+        if(!meterStep(meter,state->depth)) {
+            return 0;
+        }
+        ctn = cek_top(state);
+        node = state->closure.expr;
+        if(node->kind==IdK) {
+            EVAL_COUNT(lookups);
+            binding = lookupBinding(node->index,state->closure.env);
+            if(binding==NULL) {
+                fprintf(errOut, "Error: %s is not a defined variable or function.\n", node->name);
+                return 0;
+            }
+            // the binding may only be reachable from the closure it replaces
+            closure = state->closure;
+            cek_setClosure(&state->closure,retainTree(binding->closure.expr),
+                    binding->closure.env);
+            cek_clearClosure(&closure);
+        } else if(node->kind==AppK) {
+            ctn = cek_push(state,ArgKK);
+            if(ctn==NULL) return 0;
+            cek_setClosure(&ctn->closure,retainTree(node->children[1]),state->closure.env);
+            PUSHED(state);
+            state->closure.expr = retainTree(node->children[0]);
+            deleteTree(node);
+        } else if(node->kind==PrimiK) {
+            ctn = cek_push(state,OpdKK);
+            if(ctn==NULL) return 0;
+            ctn->closure = state->closure;
+            PUSHED(state);
+            cek_setClosure(&state->closure,retainTree(node->children[0]),ctn->closure.env);
+        } else if(ctn==NULL) {
+            return 1;
+        } else if(ctn->tag==ArgKK) {
+            EVAL_COUNT(betas);
+            if(!applyClosure(&state->closure,&ctn->closure,BoundThunk,&state->closure)) {
+                return 0;
+            }
+            cek_pop(state);
+        } else if(ctn->tag==OpdKK) {
+            EVAL_COUNT(operands);
+            ctn->tag = OprKK;
+            ctn->value = state->closure;
+            cek_setClosure(&state->closure,retainTree(ctn->closure.expr->children[1]),
+                    ctn->closure.env);
+        } else if(ctn->tag==OprKK) {
+            if(ctn->value.expr->kind!=ConstK || node->kind!=ConstK) {
+                fprintf(errOut, "Error: %s can only be applied on constants.\n", ctn->closure.expr->name);
+                return 0;
+            }
+            EVAL_COUNT(primitives);
+            TreeNode *tmp = evalPrimitive(ctn->closure.expr->name,ctn->value.expr,node);
+            if(tmp==NULL) {
+                return 0;
+            }
+            cek_clearClosure(&state->closure);
+            state->closure.expr = tmp;
+            cek_clearClosure(&ctn->value);
+            cek_clearClosure(&ctn->closure);
+            cek_pop(state);
+        } else {
+            fprintf(errOut,"Error: Unknown continuation tag.\n");
+            return 0;
+        }
+    }
+}
+
+static Evaluation * newEvaluation(TreeNode *expr, Environment *globals) {
+    Evaluation *evaluation = malloc(sizeof(Evaluation));
+    PoolStats stats;
+    pool_getStats(&stats);
+    evaluation->status = EvalSuspended;
+    evaluation->strategy = context()->strategy;
+    evaluation->hashConsing = context()->hashConsing;
+    evaluation->steps = 0;
+    evaluation->baseBytes = stats.bytesInUse;
+    evaluation->exhausted = NULL;
+    evaluation->heap = context()->heapSize>0 ? cek_newHeap(context()->heapSize) : NULL;
+
+    if(expr==NULL || !db_resolve(expr,globals)) {
+        evaluation->status = EvalFailed;
+    } else if(evaluation->hashConsing) {
+        expr = hc_shareTree(expr);
+    }
+    evaluation->state = cek_newState();
+    cek_setClosure(&evaluation->state->closure,expr,globals);
+    return evaluation;
+}
+
+Evaluation * startEvaluation(TreeNode *expr) {
+    return newEvaluation(expr,globalEnvironment());
+}
+
+EvalStatus resumeEvaluation(Evaluation *evaluation, const Budget *budget) {
+    if(evaluation->status==EvalSuspended) {
+        runMachine(evaluation,budget!=NULL ? budget : &unlimited);
+    }
+    return evaluation->status;
+}
+
+TreeNode * evaluationResult(Evaluation *evaluation) {
+    TreeNode *result = NULL;
+    if(evaluation->status==EvalDone) {
+        result = evaluation->state->closure.expr;
+        evaluation->state->closure.expr = NULL;
+    }
+    return result;
+}
+
+long evaluationSteps(Evaluation *evaluation) {
+    return evaluation->steps;
+}
+
+void deleteEvaluation(Evaluation *evaluation) {
+    cancelSpeculations(evaluation->state);
+    cek_cleanup(evaluation->state);
+    cek_deleteHeap(evaluation->heap);
+    free(evaluation);
+}
+
+static double seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+void startMeter(Meter *meter) {
+    const Budget *budget = &context()->budget;
+    PoolStats stats;
+    pool_getStats(&stats);
+    meter->steps = 0;
+    meter->fuel = budget->steps>0 ? budget->steps : -1;
+    meter->frames = budget->frames;
+    meter->deadline = budget->seconds>0 ? seconds()+budget->seconds : 0.0;
+    meter->maxBytes = budget->bytes>0 ? stats.bytesInUse+budget->bytes : 0;
+    meter->exhausted = NULL;
+}
+
+int meterStep(Meter *meter, long depth) {
+    PoolStats stats;
+    if(meter->exhausted!=NULL) return 0;
+    if(meter->steps==meter->fuel) {
+        meter->exhausted = "steps";
+    } else if(meter->frames>0 && depth>meter->frames) {
+        meter->exhausted = "frames";
+    } else if((++meter->steps&CHECK_MASK)==0) {
+        if(meter->deadline>0 && seconds()>=meter->deadline) {
+            meter->exhausted = "time";
+        } else if(meter->maxBytes>0) {
+            pool_getStats(&stats);
+            if(stats.bytesInUse>meter->maxBytes) {
+                meter->exhausted = "memory";
+            }
+        }
+    }
+    if(meter->exhausted!=NULL) {
+        fprintf(errOut,"Error: evaluation stopped after %ld steps, out of %s.\n",
+                meter->steps,meter->exhausted);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Runs the machine until the evaluation ends or the budget is exhausted.
+ * The machine is only suspended between steps, so the state is complete
+ * and the evaluation can go on later.
+ */
+static EvalStatus runMachine(Evaluation *evaluation, const Budget *budget) {
+    State *state = evaluation->state;
+    EvalStrategy strategy = evaluation->strategy;
+    int hashConsing = evaluation->hashConsing;
+    int threshold = par_workers()>0 ? context()->parallelThreshold : 0;
+    int worker = par_isWorker();
+    long steps = evaluation->steps;
+    long fuel = budget->steps>0 ? steps+budget->steps : -1;
+    long frames = budget->frames>0 ? budget->frames : LONG_MAX;
+    double deadline = budget->seconds>0 ? seconds()+budget->seconds : 0.0;
+    long joined = 0;
+    Budget left;
+    PoolStats stats;
+    Heap *heap = evaluation->heap;
+    Heap *previousHeap = cek_useHeap(heap);
+    evaluation->exhausted = NULL;
 
     int error = 0;
     Continuation * ctn = NULL;
-    Closure *closure = NULL;
-    Environment *env = NULL;
+    Closure closure;
+    Environment *binding = NULL;
+    TreeNode *node = NULL;
     while(!cek_canTerminate(state)) {
-        if(state->closure->expr->kind==IdK) {
+        if(steps==fuel) {
+            evaluation->exhausted = "steps";
+            break;
+        }
+        if(state->depth>frames) {
+            evaluation->exhausted = "frames";
+            break;
+        }
+        if((++steps&CHECK_MASK)==0) {
+            if(worker && par_cancelled()) {
+                error = 1;
+                break;
+            }
+            if(deadline>0 && seconds()>=deadline) {
+                evaluation->exhausted = "time";
+                break;
+            }
+            if(budget->bytes>0) {
+                pool_getStats(&stats);
+                if(stats.bytesInUse>evaluation->baseBytes+budget->bytes) {
+                    evaluation->exhausted = "memory";
+                    break;
+                }
+            }
+        }
+        if(cek_heapFull(heap)) {
+            cek_collect(heap,state);
+        }
+        ctn = cek_top(state);
+        if(state->closure.expr->kind==IdK) {
             // Find mapped closure from the evironment
-            closure = lookupVariable(state->closure->expr->name,state->closure->env);
-            if(closure==NULL) {
-                fprintf(errOut, "Error: %s is not a defined variable or function.\n", state->closure->expr->name);
+            EVAL_COUNT(lookups);
+            binding = lookupBinding(state->closure.expr->index,state->closure.env);
+            if(binding==NULL) {
+                fprintf(errOut, "Error: %s is not a defined variable or function.\n", state->closure.expr->name);
                 error = 1;
                 break;
             } else {
-                /*
-                 * Should not use the found closure directly, because it will
-                 * be deleted after evaluted and the mapped id may be used
-                 * again afterwards. So does the expression in it.
-                 */
-                closure = cek_newClosure(duplicateTree(closure->expr),closure->env);
-                // replace the closure with mapped closure.
-                deleteTreeNode(state->closure->expr);
-                cek_deleteClosure(state->closure);
-                state->closure = closure;
+                if(binding->kind==BoundThunk) {
+                    // evaluate the argument, then update the binding
+                    ctn = cek_push(state,UpdKK);
+                    if(ctn==NULL) {
+                        error = 1;
+                        break;
+                    }
+                    ctn->binding = binding;
+                    binding->refCount += 1;
+                    PUSHED(state);
+                }
+                // Trees are never changed by the machine, so the mapped
+                // expression is shared instead of copied. The binding may
+                // only be reachable from the closure it replaces.
+                closure = state->closure;
+                cek_setClosure(&state->closure,retainTree(binding->closure.expr),
+                        binding->closure.env);
+                cek_clearClosure(&closure);
             }
-        } else if(isValue(state->closure->expr)) {
-            if(state->continuation==NULL) {
+        } else if(isValue(state->closure.expr)) {
+            if(ctn==NULL && strategy==CallByNeed) {
+                // evaluate the thunks the value refers to before reading it back
+                ctn = cek_push(state,ReadKK);
+                if(ctn==NULL) {
+                    error = 1;
+                    break;
+                }
+                cek_setClosure(&ctn->closure,retainTree(state->closure.expr),
+                        state->closure.env);
+                PUSHED(state);
+                if(!pushThunks(state,state->closure.expr,state->closure.env)) {
+                    error = 1;
+                    break;
+                }
+            } else if(ctn==NULL || ctn->tag==ReadKK) {
+                if(ctn!=NULL) {
+                    // the thunks are evaluated, read back the value kept
+                    cek_clearClosure(&state->closure);
+                    state->closure = ctn->closure;
+                    cek_pop(state);
+                }
                 // if the control string is an abstraction, need to substitute
                 // free variables in it using the environment for it.
-                TreeNode *tmp = resolveFreeVariables(state->closure->expr,state->closure->env);
+                TreeNode *tmp = readback(state->closure.expr,state->closure.env,0);
                 if(tmp==NULL) {
                     error = 1;
                 }else {
-                    state->closure->expr = tmp;
+                    deleteTree(state->closure.expr);
+                    state->closure.expr = hashConsing ? hc_shareTree(tmp) : tmp;
                 }
                 break;
-            } else if(state->continuation->tag==FunKK) {
+            } else if(ctn->tag==FunKK) {
                 // pop the continuation
-                ctn = state->continuation;
-                if(ctn->closure->expr->kind==ConstK) {
-                    fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
-                    fprintf(errOut, "Expression:\t");
-                    printExpression(ctn->closure->expr,errOut);
-                    fprintf(errOut,"\n");
+                EVAL_COUNT(betas);
+                if(!applyClosure(&ctn->closure,&state->closure,BoundValue,&state->closure)) {
                     error = 1;
                     break;
-                }else if(ctn->closure->expr->kind==IdK) {
-                    // This should never happen
+                }
+                cek_pop(state);
+            } else if(ctn->tag==UpdKK) {
+                // replace the thunk by its value
+                EVAL_COUNT(updates);
+                binding = ctn->binding;
+                cek_pop(state);
+                closure = binding->closure;
+                cek_setClosure(&binding->closure,retainTree(state->closure.expr),state->closure.env);
+                binding->kind = BoundValue;
+                cek_clearClosure(&closure);
+                cek_releaseEnvironment(binding);
+            } else if(ctn->tag==ForceKK) {
+                binding = ctn->binding;
+                if(binding->kind==BoundThunk) {
+                    // evaluate it, then come back to look into its value
+                    ctn = cek_push(state,UpdKK);
+                    if(ctn==NULL) {
+                        error = 1;
+                        break;
+                    }
+                    ctn->binding = binding;
+                    binding->refCount += 1;
+                    PUSHED(state);
+                    cek_clearClosure(&state->closure);
+                    cek_setClosure(&state->closure,retainTree(binding->closure.expr),
+                            binding->closure.env);
                 } else {
-                    state->continuation = ctn->next;
-                    env = cek_newEnvironment(ctn->closure->expr->children[0]->name,state->closure,ctn->closure->env);
-                    state->closure = cek_newClosure(ctn->closure->expr->children[1],env);
-                    ctn->closure->expr->children[1] = NULL;
-                    deleteTree(ctn->closure->expr);
-                    cek_deleteClosure(ctn->closure);
-                    cek_deleteContinuation(ctn);
+                    cek_pop(state);
+                    if(!pushThunks(state,binding->closure.expr,binding->closure.env)) {
+                        error = 1;
+                    }
+                    cek_releaseEnvironment(binding);
+                    if(error) break;
+                }
+            } else if(strategy==CallByNeed && ctn->tag==ArgKK) {
+                // bind the argument without evaluating it
+                EVAL_COUNT(betas);
+                if(!applyClosure(&state->closure,&ctn->closure,
+                        isValue(ctn->closure.expr) ? BoundValue : BoundThunk,&state->closure)) {
+                    error = 1;
+                    break;
                 }
-            } else if(state->continuation->tag==OprKK) {
-                ctn = state->continuation;
+                cek_pop(state);
+            } else if(ctn->tag==OprKK) {
                 // only perform primitive operation if operands are constants
-                if(ctn->closure->expr->children[0]->kind==ConstK 
-                    && state->closure->expr->kind==ConstK) {
-                    state->continuation = ctn->next;
-                    // reattach the second operand
-                    ctn->closure->expr->children[1] = state->closure->expr;
-                    TreeNode* tmp  = evalPrimitive(ctn->closure->expr);
-                    cek_deleteClosure(state->closure);
-                    state->closure = cek_newClosure(tmp,NULL);
-
-                    deleteTree(ctn->closure->expr);
-                    cek_deleteClosure(ctn->closure);
-                    cek_deleteContinuation(ctn);
+                if(ctn->value.expr->kind==ConstK 
+                    && state->closure.expr->kind==ConstK) {
+                    EVAL_COUNT(primitives);
+                    TreeNode* tmp  = evalPrimitive(ctn->closure.expr->name,
+                            ctn->value.expr,state->closure.expr);
+                    // the closure of the operand is reused for the result
+                    cek_clearClosure(&state->closure);
+                    state->closure.expr = tmp;
+
+                    cek_clearClosure(&ctn->value);
+                    cek_clearClosure(&ctn->closure);
+                    cek_pop(state);
+                    if(tmp==NULL) {
+                        error = 1;
+                        break;
+                    }
                 } else {
-                    fprintf(errOut, "Error: %s can only be applied on constants.\n", ctn->closure->expr->name);
+                    fprintf(errOut, "Error: %s can only be applied on constants.\n", ctn->closure.expr->name);
                     error = 1;
                     break;
                 }
-            } else if(state->continuation->tag==ArgKK) {
-                state->continuation->tag = FunKK;
+            } else if(ctn->tag==ArgKK) {
+                EVAL_COUNT(swaps);
+                if(ctn->speculation!=NULL
+                        && (joined = joinSpeculation(ctn,hashConsing,&closure))>=0) {
+                    // the argument is evaluated already, in that many steps
+                    steps += joined;
+                    cek_clearClosure(&ctn->closure);
+                    ctn->closure = closure;
+                }
+                ctn->tag = FunKK;
                 // switch current closure with that in continuation
                 closure = state->closure;
-                state->closure = state->continuation->closure;
-                state->continuation->closure = closure;
-            } else if(state->continuation->tag==OpdKK) {
-                state->continuation->tag = OprKK;
-                // switch environment and expression
-                env = state->continuation->closure->env;
-                state->continuation->closure->env = state->closure->env;
-                state->closure->env = env;
-                // attach the expression back to the PrimiK node
-                state->continuation->closure->expr->children[0] = state->closure->expr;
-                state->closure->expr = state->continuation->closure->expr->children[1];
-                // dettach the operand from PrimiK node
-                state->continuation->closure->expr->children[1] = NULL;
+                state->closure = ctn->closure;
+                ctn->closure = closure;
+            } else if(ctn->tag==OpdKK) {
+                EVAL_COUNT(operands);
+                ctn->tag = OprKK;
+                // keep the first operand and evaluate the second one
+                ctn->value = state->closure;
+                node = ctn->closure.expr;
+                cek_setClosure(&state->closure,retainTree(node->children[1]),ctn->closure.env);
             } else {
                 fprintf(errOut,"Error: Unknown continuation tag.\n");
                 error = 1;
                 break;
             }
-        } else if(state->closure->expr->kind==AppK) {
-            ctn = cek_newContinuation(ArgKK);
-            ctn->closure = cek_newClosure(state->closure->expr->children[1],state->closure->env);
-            ctn->next = state->continuation;
-            state->continuation = ctn;
-            TreeNode *tmp = state->closure->expr;
-            state->closure->expr = tmp->children[0];
-            deleteTreeNode(tmp);
-        } else if(state->closure->expr->kind==PrimiK) {
-            ctn = cek_newContinuation(OpdKK);
+        } else if(state->closure.expr->kind==AppK) {
+            node = state->closure.expr;
+            ctn = cek_push(state,ArgKK);
+            if(ctn==NULL) {
+                error = 1;
+                break;
+            }
+            cek_setClosure(&ctn->closure,retainTree(node->children[1]),state->closure.env);
+            if(threshold>0 && strategy==CallByValue
+                    && budgetLeft(evaluation,budget,fuel,&left)) {
+                ctn->speculation = speculate(node->children[1],state->closure.env,
+                        threshold,&left,deadline);
+            }
+            PUSHED(state);
+            state->closure.expr = retainTree(node->children[0]);
+            deleteTree(node);
+        } else if(state->closure.expr->kind==PrimiK) {
+            node = state->closure.expr;
+            ctn = cek_push(state,OpdKK);
+            if(ctn==NULL) {
+                error = 1;
+                break;
+            }
             ctn->closure = state->closure;
-            ctn->next = state->continuation;
-            state->continuation = ctn;
-            state->closure = cek_newClosure(state->closure->expr->children[0],state->closure->env);
-            state->closure->expr->children[0] = NULL;   // dettach
+            PUSHED(state);
+            cek_setClosure(&state->closure,retainTree(node->children[0]),ctn->closure.env);
         }
     }
 
-    TreeNode* result = NULL;
-    if(!error) {
-        result = state->closure->expr;
-        state->closure->expr = NULL;
+    cek_useHeap(previousHeap);
+    evaluation->steps = steps;
+    if(error) {
+        evaluation->status = EvalFailed;
+    } else if(evaluation->exhausted!=NULL && !cek_canTerminate(state)) {
+        evaluation->status = EvalSuspended;
+    } else {
+        evaluation->status = EvalDone;
+        evaluation->exhausted = NULL;
     }
-    cek_cleanup(state);
-    return result;
+    return evaluation->status;
 }
 
 TreeNode * alphaConversion(TreeNode *expr) {
@@ -153,29 +785,56 @@ TreeNode * alphaConversion(TreeNode *expr) {
         return expr;
     }
 
+    EVAL_COUNT(alphaConversions);
     VarSet* set = FV(expr->children[1]);
-    char *name = NULL;
+    if(set==NULL) {
+        deleteTree(expr);
+        return NULL;
+    }
+    char *candidate = NULL;
+    const char *name = NULL;
     int len = strlen(expr->children[0]->name);
     int attempts = 0;
     // pick a new name
     do {
-        if(name!=NULL) free(name);  // free the last attempt
+        if(candidate!=NULL) free(candidate);  // free the last attempt
         attempts++;
-        name = malloc(len+attempts);
-        strcpy(name,expr->children[0]->name);
+        candidate = malloc(len+attempts+1);
+        if(candidate==NULL) {
+            fprintf(errOut,"Out of memory.\n");
+            deleteTree(expr);
+            return NULL;
+        }
+        strcpy(candidate,expr->children[0]->name);
         int a;
         // append '_' to the original name
         for(a=0;a<attempts;a++) {
-            strcat(name,"_");
+            strcat(candidate,"_");
+        }
+        name = sym_intern(candidate);
+        if(name==NULL) {
+            free(candidate);
+            deleteTree(expr);
+            return NULL;
         }
-    } while(strcmp(name,expr->children[0]->name)==0 || contains(set,name)==1);
+    } while(name==expr->children[0]->name || contains(set,name)==1);
+    free(candidate);
 
     TreeNode *var = newTreeNode(IdK);
+    if(var==NULL) {
+        deleteTree(expr);
+        return NULL;
+    }
     var->name = name;
     TreeNode *result = substitute(expr->children[1], expr->children[0], var);
     expr->children[1] = result;
     deleteTree(expr->children[0]);
     expr->children[0] = var;
+    forgetFV(expr);
+    if(result==NULL) {
+        deleteTree(expr);
+        return NULL;
+    }
     return expr;
 }
 
@@ -199,132 +858,496 @@ TreeNode * betaReduction(TreeNode *expr) {
     return expr;
 }
 
+TreeNode * normalOrderReduction(TreeNode *expr, long limit, long *steps) {
+    int reduced = 1;
+    *steps = 0;
+    while((limit<0 || *steps<limit) && (reduced = reduceStep(&expr))>0) {
+        *steps += 1;
+    }
+    if(reduced<0) {
+        deleteTree(expr);
+        return NULL;
+    }
+    return expr;
+}
+
 /* == Definitions of the local functions. */
-/* Gets the free variables in the expression. */ 
+/*
+ * Gets the free variables in the expression. The set is computed once and
+ * cached in the node, so it must not be changed or deleted by the caller.
+ * Returns NULL if there is not enough memory.
+ */ 
 static VarSet * FV(TreeNode *expr) {
-    VarSet* set = NULL;
-    VarSet* set1 = NULL;
-    VarSet* set2 = NULL;
-    switch(expr->kind) {
-        case IdK:
-            set = newVarSet();
-            addVar(set,expr->name);
-            break;
-        case ConstK:
-            set = newVarSet();
-            break;
-        case AbsK:
-            set = FV(expr->children[1]);
-            deleteVar(set,expr->children[0]->name);
-            break;
-        case AppK:
-        case PrimiK:
-            set = newVarSet();
-            set1 = FV(expr->children[0]);
-            set2 = FV(expr->children[1]);
-            unionVarSet(set,set1,set2);
-            deleteVarSet(set1);
-            deleteVarSet(set2);
-            break;
-        default:
-            fprintf(errOut,"Unknown expression type.\n");
+    Stack stack;
+    TreeNode **top;
+    if(expr->fv!=NULL) return expr->fv;
+
+    // a node is popped once the sets of its children are cached
+    initStack(&stack,sizeof(TreeNode*));
+    *(TreeNode**)pushStack(&stack) = expr;
+    while((top = topStack(&stack))!=NULL) {
+        TreeNode **slot = NULL;
+        TreeNode *node = *top;
+        VarSet* set = NULL;
+        if(node->fv!=NULL) {    // a shared subtree, already done
+            popStack(&stack);
+            continue;
+        }
+        switch(node->kind) {
+            case IdK:
+                set = newVarSet();
+                addVar(set,node->name);
+                break;
+            case ConstK:
+                set = newVarSet();
+                break;
+            case AbsK:
+                if(node->children[1]->fv==NULL) {
+                    if((slot = pushStack(&stack))==NULL) break;
+                    *slot = node->children[1];
+                    continue;
+                }
+                set = vs_copy(node->children[1]->fv);
+                deleteVar(set,node->children[0]->name);
+                break;
+            case AppK:
+            case PrimiK:
+                if(node->children[0]->fv==NULL || node->children[1]->fv==NULL) {
+                    if((slot = pushStack(&stack))==NULL) break;
+                    *slot = node->children[1];
+                    if((slot = pushStack(&stack))==NULL) break;
+                    *slot = node->children[0];
+                    continue;
+                }
+                set = newVarSet();
+                unionVarSet(set,node->children[0]->fv,node->children[1]->fv);
+                break;
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+                set = newVarSet();
+        }
+        if(set==NULL) {
+            // out of memory
+            freeStack(&stack);
+            return NULL;
+        }
+        node->fv = set;
+        popStack(&stack);
     }
-    return set;
+    freeStack(&stack);
+    return expr->fv;
+}
+
+/* Drops the cached free variables after the children are changed. */
+static void forgetFV(TreeNode *expr) {
+    deleteVarSet(expr->fv);
+    expr->fv = NULL;
 }
 
-/* Performs substitution on the expression. */
+/*
+ * Performs substitution on the expression. If there is not enough memory,
+ * deletes the expression and returns NULL.
+ */
 static TreeNode *substitute(TreeNode *expr, TreeNode *var, TreeNode *sub) {
+    Stack stack;
+    TreeNode ***top;
+    TreeNode ***slot;
+    int failed = 0;
     if(expr==NULL || var==NULL || sub==NULL) return expr;
 
     if(var->kind!=IdK) {
         fprintf(errOut,"The replaced expression is not a variable.\n");
         return expr;
     }
-    const char * parname = NULL;
-    TreeNode * result = NULL;
-    switch(expr->kind) {
-        case IdK:
-            if(strcmp(expr->name,var->name)==0) {
-                deleteTree(expr);
-                return duplicateTree(sub);
-            }else {
-                return expr;
+    // the places of the subexpressions left, which are replaced in place
+    initStack(&stack,sizeof(TreeNode**));
+    *(TreeNode***)pushStack(&stack) = &expr;
+    while(!failed && (top = popStack(&stack))!=NULL) {
+        TreeNode **place = *top;
+        TreeNode *node = *place;
+        const char * parname = NULL;
+        VarSet *set = FV(node);
+        if(set==NULL) {
+            failed = 1;
+            break;
+        }
+        // nothing to do if the variable doesn't occur free
+        if(!contains(set,var->name)) continue;
+
+        switch(node->kind) {
+            case IdK:
+                if(node->name==var->name) {
+                    deleteTree(node);
+                    *place = duplicateTree(sub);
+                    failed = *place==NULL;
+                }
+                break;
+            case ConstK:
+                break;
+            case AbsK:
+                parname = node->children[0]->name;
+                if(parname!=var->name) {
+                    set = FV(sub);
+                    while(set!=NULL && node!=NULL && contains(set,parname)) {
+                        // do alpha conversion
+                        node = alphaConversion(node);
+                        parname = node!=NULL ? node->children[0]->name : NULL;
+                    }
+                    *place = node;
+                    if(set==NULL || node==NULL) {
+                        failed = 1;
+                        break;
+                    }
+                    forgetFV(node);
+                    if((slot = pushStack(&stack))==NULL) {
+                        failed = 1;
+                        break;
+                    }
+                    *slot = &node->children[1];
+                }
+                break;
+            case AppK:
+            case PrimiK:
+                forgetFV(node);
+                if((slot = pushStack(&stack))==NULL) {
+                    failed = 1;
+                    break;
+                }
+                *slot = &node->children[1];
+                if((slot = pushStack(&stack))==NULL) {
+                    failed = 1;
+                    break;
+                }
+                *slot = &node->children[0];
+                break;
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+        }
+    }
+    freeStack(&stack);
+    if(failed) {
+        // the subexpressions which couldn't be made are NULL
+        deleteTree(expr);
+        return NULL;
+    }
+    return expr;
+}
+
+/* A node on the path searched by reduceStep(). */
+typedef struct {
+    TreeNode **place;
+    int child;      // the next child to search
+} StepItem;
+
+/*
+ * Performs the leftmost outermost reduction step in the expression, with
+ * betaReduction or a primitive on constants. Returns 0 if the expression
+ * is in normal form, and -1 if there is not enough memory, which may
+ * leave a NULL subexpression in it.
+ */
+
+static int reduceStep(TreeNode **expr) {
+    Stack stack;
+    StepItem *item;
+    int reduced = 0;
+    // the path from the root to the node searched, whose sets are forgotten
+    // if the step is found below them
+    initStack(&stack,sizeof(StepItem));
+    item = pushStack(&stack);
+    item->place = expr;
+    item->child = 0;
+    while((item = topStack(&stack))!=NULL) {
+        TreeNode **place = item->place;
+        TreeNode *node = *place;
+        TreeNode *tmp = NULL;
+        if(reduced) {
+            if(item->child>0) {
+                forgetFV(node);
+            }
+            popStack(&stack);
+            continue;
+        }
+        if(item->child==0) {
+            if(node->kind==AbsK) {
+                item->child = 2;
+                item = pushStack(&stack);
+                if(item==NULL) {
+                    reduced = -1;
+                    break;
+                }
+                item->place = &node->children[1];
+                item->child = 0;
+                continue;
             }
-        case ConstK:
-            return expr;
-        case AbsK:
-            parname = expr->children[0]->name;
-            if(strcmp(parname,var->name)!=0) {
-                VarSet* set = FV(sub); 
-                while(contains(set,parname)) {  // do alpha conversion
-                    expr = alphaConversion(expr);
-                    parname = expr->children[0]->name;
+            if(node->kind==AppK && node->children[0]->kind==AbsK) {
+                *place = betaReduction(node);
+                reduced = *place!=NULL ? 1 : -1;
+                if(reduced<0) break;
+                popStack(&stack);
+                continue;
+            }
+        }
+        if((node->kind==AppK || node->kind==PrimiK) && item->child<2) {
+            // reduce the children, from left to right
+            int child = item->child++;
+            item = pushStack(&stack);
+            if(item==NULL) {
+                reduced = -1;
+                break;
+            }
+            item->place = &node->children[child];
+            item->child = 0;
+            continue;
+        }
+        popStack(&stack);
+        if(node->kind==PrimiK && node->children[0]->kind==ConstK
+                && node->children[1]->kind==ConstK) {
+            tmp = evalPrimitive(node->name,node->children[0],node->children[1]);
+            if(tmp==NULL) continue;
+            if(tmp->refCount>1) {
+                // the reduction changes trees in place, so it needs a copy
+                TreeNode *copy = duplicateTree(tmp);
+                deleteTree(tmp);
+                tmp = copy;
+                if(tmp==NULL) {
+                    reduced = -1;
+                    break;
                 }
-                result = substitute(expr->children[1],var,sub);
-                expr->children[1] = result;
-                deleteVarSet(set);
             }
-            return expr;
-        case AppK:
-        case PrimiK:
-            result = substitute(expr->children[0],var,sub);
-            expr->children[0] = result;
-            result = substitute(expr->children[1],var,sub);
-            expr->children[1] = result;
-            return expr;
-        default:
-            fprintf(errOut,"Unknown expression type.\n");
+            deleteTree(node);
+            *place = tmp;
+            reduced = 1;
+        }
     }
-    return expr;
+    freeStack(&stack);
+    return reduced;
 }
 
 /*
- * Lookup closure by name in the environment or its parent.
+ * Lookup binding by de Bruijn index, skipping that many environments.
  */
-static Closure* lookupVariable(const char *name, Environment *env) {
-    if(env==NULL) return NULL;
-    if(strcmp(name,env->name)==0) {
-        return env->closure;
+static Environment* lookupBinding(int index, Environment *env) {
+    if(index<0) return NULL;
+    EVAL_ADD(links,index);
+    while(env!=NULL && index>0) {
+        env = env->parent;
+        index--;
     }
-    return lookupVariable(name,env->parent);
+    return env;
+}
+
+static Closure* lookupVariable(int index, Environment *env) {
+    env = lookupBinding(index,env);
+    return env==NULL ? NULL : &env->closure;
 }
 
 /*
- * Substitutes free variables in the expression using mappings in the
- * environment.
+ * Applies the abstraction in the function closure to the argument closure,
+ * and stores the closure of the body, which may replace one of them. Both
+ * closures are consumed. If the function is a constant, reports an error
+ * and returns 0 without consuming them.
  */
-static TreeNode* resolveFreeVariables(TreeNode *expr, Environment *env) {
-    // get the free variable set
-    VarSet* set = FV(expr);
-    VarSetList *list = vs_asList(set);
-    deleteVarSet(set);
-
-    TreeNode *result = expr;
-    Closure *closure = NULL;
-    VarSetList *l = list;
-    while(l!=NULL) {
-        closure = lookupVariable(l->name,env);
-        if(closure==NULL) {
-            fprintf(errOut,"Error: Variable %s is not defined.\n",l->name);
-            result = NULL;
-            break;
-        } else {
-            TreeNode *tmp = resolveFreeVariables(closure->expr,closure->env);
-            if(tmp==NULL) {
-                result = NULL;
+static int applyClosure(Closure *fun, Closure *arg, BindingKind kind, Closure *body) {
+    TreeNode *abs = fun->expr;
+    Environment *parent = fun->env;
+    if(abs->kind==ConstK) {
+        fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
+        fprintf(errOut, "Expression:\t");
+        printExpression(abs,errOut);
+        fprintf(errOut,"\n");
+        return 0;
+    }
+    Environment *env = cek_newEnvironment(abs->children[0]->name,*arg,parent);
+    env->kind = kind;
+    cek_setClosure(body,retainTree(abs->children[1]),env);
+    deleteTree(abs);
+    cek_releaseEnvironment(parent);
+    return 1;
+}
+
+/* A subexpression left to read back, or a node whose children are done. */
+typedef struct {
+    TreeNode *expr;         // NULL once the children are done
+    Environment *env;
+    int depth;
+    TreeNode **place;
+} ReadbackItem;
+
+/*
+ * Copies the expression, replacing the identifiers bound in the environment
+ * by their values. Depth is the number of abstractions entered in the copy,
+ * whose identifiers are kept. The values are closed terms, so no alpha
+ * conversion is needed. Subtrees that don't refer to the environment are
+ * shared instead of copied.
+ */
+static TreeNode* readback(TreeNode *expr, Environment *env, int depth) {
+    TreeNode *result = NULL;
+    Stack stack;
+    ReadbackItem *item;
+    initStack(&stack,sizeof(ReadbackItem));
+    item = pushStack(&stack);
+    item->expr = expr;
+    item->env = env;
+    item->depth = depth;
+    item->place = &result;
+    while((item = popStack(&stack))!=NULL) {
+        TreeNode **place = item->place;
+        TreeNode *node = NULL;
+        expr = item->expr;
+        env = item->env;
+        depth = item->depth;
+        if(expr==NULL) {
+            // the children of the node are read back
+            node = *place;
+            node->freeDepth = node->kind==AbsK
+                ? db_abstractionDepth(node->children[1]->freeDepth)
+                : db_applicationDepth(node->children[0]->freeDepth,
+                        node->children[1]->freeDepth);
+            continue;
+        }
+        // the value of an identifier is read back in its place
+        while(expr->kind==IdK && expr->freeDepth>depth) {
+            Closure *closure = lookupVariable(expr->index-depth,env);
+            if(closure==NULL) {
+                fprintf(errOut,"Error: Variable %s is not defined.\n",expr->name);
                 break;
             }
-            TreeNode *var = newTreeNode(IdK);
-            var->name = stringCopy(l->name);
-            result = substitute(result,var,tmp);
-            deleteTree(var);
+            expr = closure->expr;
+            env = closure->env;
+            depth = 0;
         }
-        l = l->next;
+        if(expr->freeDepth<=depth || expr->kind==ConstK) {
+            *place = retainTree(expr);
+            continue;
+        }
+        switch(expr->kind) {
+            case AbsK:
+                node = newTreeNode(AbsK);
+                node->children[0] = retainTree(expr->children[0]);
+                break;
+            case AppK:
+            case PrimiK:
+                node = newTreeNode(expr->kind);
+                node->name = expr->name;
+                break;
+            case IdK:
+                break;      // not defined
+            default:
+                fprintf(errOut,"Unknown expression type.\n");
+        }
+        if(node==NULL) {
+            freeStack(&stack);
+            deleteTree(result);
+            return NULL;
+        }
+        *place = node;
+        if((item = pushStack(&stack))==NULL) break;
+        item->expr = NULL;
+        item->place = place;
+        if((item = pushStack(&stack))==NULL) break;
+        item->expr = expr->children[1];
+        item->env = env;
+        item->depth = node->kind==AbsK ? depth+1 : depth;
+        item->place = &node->children[1];
+        if(node->kind!=AbsK) {
+            if((item = pushStack(&stack))==NULL) break;
+            item->expr = expr->children[0];
+            item->env = env;
+            item->depth = depth;
+            item->place = &node->children[0];
+        }
+    }
+    if(stack.size>0) {
+        // there is no memory to read back the rest
+        freeStack(&stack);
+        deleteTree(result);
+        return NULL;
     }
-    vs_deleteVarSetList(list);
+    freeStack(&stack);
     return result;
 }
 
+/*
+ * Pushes a ForceKK frame for each thunk that reading back the expression
+ * would print unevaluated, looking into the values bound in the
+ * environment like readback() does. Returns 0 if there is not enough
+ * memory.
+ */
+static int pushThunks(State *state, TreeNode *expr, Environment *env) {
+    Stack stack;
+    ReadbackItem *item;
+    int pushed = 1;
+    initStack(&stack,sizeof(ReadbackItem));
+    item = pushStack(&stack);
+    item->expr = expr;
+    item->env = env;
+    item->depth = 0;
+    while(pushed && (item = popStack(&stack))!=NULL) {
+        ReadbackItem next = *item;
+        while(next.expr->kind==IdK && next.expr->freeDepth>next.depth) {
+            Environment *binding = lookupBinding(next.expr->index-next.depth,next.env);
+            if(binding==NULL || binding->kind==BoundThunk) {
+                Continuation *ctn = binding==NULL ? NULL : cek_push(state,ForceKK);
+                if(ctn!=NULL) {
+                    ctn->binding = binding;
+                    binding->refCount += 1;
+                    PUSHED(state);
+                }
+                pushed = binding==NULL || ctn!=NULL;
+                break;
+            }
+            next.expr = binding->closure.expr;
+            next.env = binding->closure.env;
+            next.depth = 0;
+        }
+        if(next.expr->freeDepth<=next.depth || next.expr->kind==IdK
+                || next.expr->kind==ConstK) {
+            continue;
+        }
+        if((item = pushStack(&stack))==NULL) {
+            pushed = 0;
+            break;
+        }
+        item->expr = next.expr->children[1];
+        item->env = next.env;
+        item->depth = next.expr->kind==AbsK ? next.depth+1 : next.depth;
+        if(next.expr->kind!=AbsK) {
+            if((item = pushStack(&stack))==NULL) {
+                pushed = 0;
+                break;
+            }
+            item->expr = next.expr->children[0];
+            item->env = next.env;
+            item->depth = next.depth;
+        }
+    }
+    freeStack(&stack);
+    return pushed;
+}
+
+/*
+ * The global environment holding the builtin and standard functions is
+ * built on first use and pinned by an extra reference, so evaluations share
+ * it instead of expanding and parsing the prelude again. Every context has
+ * its own, so threads never share environments or trees.
+ */
+Environment * globalEnvironment(void) {
+    EvalContext *ctx = context();
+    if(ctx->globals==NULL) {
+        ctx->globals = buildGlobalEnvironment();
+        ctx->globals->refCount += 1;    // pinned, never freed by a closure
+    }
+    return ctx->globals;
+}
+
+void releaseGlobalEnvironment(void) {
+    EvalContext *ctx = context();
+    releaseSharedConstants();
+    if(ctx->globals==NULL) return;
+    cek_releaseEnvironment(ctx->globals);
+    ctx->globals = NULL;
+}
+
 static Environment *buildGlobalEnvironment() {
     Environment *ret = NULL;
     int size = 0;
@@ -332,14 +1355,279 @@ static Environment *buildGlobalEnvironment() {
     int i;
     for(i=0;i<size;i++) {
         BuiltinFun fun = funs[i];
-        ret = cek_newEnvironment(fun.name,cek_newClosure((fun.expandFun)(),NULL),ret);
+        TreeNode *expr = (fun.expandFun)();
+        db_resolve(expr,NULL);
+        ret = cek_newEnvironment(sym_intern(fun.name),(Closure){expr,NULL},ret);
     }
 
     StandardFun *stdFuns = standardFuns(&size);
     for(i=0;i<size;i++) {
         StandardFun fun = stdFuns[i];
-        ret = cek_newEnvironment(fun.name,cek_newClosure(expandStandardFun(&fun),NULL),ret);
+        TreeNode *expr = expandStandardFun(&fun);
+        db_resolve(expr,NULL);
+        ret = cek_newEnvironment(sym_intern(fun.name),(Closure){expr,NULL},ret);
     }
 
     return ret;
 }
+
+/*
+ * Appends the tree to the flat term, in preorder. Returns 0 if there is
+ * not enough memory.
+ */
+static int flatten(TreeNode *expr, FlatTerm *term) {
+    Stack stack;
+    TreeNode **top;
+    TreeNode **slot;
+    initStack(&stack,sizeof(TreeNode*));
+    *(TreeNode**)pushStack(&stack) = expr;
+    while((top = popStack(&stack))!=NULL) {
+        expr = *top;
+        if(term->size==term->capacity) {
+            int capacity = term->capacity==0 ? 64 : term->capacity*2;
+            FlatNode *nodes = realloc(term->nodes,capacity*sizeof(FlatNode));
+            if(nodes==NULL) {
+                fprintf(errOut,"Out of memory.\n");
+                freeStack(&stack);
+                return 0;
+            }
+            term->nodes = nodes;
+            term->capacity = capacity;
+        }
+        term->nodes[term->size].kind = expr->kind;
+        term->nodes[term->size].name = expr->name;
+        term->nodes[term->size].value = expr->value;
+        term->nodes[term->size].big = big_retain(expr->big);
+        term->size++;
+        if(expr->kind!=IdK && expr->kind!=ConstK) {
+            if((slot = pushStack(&stack))==NULL) {
+                freeStack(&stack);
+                return 0;
+            }
+            *slot = expr->children[1];
+            if((slot = pushStack(&stack))==NULL) {
+                freeStack(&stack);
+                return 0;
+            }
+            *slot = expr->children[0];
+        }
+    }
+    freeStack(&stack);
+    return 1;
+}
+
+/*
+ * Builds the tree starting at the position of the flat term. Returns NULL
+ * if there is not enough memory.
+ */
+static TreeNode * unflatten(FlatTerm *term, int *pos) {
+    TreeNode *result = NULL;
+    Stack stack;
+    TreeNode ***top;
+    TreeNode ***slot;
+    initStack(&stack,sizeof(TreeNode**));
+    *(TreeNode***)pushStack(&stack) = &result;
+    while((top = popStack(&stack))!=NULL) {
+        TreeNode **place = *top;
+        FlatNode *node = &term->nodes[(*pos)++];
+        TreeNode *expr = newTreeNode(node->kind);
+        if(expr==NULL) break;
+        expr->name = node->name;
+        expr->value = node->value;
+        expr->big = big_retain(node->big);
+        *place = expr;
+        if(expr->kind!=IdK && expr->kind!=ConstK) {
+            if((slot = pushStack(&stack))==NULL) break;
+            *slot = &expr->children[1];
+            if((slot = pushStack(&stack))==NULL) break;
+            *slot = &expr->children[0];
+        }
+    }
+    if(top!=NULL) {
+        // a break above, for lack of memory
+        freeStack(&stack);
+        deleteTree(result);
+        return NULL;
+    }
+    freeStack(&stack);
+    return result;
+}
+
+/* Counts the nodes of the tree, up to the limit. */
+static int treeSize(TreeNode *expr, int limit) {
+    int size = 1;
+    int i;
+    for(i=0;i<MAXCHILDREN && size<limit;i++) {
+        if(expr->children[i]!=NULL) {
+            size += treeSize(expr->children[i],limit-size);
+        }
+    }
+    return size;
+}
+
+static void deleteFlatTerm(FlatTerm *term) {
+    int i;
+    for(i=0;i<term->size;i++) {
+        big_release(term->nodes[i].big);
+    }
+    free(term->nodes);
+}
+
+static void deleteSpeculation(Speculation *s) {
+    deleteFlatTerm(&s->input);
+    deleteFlatTerm(&s->result);
+    free(s);
+}
+
+/* The context of a worker, writing nowhere. */
+static THREAD_LOCAL EvalContext *workerContext = NULL;
+
+static void releaseWorkerContext(void) {
+    if(workerContext==NULL) return;
+    FILE *sink = workerContext->out;
+    deleteEvalContext(workerContext);
+    fclose(sink);
+    workerContext = NULL;
+}
+
+/*
+ * Evaluates the subterm on a worker, within the budget left to the
+ * machine, so the machine never waits for it longer than it could run.
+ */
+static void runSpeculation(void *arg) {
+    Speculation *s = arg;
+    Evaluation *evaluation = NULL;
+    int pos = 0;
+    if(workerContext==NULL) {
+        // the machine reports the errors if it evaluates the subterm again
+        FILE *sink = fopen("/dev/null","w");
+        workerContext = newEvalContext(sink,sink);
+        useEvalContext(workerContext);
+    }
+    workerContext->engine = &engineList[0];
+    workerContext->strategy = s->strategy;
+    workerContext->hashConsing = 0;
+    workerContext->parallelThreshold = s->threshold;
+    workerContext->budget = s->budget;
+    if(s->deadline>0) {
+        workerContext->budget.seconds = s->deadline-seconds();
+        if(workerContext->budget.seconds<=0) return;
+    }
+
+    TreeNode *input = unflatten(&s->input,&pos);
+    TreeNode *result = NULL;
+    if(input!=NULL) {
+        evaluation = newEvaluation(input,globalEnvironment());
+        resumeEvaluation(evaluation,&workerContext->budget);
+        result = evaluationResult(evaluation);
+        s->steps = evaluation->steps;
+        deleteEvaluation(evaluation);
+    }
+    if(result!=NULL) {
+        if(!flatten(result,&s->result)) {
+            // the machine evaluates it again
+            s->result.size = 0;
+        }
+        deleteTree(result);
+    }
+}
+
+/*
+ * Gets what is left of the budget of the evaluation, for a subterm it
+ * forks at the depth of its continuation: the worker must not go beyond
+ * what the machine could do. The time is left to the deadline. Returns 0
+ * if nothing is left, or if the steps are limited: the worker skips the
+ * lookups of the variables read back, so its steps are fewer than those
+ * of the machine, and the machine would run out of steps elsewhere.
+ */
+static int budgetLeft(Evaluation *evaluation, const Budget *budget, long fuel,
+        Budget *left) {
+    PoolStats stats;
+    *left = unlimited;
+    if(fuel>=0) return 0;
+    if(budget->frames>0) {
+        left->frames = budget->frames-evaluation->state->depth;
+        if(left->frames<=0) return 0;
+    }
+    if(budget->bytes>0) {
+        pool_getStats(&stats);
+        if(stats.bytesInUse>=evaluation->baseBytes+budget->bytes) return 0;
+        left->bytes = evaluation->baseBytes+budget->bytes-stats.bytesInUse;
+    }
+    return 1;
+}
+
+/*
+ * Forks the evaluation of the expression in the environment if it is
+ * large enough, with what is left of the budget and the deadline. The
+ * expression is read back to a closed term first, so the worker shares
+ * nothing with the machine. Returns NULL if it is not forked.
+ */
+static Speculation * speculate(TreeNode *expr, Environment *env, int threshold,
+        const Budget *left, double deadline) {
+    if(isValue(expr) || expr->kind==IdK || expr->freeDepth==INT_MAX
+        || treeSize(expr,threshold)<threshold) {
+        return NULL;
+    }
+    TreeNode *closed = readback(expr,env,0);
+    if(closed==NULL) return NULL;
+
+    Speculation *s = malloc(sizeof(Speculation));
+    s->input = (FlatTerm){NULL, 0, 0};
+    s->result = (FlatTerm){NULL, 0, 0};
+    s->strategy = context()->strategy;
+    s->threshold = threshold;
+    s->budget = *left;
+    s->deadline = deadline;
+    s->steps = 0;
+    if(!flatten(closed,&s->input)) {
+        deleteTree(closed);
+        deleteSpeculation(s);
+        return NULL;
+    }
+    deleteTree(closed);
+    s->task = par_fork(runSpeculation,s);
+    if(s->task==NULL) {
+        deleteSpeculation(s);
+        return NULL;
+    }
+    return s;
+}
+
+/*
+ * Waits for the subterm forked by the continuation. Stores the closure of
+ * its value and returns the steps the worker took, which count as steps of
+ * the machine. Returns -1 if the worker failed, so the machine must
+ * evaluate it itself. The steps of the machine are never limited while a
+ * subterm is forked, see budgetLeft().
+ */
+static long joinSpeculation(Continuation *ctn, int hashConsing, Closure *closure) {
+    Speculation *s = ctn->speculation;
+    long joined = -1;
+    int pos = 0;
+    ctn->speculation = NULL;
+    if(par_join(s->task) && s->result.size>0) {
+        TreeNode *value = unflatten(&s->result,&pos);
+        if(value!=NULL && db_resolve(value,NULL)) {
+            cek_setClosure(closure,hashConsing ? hc_shareTree(value) : value,NULL);
+            joined = s->steps;
+        } else {
+            deleteTree(value);
+        }
+    }
+    deleteSpeculation(s);
+    return joined;
+}
+
+/* Stops the subterms forked by the continuations of the state. */
+static void cancelSpeculations(State *state) {
+    int i;
+    for(i=0;i<state->depth;i++) {
+        Continuation *ctn = &state->frames[i];
+        if(ctn->speculation!=NULL) {
+            par_cancel(ctn->speculation->task);
+            deleteSpeculation(ctn->speculation);
+            ctn->speculation = NULL;
+        }
+    }
+}
@@ -5,13 +5,294 @@
 /**************************************************************/
 #ifndef _EVAL_H_
 #define _EVAL_H_
-/* Evaluates the expression. */
+struct envStruct;
+
+/*
+ * An evaluation engine. Engines consume the expression and return its
+ * value as a tree, or NULL on errors.
+ */
+typedef TreeNode * (*EngineFun)(TreeNode *expr, struct envStruct *globals);
+typedef struct {
+    char *name;
+    EngineFun evaluate;
+} Engine;
+
+/* Look for the engine by name. Returns NULL if there is no such engine. */
+Engine * lookupEngine(const char *name);
+
+/* Returns all the engines and stores their number in size. */
+Engine * engines(int *size);
+
+/*
+ * Selects the engine used by evaluate() and evaluateIn(). The default is
+ * the CEK machine ("cek"); "bytecode" compiles the expression for the
+ * virtual machine in bytecode.h, and "cc" and "ck" are the machines of
+ * cc_machine.h and ck_machine.h, which substitute the arguments in the
+ * trees instead of binding them in environments. "krivine" is the Krivine
+ * machine, which evaluates by name: arguments are bound unevaluated, and
+ * evaluated again at every use, while the operands of the primitives are
+ * evaluated first. They all stop at abstractions, while "nbe" computes the
+ * full normal form (see nbe.h).
+ */
+void setEngine(Engine *engine);
+
+/* Evaluates the expression in the global environment. */
 TreeNode * evaluate(TreeNode *expr);
 
-/* Perform alpha conversion on the expression. */
+/*
+ * Evaluates the expression in the given environment. The environment is
+ * not modified, so many expressions can be evaluated against it.
+ */
+TreeNode * evaluateIn(TreeNode *expr, struct envStruct *globals);
+
+/*
+ * Returns the global environment with the builtin and standard functions.
+ * It is built once per context and shared by all its evaluations.
+ */
+struct envStruct * globalEnvironment(void);
+
+/*
+ * Frees the global environment of the context, and drops the constants
+ * shared by the primitives of the thread.
+ */
+void releaseGlobalEnvironment(void);
+
+/*
+ * Enables or disables hash-consing of the input and result trees, so
+ * equal subtrees are represented by one node (see hashcons.h).
+ */
+void setHashConsing(int enabled);
+
+/* Evaluation strategies of the CEK machine. */
+typedef enum {
+    CallByValue,    /* arguments are evaluated before the call */
+    CallByNeed      /* arguments are evaluated at most once, when needed */
+} EvalStrategy;
+
+/*
+ * Selects how the CEK machine passes arguments. Under call-by-need an
+ * argument is bound as a thunk, and the first lookup evaluates it and
+ * updates the binding, so later lookups share the value. Unused arguments
+ * are never evaluated, and the plain Y combinator terminates. The default
+ * is call-by-value. The bytecode, CC and CK engines are always
+ * call-by-value, and the Krivine machine is always call-by-name.
+ */
+void setStrategy(EvalStrategy strategy);
+
+/*
+ * Limits of an evaluation with the CEK machine. Zero means unlimited. The
+ * steps and the frames are exact, while the time and the memory are
+ * checked every 1024 steps. The memory is the growth of the bytes in use
+ * in the pool of the thread since the evaluation started (see pool.h).
+ */
+typedef struct {
+    long steps;         /* machine steps */
+    size_t bytes;       /* bytes allocated and still in use */
+    double seconds;     /* wall-clock time */
+    long frames;        /* depth of the continuation */
+} Budget;
+
+/*
+ * Sets the budget of every evaluation of the CEK machine, and of the
+ * bytecode, nbe, CC, CK and Krivine engines. An evaluation which exhausts
+ * it fails with an error. NULL removes the limits, which is the default.
+ */
+void setBudget(const Budget *budget);
+
+/*
+ * The budget of the context as spent by an engine other than the CEK
+ * machine, which can't suspend: exhausting it fails the evaluation.
+ */
+typedef struct {
+    long steps;             /* steps done so far */
+    long fuel;              /* -1 if unlimited */
+    long frames;            /* 0 if unlimited */
+    double deadline;        /* 0 if unlimited */
+    size_t maxBytes;        /* bytes in use allowed, 0 if unlimited */
+    const char *exhausted;  /* the budget exhausted, or NULL */
+} Meter;
+
+/* Starts spending the budget of the context of the thread. */
+void startMeter(Meter *meter);
+
+/*
+ * Counts a step of the engine, at that depth of its continuation or its
+ * recursion. Returns 0 if the budget is exhausted, after reporting the
+ * error the first time.
+ */
+int meterStep(Meter *meter, long depth);
+
+/*
+ * Collects the environments of every evaluation of the CEK machine by
+ * mark-sweep, in a heap of the evaluation which is collected between two
+ * steps once it holds that many environments (see cek_machine.h). The
+ * environments are then never freed while the machine runs, and those
+ * left in cycles by call-by-need are freed too. 0 counts the references
+ * of the environments instead, which is the default.
+ */
+void setHeapSize(size_t environments);
+
+/* Status of a resumable evaluation. */
+typedef enum {
+    EvalDone,       /* the value is ready */
+    EvalFailed,     /* an error was reported */
+    EvalSuspended   /* the budget is exhausted, it can be resumed */
+} EvalStatus;
+
+typedef struct evaluationStruct Evaluation;
+
+/*
+ * Starts evaluating the expression with the CEK machine in the global
+ * environment, without running it yet. The expression is consumed. A
+ * scheduler can run many evaluations in turns with resumeEvaluation(),
+ * giving each a budget per turn. The evaluation stays in the thread which
+ * started it, and uses the strategy selected then.
+ */
+Evaluation * startEvaluation(TreeNode *expr);
+
+/*
+ * Runs the evaluation until it ends or the budget, counted from this call,
+ * is exhausted. NULL means no limit. Returns the new status.
+ */
+EvalStatus resumeEvaluation(Evaluation *evaluation, const Budget *budget);
+
+/*
+ * Takes the value of a finished evaluation. Returns NULL if it is not
+ * finished, failed, or the value was taken already.
+ */
+TreeNode * evaluationResult(Evaluation *evaluation);
+
+/* Returns the number of steps done so far. */
+long evaluationSteps(Evaluation *evaluation);
+
+/* Frees the evaluation, whether finished or not. */
+void deleteEvaluation(Evaluation *evaluation);
+
+/* Default granularity of the parallel evaluation, in tree nodes. */
+#define PARALLEL_THRESHOLD 32
+
+/*
+ * Lets the CEK machine evaluate independent subterms on that many worker
+ * threads: under call-by-value, the argument of an application, while the
+ * machine goes on with the function. The operands of the primitives are
+ * not forked, since they are the variables of the standard functions.
+ * Subterms with fewer than threshold nodes stay sequential. A subterm is
+ * read back to a closed term and evaluated by a worker with its own
+ * context; if it fails, the machine evaluates it again itself, so the
+ * output is the same as the sequential one. The worker gets what is left
+ * of the budget of the evaluation, and its steps count as steps of the
+ * evaluation; nothing is forked while the steps are limited, since the
+ * worker takes fewer. The workers are shared by all the contexts. Zero
+ * workers stops them.
+ */
+void setParallel(int workers, int threshold);
+
+/*
+ * The state of the evaluator: the output streams, the settings above and
+ * the global environment. The functions above work on the context of the
+ * calling thread. Threads without a context of their own share a default
+ * one, so to evaluate on many threads at once every thread must create and
+ * use its own context. Nothing is shared between contexts except the
+ * symbol table, which is thread-safe; trees and environments are
+ * allocated from the pool of the thread (see pool.h).
+ */
+typedef struct evalContext {
+    FILE *out;              /* The streams, or NULL to keep those of */
+    FILE *errOut;           /* the thread. */
+    Engine *engine;
+    EvalStrategy strategy;
+    int hashConsing;
+    int parallelThreshold;      /* 0 if not parallel. */
+    Budget budget;
+    size_t heapSize;            /* 0 if environments are counted. */
+    struct envStruct *globals;  /* Built on first use. */
+} EvalContext;
+
+/*
+ * Creates a context writing to the streams, with the settings of the
+ * context of the calling thread.
+ */
+EvalContext * newEvalContext(FILE *out, FILE *errOut);
+
+/*
+ * Frees the context and its global environment. It must be called by the
+ * thread which used the context.
+ */
+void deleteEvalContext(EvalContext *ctx);
+
+/*
+ * Makes the context the one of the calling thread, and its streams the
+ * out and errOut of the thread. NULL selects the default context again.
+ * Returns the previous context of the thread.
+ */
+EvalContext * useEvalContext(EvalContext *ctx);
+
+/*
+ * Counters of what the evaluator does, kept per thread. They are only
+ * maintained when compiled with EVAL_STATS defined ("make stats");
+ * otherwise they cost nothing and stay zero. The transitions and the
+ * continuation depth are those of the CEK machine.
+ */
+typedef struct {
+    unsigned long evaluations;  /* calls of evaluate() and evaluateIn() */
+    unsigned long lookups;      /* identifiers looked up */
+    unsigned long swaps;        /* functions evaluated, ArgKK to FunKK */
+    unsigned long betas;        /* closures applied, FunKK */
+    unsigned long operands;     /* first operands evaluated, OpdKK */
+    unsigned long primitives;   /* primitives applied, OprKK */
+    unsigned long updates;      /* thunks updated, UpdKK */
+    unsigned long links;        /* environment frames walked by lookups */
+    unsigned long nodesAllocated;
+    unsigned long nodesFreed;
+    unsigned long alphaConversions;
+    unsigned long peakDepth;    /* continuations */
+    double seconds;             /* time spent in the engines */
+} EvalStats;
+
+#ifdef EVAL_STATS
+extern THREAD_LOCAL EvalStats evalStats;
+#define EVAL_ADD(counter,n) (evalStats.counter += (n))
+#else
+#define EVAL_ADD(counter,n) ((void)0)
+#endif
+#define EVAL_COUNT(counter) EVAL_ADD(counter,1)
+
+/* Gets the counters of the thread. */
+void getEvalStats(EvalStats *stats);
+
+/* Sets the counters of the thread to zero. */
+void resetEvalStats(void);
+
+/*
+ * Adds the counters to the total, such as those of another thread. The
+ * peak depth is the larger one.
+ */
+void addEvalStats(EvalStats *total, const EvalStats *stats);
+
+/* Prints the counters, one per line. */
+void printEvalStats(const EvalStats *stats, FILE *stream);
+
+/*
+ * Perform alpha conversion on the expression. Deletes it and returns NULL
+ * if there is not enough memory.
+ */
 TreeNode * alphaConversion(TreeNode *expr);
 
-/* Perform beta reduction on the expression. */
+/*
+ * Perform beta reduction on the expression. Deletes it and returns NULL if
+ * there is not enough memory.
+ */
 TreeNode * betaReduction(TreeNode *expr);
 
+/*
+ * Reduces the expression towards its normal form in normal order, by
+ * repeating betaReduction on the leftmost outermost redex, and primitives
+ * on constants. Stops after limit steps unless limit is negative, and
+ * stores the number of steps. Identifiers are not resolved, so free ones
+ * are kept. The expression must not be shared; it is reduced in place.
+ * This is the naive reference for the "nbe" engine. Returns NULL if there
+ * is not enough memory.
+ */
+TreeNode * normalOrderReduction(TreeNode *expr, long limit, long *steps);
+
 #endif
@@ -10,6 +10,8 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <limits.h>
+#include <stdint.h>
 
 #ifndef YYPARSER
 #include "y.tab.h"
@@ -20,25 +22,33 @@
 typedef enum { IdK, ConstK, AbsK, AppK, PrimiK } ExprKind;
 
 #define MAXCHILDREN 2
+struct varset;
+struct bigNum;
+
 /* tree nodes */
 typedef struct treeNode {
     ExprKind kind;
-    // NOTE: cannot use Union here because name is checked to free strings
-    char * name;    // only for IdK
-    int value;      // only for integers
+    const char * name;  // only for IdK and PrimiK, interned by sym_intern
+    int64_t value;  // only for integers
+    struct bigNum * big;    // only for integers beyond 64 bits, else NULL
+    int index;      // only for IdK, de Bruijn index or -1 if unresolved
+    int refCount;   // number of references, trees are shared
+    unsigned int hash;  // nonzero if in the hash-consing store
+    int freeDepth;  // 1 + largest free de Bruijn index, 0 if closed
+    struct varset * fv; // cached free variables by name, NULL if unknown
     struct treeNode * children[MAXCHILDREN];
 } TreeNode;
 
+/* Storage class of the state kept per thread. */
+#if defined(__STDC_VERSION__) && __STDC_VERSION__>=201112L
+#define THREAD_LOCAL _Thread_local
+#else
+#define THREAD_LOCAL __thread
+#endif
+
 extern FILE* in;
-extern FILE* out;
-extern FILE* errOut;
-
-// lex and yacc definitions
-extern char* yytext;
-extern int yyerror(char*);
-extern int yylex(void);
-extern void useStringBuffer(const char*);
-extern void deleteStringBuffer();
-extern int yyparse();
-extern int yylex_destroy(void);
+// output streams of the current thread, see useEvalContext()
+extern THREAD_LOCAL FILE* out;
+extern THREAD_LOCAL FILE* errOut;
+
 #endif
@@ -0,0 +1,246 @@
+/******************************************************************/
+/* File: hashcons.c                                               */
+/* Implementation of the hash-consing store.                      */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include <stdint.h>
+#include "globals.h"
+#include "util.h"
+#include "bignum.h"
+#include "hashcons.h"
+
+#define INITIAL_SIZE 1024
+
+/* Marks a slot whose node has been removed. */
+#define TOMBSTONE ((TreeNode*)1)
+
+/* Open addressing table, kept at most half full. */
+// every thread has its own store, like its own pool
+static THREAD_LOCAL TreeNode **table = NULL;
+static THREAD_LOCAL size_t tableSize = 0;
+static THREAD_LOCAL size_t used = 0;    // slots with a node or a tombstone
+static THREAD_LOCAL HashConsStats stats;
+
+static unsigned int mix(unsigned int h, uintptr_t v) {
+    h ^= (unsigned int)(v ^ (v>>32));
+    return h * 0x9E3779B1u;
+}
+
+/*
+ * Hashes the node by its fields and the hashes of its children. Names of
+ * identifiers are left out, so alpha-equivalent nodes hash the same. Never
+ * returns 0, which means unshared.
+ */
+static unsigned int hashNode(TreeNode *node) {
+    unsigned int h = mix(0,node->kind);
+    if(node->kind!=IdK) {
+        h = mix(h,(uintptr_t)node->name);
+    }
+    h = mix(h,(uintptr_t)node->value);
+    if(node->big!=NULL) {
+        h = mix(h,big_hash(node->big));
+    }
+    h = mix(h,(uintptr_t)node->index);
+    h = mix(h,node->children[0]==NULL ? 0 : node->children[0]->hash);
+    h = mix(h,node->children[1]==NULL ? 0 : node->children[1]->hash);
+    return h | 1;
+}
+
+/* Compares the fields of two nodes, but not their children. */
+static int sameFields(TreeNode *a, TreeNode *b, int names) {
+    return a->kind==b->kind && (a->name==b->name || (!names && a->kind==IdK))
+        && a->value==b->value
+        && (a->big==b->big || (a->big!=NULL && b->big!=NULL
+            && big_compare(a->big,b->big)==0))
+        && a->index==b->index;
+}
+
+/* A pair of subtrees to compare. */
+typedef struct {
+    TreeNode *a;
+    TreeNode *b;
+} NodePair;
+
+/*
+ * Tells whether two trees are equal up to the names of their identifiers,
+ * which are bound by de Bruijn index. Only right for closed trees.
+ */
+static int alphaEqual(TreeNode *a, TreeNode *b) {
+    Stack stack;
+    NodePair *pair;
+    int equal = 1;
+    int i;
+    initStack(&stack,sizeof(NodePair));
+    pair = pushStack(&stack);
+    pair->a = a;
+    pair->b = b;
+    while(equal && (pair = popStack(&stack))!=NULL) {
+        a = pair->a;
+        b = pair->b;
+        if(a==b) continue;
+        if(a==NULL || b==NULL || !sameFields(a,b,0)) {
+            equal = 0;
+            break;
+        }
+        for(i=0;i<MAXCHILDREN;i++) {
+            if((pair = pushStack(&stack))==NULL) {
+                // without memory to compare, the nodes are kept apart
+                equal = 0;
+                break;
+            }
+            pair->a = a->children[i];
+            pair->b = b->children[i];
+        }
+    }
+    freeStack(&stack);
+    return equal;
+}
+
+/*
+ * Closed nodes are equal up to the names of their identifiers. Other nodes
+ * must have the same names, since a free identifier is only known by it.
+ */
+static int sameNode(TreeNode *a, TreeNode *b) {
+    if(a->freeDepth!=b->freeDepth) return 0;
+    if(a->freeDepth==0) return alphaEqual(a,b);
+    return sameFields(a,b,1) && a->children[0]==b->children[0]
+        && a->children[1]==b->children[1];
+}
+
+/* Rebuilds the table with the given size, dropping the tombstones. */
+static int rehash(size_t newSize) {
+    TreeNode **newTable = calloc(newSize,sizeof(TreeNode*));
+    if(newTable==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return 0;
+    }
+    size_t i;
+    for(i=0;i<tableSize;i++) {
+        TreeNode *node = table[i];
+        if(node!=NULL && node!=TOMBSTONE) {
+            size_t j = node->hash & (newSize-1);
+            while(newTable[j]!=NULL) {
+                j = (j+1) & (newSize-1);
+            }
+            newTable[j] = node;
+        }
+    }
+    free(table);
+    table = newTable;
+    tableSize = newSize;
+    used = stats.nodes;
+    return 1;
+}
+
+TreeNode * hc_share(TreeNode *node) {
+    if(node==NULL || node->hash!=0) return node;
+
+    if(2*(used+1)>tableSize) {
+        size_t newSize = tableSize==0 ? INITIAL_SIZE : tableSize;
+        while(4*(stats.nodes+1)>newSize) newSize *= 2;
+        if(!rehash(newSize)) return node;
+    }
+
+    stats.lookups++;
+    unsigned int h = hashNode(node);
+    size_t i = h & (tableSize-1);
+    size_t slot = tableSize;     // first tombstone found
+    TreeNode *entry = NULL;
+    while((entry=table[i])!=NULL) {
+        if(entry==TOMBSTONE) {
+            if(slot==tableSize) slot = i;
+        } else if(entry->hash==h && sameNode(entry,node)) {
+            stats.hits++;
+            retainTree(entry);
+            deleteTree(node);
+            return entry;
+        }
+        i = (i+1) & (tableSize-1);
+    }
+    if(slot==tableSize) {
+        slot = i;
+        used++;
+    }
+    node->hash = h;
+    table[slot] = node;
+    stats.nodes++;
+    return node;
+}
+
+/* The place of a node to share, or of one whose children are shared. */
+typedef struct {
+    TreeNode **place;
+    int shared;
+} ShareItem;
+
+TreeNode * hc_shareTree(TreeNode *tree) {
+    Stack stack;
+    ShareItem *item;
+    if(tree==NULL || tree->hash!=0) return tree;
+    // the children are shared first, then the node replaced in its place
+    initStack(&stack,sizeof(ShareItem));
+    item = pushStack(&stack);
+    item->place = &tree;
+    item->shared = 0;
+    while((item = popStack(&stack))!=NULL) {
+        TreeNode **place = item->place;
+        TreeNode *node = *place;
+        int i;
+        if(node==NULL || node->hash!=0) continue;
+        if(item->shared) {
+            *place = hc_share(node);
+            continue;
+        }
+        // without memory for the stack, the rest of the tree isn't shared
+        if((item = pushStack(&stack))==NULL) break;
+        item->place = place;
+        item->shared = 1;
+        for(i=MAXCHILDREN-1;i>=0 && item!=NULL;i--) {
+            if((item = pushStack(&stack))==NULL) break;
+            item->place = &node->children[i];
+            item->shared = 0;
+        }
+        if(item==NULL) break;
+    }
+    freeStack(&stack);
+    return tree;
+}
+
+void hc_forget(TreeNode *node) {
+    if(table==NULL) return;
+    size_t i = node->hash & (tableSize-1);
+    while(table[i]!=NULL) {
+        if(table[i]==node) {
+            table[i] = TOMBSTONE;
+            stats.nodes--;
+            break;
+        }
+        i = (i+1) & (tableSize-1);
+    }
+    node->hash = 0;
+}
+
+void hc_getStats(HashConsStats *s) {
+    *s = stats;
+}
+
+void hc_printStats(const HashConsStats *s, FILE *stream) {
+    fprintf(stream,"hc_lookups\t%lu\n",(unsigned long)s->lookups);
+    fprintf(stream,"hc_hits\t%lu\n",(unsigned long)s->hits);
+    fprintf(stream,"hc_nodes\t%lu\n",(unsigned long)s->nodes);
+}
+
+void hc_cleanup(void) {
+    size_t i;
+    for(i=0;i<tableSize;i++) {
+        if(table[i]!=NULL && table[i]!=TOMBSTONE) {
+            table[i]->hash = 0;
+        }
+    }
+    free(table);
+    table = NULL;
+    tableSize = 0;
+    used = 0;
+    stats.nodes = 0;
+}
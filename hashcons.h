@@ -0,0 +1,56 @@
+/******************************************************************/
+/* File: hashcons.h                                               */
+/* Definition of the hash-consing store for trees.                */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _HASHCONS_H_
+#define _HASHCONS_H_
+
+/*
+ * The store keeps one canonical node for each distinct node, so equal
+ * subtrees are represented by the same node and compared with ==. Two
+ * nodes are equal when they have the same kind, name, value, de Bruijn
+ * index and children. Closed nodes are keyed on their de Bruijn structure
+ * only, so closed subtrees that differ in bound names are merged too, and
+ * print with the names of the first one stored.
+ *
+ * Every thread has its own store, holding the nodes of that thread.
+ *
+ * The store doesn't keep nodes alive: a canonical node is removed from it
+ * when its last reference is dropped. Canonical nodes are shared and must
+ * not be changed.
+ */
+
+/* Statistics of the store. */
+typedef struct {
+    size_t lookups;     /* Number of nodes looked up. */
+    size_t hits;        /* Lookups that found an equal canonical node. */
+    size_t nodes;       /* Canonical nodes currently in the store. */
+} HashConsStats;
+
+/*
+ * Returns the canonical node equal to the node, whose children must be
+ * canonical already. The reference to the node is transferred to the
+ * result.
+ */
+TreeNode * hc_share(TreeNode *node);
+
+/*
+ * Makes the whole tree canonical, bottom-up. The tree must not be shared
+ * with other holders unless it is canonical already.
+ */
+TreeNode * hc_shareTree(TreeNode *tree);
+
+/* Removes the node from the store. Called when the node is freed. */
+void hc_forget(TreeNode *node);
+
+/* Gets the statistics of the store. */
+void hc_getStats(HashConsStats *stats);
+
+/* Prints the statistics, one "name\tvalue" line each. */
+void hc_printStats(const HashConsStats *stats, FILE *stream);
+
+/* Frees the store. Nodes in it become ordinary nodes. */
+void hc_cleanup(void);
+#endif
@@ -1,45 +1,272 @@
 /*****************************************************************/
 /* File: main.c                                                  */
 /* Implements the interactive interface of this lambda calculus  */
-/* evaluator.                                                    */
+/* evaluator, and the batch mode for pipelines.                  */
 /* Author: Minjie Zha                                            */
 /*****************************************************************/
 
+#include <time.h>
+#include <pthread.h>
 #include "globals.h"
 #include "eval.h"
 #include "util.h"
+#include "symbol.h"
+#include "parse.h"
+#include "pool.h"
+#include "cek_machine.h"
+#include "hashcons.h"
 
 FILE* in;
-FILE* out;
-FILE* errOut;
-
-TreeNode * tree = NULL;    // used in the parser
+THREAD_LOCAL FILE* out;
+THREAD_LOCAL FILE* errOut;
 
 #define BUFF_SIZE 255
+#define OUT_BUFF_SIZE 65536
+#define MAX_JOBS 256
+#define SHARD_RECORDS 64    /* records per shard in parallel batch mode */
+
+/*
+ * A record read in batch mode. The buffer is reused for all records and
+ * grows as needed.
+ */
+typedef struct {
+    char *text;
+    size_t length;
+    size_t capacity;
+} Record;
+
+/* Counters of the batch mode. */
+typedef struct {
+    long records;
+    long failures;
+    long bytes;
+} BatchStats;
+
+typedef enum { ShardFree, ShardFilled, ShardRunning, ShardDone } ShardState;
+
+/*
+ * Records evaluated together by one worker in parallel batch mode. The
+ * records are stored one after the other, each followed by its two NUL
+ * bytes. The worker writes the output and the errors to memory, and the
+ * main thread copies them to out and errOut in the order of the input.
+ */
+typedef struct {
+    ShardState state;
+    Record text;
+    size_t lengths[SHARD_RECORDS];
+    int count;
+    char *output;
+    size_t outputSize;
+    char *errors;
+    size_t errorsSize;
+    BatchStats stats;
+} Shard;
+
+/*
+ * A ring of shards. The main thread fills shard number filled, the
+ * workers take shard number taken, and the main thread prints shard
+ * number printed, each modulo size.
+ */
+typedef struct {
+    Shard *shards;
+    int size;
+    long filled;
+    long taken;
+    long printed;
+    int finished;           /* no more input */
+    EvalContext *contexts[MAX_JOBS];    /* of the workers, by start order */
+    int started;
+    BatchStats stats;       /* of the printed shards */
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} ShardRing;
+
+/*
+ * Counters of the batch workers, added up as they exit, since the counters
+ * of a thread are its own.
+ */
+typedef struct {
+    EvalStats eval;
+    GcStats gc;
+    HashConsStats hashCons;
+} WorkerStats;
+
+static WorkerStats workerStats;
+
+static void interactive(void);
+static int batch(char *files[], int size, int jobs);
+static int readRecord(FILE *stream, Record *record);
+static void evaluateRecord(ParseContext *ctx, Record *record, BatchStats *stats);
+static void submitRecord(ShardRing *ring, Record *record);
+static void printShards(ShardRing *ring, int all);
+static void * worker(void *arg);
+static void addWorkerStats(void);
 
 int main(int argc, char* argv[]) {
-    
+
     in = stdin;
     out = stdout;
     errOut = stderr;
 
+    int batchMode = 0;
+    int jobs = 1;
+    int workers = 0;
+    int status = 0;
+    int printStats = 0;
+    int printHashCons = 0;
+    Budget budget = {0, 0, 0.0, 0};
+    // -b evaluates the files, or stdin, in batch mode.
+    // -j sets the number of threads of the batch mode.
+    // -p sets the number of workers evaluating subterms in parallel.
+    // -e selects the evaluation engine.
+    // -s selects how the CEK machine passes arguments, by value or need.
+    // -f, -m and -t limit the steps, bytes and seconds of an evaluation,
+    // and -d the depth of its continuation.
+    // -g collects the environments in a heap of that many environments.
+    // -S prints the statistics of the evaluator at the end.
+    // -H shares equal subtrees, and prints how much at the end.
+    while(argc>1 && argv[1][0]=='-') {
+        if(strcmp(argv[1],"-b")==0) {
+            batchMode = 1;
+            argv += 1;
+            argc -= 1;
+        } else if(strcmp(argv[1],"-S")==0) {
+            printStats = 1;
+            argv += 1;
+            argc -= 1;
+        } else if(strcmp(argv[1],"-H")==0) {
+            printHashCons = 1;
+            setHashConsing(1);
+            argv += 1;
+            argc -= 1;
+        } else if(strcmp(argv[1],"-j")==0 && argc>2) {
+            jobs = atoi(argv[2]);
+            if(jobs<1 || jobs>MAX_JOBS) {
+                fprintf(errOut,"Invalid number of jobs: %s\n",argv[2]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-p")==0 && argc>2) {
+            workers = atoi(argv[2]);
+            if(workers<0 || workers>MAX_JOBS) {
+                fprintf(errOut,"Invalid number of workers: %s\n",argv[2]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-f")==0 && argc>2) {
+            budget.steps = atol(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-m")==0 && argc>2) {
+            budget.bytes = atol(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-d")==0 && argc>2) {
+            budget.frames = atol(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-t")==0 && argc>2) {
+            budget.seconds = atof(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-g")==0 && argc>2) {
+            long heapSize = atol(argv[2]);
+            if(heapSize<1) {
+                fprintf(errOut,"Invalid heap size: %s\n",argv[2]);
+                return 1;
+            }
+            setHeapSize(heapSize);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-e")==0 && argc>2) {
+            Engine *engine = lookupEngine(argv[2]);
+            if(engine==NULL) {
+                fprintf(errOut,"Unknown engine: %s\n",argv[2]);
+                return 1;
+            }
+            setEngine(engine);
+            argv += 2;
+            argc -= 2;
+        } else if(strcmp(argv[1],"-s")==0 && argc>2) {
+            if(strcmp(argv[2],"value")==0) {
+                setStrategy(CallByValue);
+            } else if(strcmp(argv[2],"need")==0) {
+                setStrategy(CallByNeed);
+            } else {
+                fprintf(errOut,"Unknown strategy: %s\n",argv[2]);
+                return 1;
+            }
+            argv += 2;
+            argc -= 2;
+        } else {
+            fprintf(errOut,"Usage: %s [-e engine] [-s value|need] [-p workers] [-f steps] [-m bytes] [-t seconds] [-d frames] [-g environments] [-S] [-H] [-b [-j jobs] [file ...]]\n",argv[0]);
+            return 1;
+        }
+    }
+
+    setParallel(workers,PARALLEL_THRESHOLD);
+    setBudget(&budget);
+    if(batchMode) {
+        status = batch(&argv[1],argc-1,jobs);
+    } else {
+        interactive();
+    }
+
+    if(printStats) {
+        EvalStats stats;
+        getEvalStats(&stats);
+        addEvalStats(&stats,&workerStats.eval);
+        #ifndef EVAL_STATS
+            fprintf(errOut,"Statistics are not compiled in, see \"make stats\".\n");
+        #endif
+        printEvalStats(&stats,errOut);
+        GcStats gc;
+        cek_getGcStats(&gc);
+        cek_addGcStats(&gc,&workerStats.gc);
+        cek_printGcStats(&gc,errOut);
+    }
+    if(printHashCons) {
+        HashConsStats hashCons;
+        hc_getStats(&hashCons);
+        hashCons.lookups += workerStats.hashCons.lookups;
+        hashCons.hits += workerStats.hashCons.hits;
+        hashCons.nodes += workerStats.hashCons.nodes;
+        hc_printStats(&hashCons,errOut);
+    }
+
+    setParallel(0,0);
+    releaseGlobalEnvironment();
+    sym_cleanup();
+    return status;
+}
+
+static void interactive(void) {
     char buff[BUFF_SIZE];
+    ParseContext ctx;
+    TreeNode *tree = NULL;
+    parse_init(&ctx);
 
     fprintf(out,"Welcome to Lambda Calculus Evaluator.\n");
     fprintf(out,"Press Ctrl+C to quit.\n\n");
     while(1) {
         fprintf(out,"> ");
-        fgets(buff,BUFF_SIZE-1,in);
-        useStringBuffer(buff);
-        yyparse();
-        deleteStringBuffer();
+        if(fgets(buff,BUFF_SIZE-1,in)==NULL) {
+            break;
+        }
+        tree = parse_string(&ctx,buff);
         buff[0] = EOF;
-        #ifdef DEBUG 
+        if(tree==NULL) {
+            fprintf(out,"\n");
+            continue;
+        }
+        #ifdef DEBUG
             fprintf(errOut,"Parse tree =>\n");
             printTree(tree,errOut);
             fprintf(errOut,"\n");
         #endif
-        
+
         tree = evaluate(tree);
         if(tree!=NULL) {
             fprintf(out,"-> ");
@@ -49,5 +276,315 @@ int main(int argc, char* argv[]) {
         }
         fprintf(out,"\n\n");
     }
-    return 0;
+    fprintf(out,"\n");
+    parse_destroy(&ctx);
+}
+
+/*
+ * Evaluates every record of the files, or of stdin if there is no file,
+ * and prints one line for each: the result, or an empty line if it
+ * failed. Reports the throughput on errOut. Returns 1 if a file can't be
+ * opened.
+ *
+ * With more than one job, the records are evaluated by that many worker
+ * threads, each with its own evaluator context, and the output keeps the
+ * order of the input.
+ */
+static int batch(char *files[], int size, int jobs) {
+    Record record = {NULL, 0, 0};
+    BatchStats stats = {0, 0, 0};
+    ParseContext ctx;
+    ShardRing ring;
+    pthread_t threads[MAX_JOBS];
+    struct timespec start, end;
+    int status = 0;
+    int i;
+
+    parse_init(&ctx);
+    setvbuf(out,NULL,_IOFBF,OUT_BUFF_SIZE);
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    if(jobs>1) {
+        // enough shards for the workers to never wait for the printing
+        ring.size = 4*jobs;
+        ring.shards = calloc(ring.size,sizeof(Shard));
+        ring.filled = ring.taken = ring.printed = 0;
+        ring.finished = 0;
+        ring.started = 0;
+        ring.stats = stats;
+        pthread_mutex_init(&ring.lock,NULL);
+        pthread_cond_init(&ring.changed,NULL);
+        for(i=0;i<jobs;i++) {
+            // with the settings of the main thread
+            ring.contexts[i] = newEvalContext(NULL,NULL);
+            pthread_create(&threads[i],NULL,worker,&ring);
+        }
+    }
+    for(i=0;i==0 || i<size;i++) {     // once for stdin if no file
+        FILE *stream = in;
+        if(size>0) {
+            stream = fopen(files[i],"r");
+            if(stream==NULL) {
+                fprintf(errOut,"Error: cannot open %s.\n",files[i]);
+                status = 1;
+                continue;
+            }
+        }
+        int more;
+        while((more=readRecord(stream,&record))>0) {
+            if(jobs>1) {
+                submitRecord(&ring,&record);
+            } else {
+                evaluateRecord(&ctx,&record,&stats);
+            }
+        }
+        if(more<0) {
+            status = 1;
+        }
+        if(stream!=in) {
+            fclose(stream);
+        }
+    }
+    if(jobs>1) {
+        pthread_mutex_lock(&ring.lock);
+        if(ring.shards[ring.filled%ring.size].count>0) {
+            // the last shard is partly filled
+            ring.shards[ring.filled%ring.size].state = ShardFilled;
+            ring.filled++;
+        }
+        ring.finished = 1;
+        pthread_cond_broadcast(&ring.changed);
+        pthread_mutex_unlock(&ring.lock);
+        printShards(&ring,1);
+        stats = ring.stats;
+        for(i=0;i<jobs;i++) {
+            pthread_join(threads[i],NULL);
+        }
+        for(i=0;i<ring.size;i++) {
+            free(ring.shards[i].text.text);
+        }
+        free(ring.shards);
+        pthread_cond_destroy(&ring.changed);
+        pthread_mutex_destroy(&ring.lock);
+    }
+    fflush(out);
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    free(record.text);
+    parse_destroy(&ctx);
+
+    double seconds = (end.tv_sec-start.tv_sec) + (end.tv_nsec-start.tv_nsec)/1e9;
+    fprintf(errOut,"%ld expressions (%ld failed), %ld bytes in %.3f s: "
+            "%.0f expressions/s, %.2f MB/s\n",
+            stats.records,stats.failures,stats.bytes,seconds,
+            seconds>0 ? stats.records/seconds : 0.0,
+            seconds>0 ? stats.bytes/seconds/1e6 : 0.0);
+    return status;
+}
+
+/*
+ * Reads the next record: a line, continued on the next lines while it has
+ * unclosed parentheses. Blank lines are skipped. The text is followed by
+ * the two NUL bytes needed by parse_buffer(). Returns 0 at the end of the
+ * stream and -1 if the record does not fit in memory.
+ */
+static int readRecord(FILE *stream, Record *record) {
+    int c;
+    int depth = 0;
+    int blank = 1;
+    record->length = 0;
+    while((c=getc(stream))!=EOF) {
+        if(c=='\n' && depth<=0) {
+            if(blank) {
+                record->length = 0;
+                continue;
+            }
+            break;
+        }
+        if(record->length+2>=record->capacity) {
+            size_t capacity = record->capacity==0 ? BUFF_SIZE+1 : record->capacity*2;
+            char *text = realloc(record->text,capacity);
+            if(text==NULL) {
+                fprintf(errOut,"Out of memory.\n");
+                return -1;
+            }
+            record->text = text;
+            record->capacity = capacity;
+        }
+        record->text[record->length++] = c;
+        if(c=='(') {
+            depth++;
+        } else if(c==')') {
+            depth--;
+        }
+        if(c!=' ' && c!='\t' && c!='\r' && c!='\n') {
+            blank = 0;
+        }
+    }
+    if(blank) {
+        return 0;
+    }
+    record->text[record->length] = '\0';
+    record->text[record->length+1] = '\0';
+    return 1;
+}
+
+static void evaluateRecord(ParseContext *ctx, Record *record, BatchStats *stats) {
+    stats->records++;
+    stats->bytes += record->length;
+    TreeNode *tree = parse_buffer(ctx,record->text,record->length+2);
+    if(tree==NULL) {
+        stats->failures++;
+        fprintf(out,"\n");
+        return;
+    }
+
+    tree = evaluate(tree);
+    if(tree!=NULL) {
+        printExpression(tree,out);
+        deleteTree(tree);
+        tree = NULL;
+    } else {
+        stats->failures++;
+    }
+    fprintf(out,"\n");
+}
+
+/*
+ * Copies the record to the shard being filled, and hands the shard to the
+ * workers when it is full. Prints the finished shards meanwhile, and
+ * waits when all the shards are in use.
+ */
+static void submitRecord(ShardRing *ring, Record *record) {
+    pthread_mutex_lock(&ring->lock);
+    Shard *shard = &ring->shards[ring->filled%ring->size];
+    while(shard->state!=ShardFree) {
+        pthread_mutex_unlock(&ring->lock);
+        printShards(ring,0);
+        pthread_mutex_lock(&ring->lock);
+        if(shard->state!=ShardFree) {
+            pthread_cond_wait(&ring->changed,&ring->lock);
+        }
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    // the shard is not shared until it is filled
+    Record *text = &shard->text;
+    if(text->length+record->length+2>text->capacity) {
+        text->capacity = 2*(text->length+record->length+2);
+        text->text = realloc(text->text,text->capacity);
+    }
+    memcpy(text->text+text->length,record->text,record->length+2);
+    text->length += record->length+2;
+    shard->lengths[shard->count++] = record->length;
+
+    if(shard->count==SHARD_RECORDS) {
+        pthread_mutex_lock(&ring->lock);
+        shard->state = ShardFilled;
+        ring->filled++;
+        pthread_cond_broadcast(&ring->changed);
+        pthread_mutex_unlock(&ring->lock);
+    }
+}
+
+/*
+ * Prints the finished shards in order, adds up their counters and frees
+ * them. With all set, waits for the workers until all the filled shards
+ * are printed.
+ */
+static void printShards(ShardRing *ring, int all) {
+    pthread_mutex_lock(&ring->lock);
+    while(ring->printed<ring->filled) {
+        Shard *shard = &ring->shards[ring->printed%ring->size];
+        if(shard->state!=ShardDone) {
+            if(!all) break;
+            pthread_cond_wait(&ring->changed,&ring->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&ring->lock);
+        fwrite(shard->output,1,shard->outputSize,out);
+        if(shard->errorsSize>0) {
+            fflush(out);
+            fwrite(shard->errors,1,shard->errorsSize,errOut);
+        }
+        free(shard->output);
+        free(shard->errors);
+        shard->output = shard->errors = NULL;
+        ring->stats.records += shard->stats.records;
+        ring->stats.failures += shard->stats.failures;
+        ring->stats.bytes += shard->stats.bytes;
+        shard->stats = (BatchStats){0, 0, 0};
+        shard->text.length = 0;
+        shard->count = 0;
+        pthread_mutex_lock(&ring->lock);
+        shard->state = ShardFree;
+        ring->printed++;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/*
+ * Evaluates the shards of the ring until the input is over. The worker
+ * has its own evaluator context, so its global environment, trees and
+ * memory pool are its own.
+ */
+static void * worker(void *arg) {
+    ShardRing *ring = arg;
+    ParseContext parser;
+    EvalContext *ctx = NULL;
+    parse_init(&parser);
+
+    pthread_mutex_lock(&ring->lock);
+    ctx = ring->contexts[ring->started++];
+    while(1) {
+        if(ring->taken==ring->filled) {
+            if(ring->finished) break;
+            pthread_cond_wait(&ring->changed,&ring->lock);
+            continue;
+        }
+        Shard *shard = &ring->shards[ring->taken%ring->size];
+        ring->taken++;
+        shard->state = ShardRunning;
+        pthread_mutex_unlock(&ring->lock);
+
+        ctx->out = open_memstream(&shard->output,&shard->outputSize);
+        ctx->errOut = open_memstream(&shard->errors,&shard->errorsSize);
+        useEvalContext(ctx);
+        char *text = shard->text.text;
+        int i;
+        for(i=0;i<shard->count;i++) {
+            Record record = {text, shard->lengths[i], 0};
+            evaluateRecord(&parser,&record,&shard->stats);
+            text += shard->lengths[i]+2;
+        }
+        fclose(ctx->out);
+        fclose(ctx->errOut);
+        ctx->out = ctx->errOut = NULL;
+
+        pthread_mutex_lock(&ring->lock);
+        shard->state = ShardDone;
+        pthread_cond_broadcast(&ring->changed);
+    }
+    addWorkerStats();
+    pthread_mutex_unlock(&ring->lock);
+
+    parse_destroy(&parser);
+    deleteEvalContext(ctx);
+    hc_cleanup();
+    pool_releaseAll();
+    return NULL;
+}
+
+/* Adds the counters of the worker to workerStats. Called under the lock. */
+static void addWorkerStats(void) {
+    EvalStats eval;
+    GcStats gc;
+    HashConsStats hashCons;
+    getEvalStats(&eval);
+    addEvalStats(&workerStats.eval,&eval);
+    cek_getGcStats(&gc);
+    cek_addGcStats(&workerStats.gc,&gc);
+    hc_getStats(&hashCons);
+    workerStats.hashCons.lookups += hashCons.lookups;
+    workerStats.hashCons.hits += hashCons.hits;
+    workerStats.hashCons.nodes += hashCons.nodes;
 }
@@ -3,19 +3,23 @@
 # This is script that checks the memory leaks using Valgrind.
 #
 
-make debug
+make debug CC="gcc -DPOOL_USE_MALLOC"
 
-exprs=( "x" "X" "(lambda x x)" "(lambda x y)" "(lambda x (lambda y y))" "(lambda x (lambda y x))" "(lambda x (lambda y y) z)" "x y" "x (lambda y y)" "(lambda x x) y" "(lambda x x) (lambda y y)" "(lambda x x) (lambda y y) z" "(lambda x x) (lambda y y) 1" "(lambda x x x)" "(lambda x (lambda x x))" "(lambda x (lambda y x))" "(lambda x (lambda y y))" "(lambda p (lambda q p q p))" "(lambda p (lambda q p p q))" "(lambda p (lambda a (lambda b p b a)))" "(lambda p (lambda a (lambda b p a b)))" "(lambda x (lambda y (lambda f f x y)))" "(lambda p p (lambda x (lambda y x)))" "(lambda p p (lambda x (lambda y y)))" "(lambda x (lambda y (lambda z y)))" "(lambda p (lambda x (lambda y (lambda a (lambda b b)))))" "(x)" "((lambda x x))" "((x))" "((lambda x x) y)" "(x x)" "((x x))" "(((lambda x x) u) v)" "(u ((lambda x x) v))" "((lambda x x) ((lambda y y) z))" "((lambda x x) ((lambda y y) 1))" "(lambda f (lambda x f (f x)))" "(lambda f (lambda x f (f (f x))))" "(lambda n (lambda f (lambda x f (n f x))))" "(lambda m (lambda n (lambda f (lambda x m f (n f x)))))" "(lambda n (lambda f (lambda x n (lambda g (lambda h h (g f))) (lambda u x) (lambda u u))))" "(lambda g (lambda x g (x x)) (lambda x g (x x)))" "A" "ab" "abc" "aAa" "AB" "ABC" "AaZ" "var" "_" "__" "_a" "a_" "A_a" "_a_" "(lambda name name)" "say hello" "_ _" "-1" "-50" "0" "100" "(lambda x 10)" "(lambda x x) 1" "(lambda x x) -10" "+ 1 1" "(+ 2 2)" "+ 1" "+ -1 +1" "(lambda x + x 1)" "+" "(lambda x (lambda y + x y))" "- 1 1" "* 1 1" "/ 1 1" "% 1 1" "+ (+ 1 2) 3"  "+ y" "* (+ 1 2) 3" "^ 2 4" "< 1 2" "> 1 2" "= 2 2" "<= 1 2" ">= 1 2" "!= 2 2" "1 1" "x 1" "(lambda x (lambda y + (* x x) (* y y))) 3 4" "(lambda x (lambda y y x)) 1 (lambda x x)" "(lambda x (lambda y x (x y)) (x 1)) (lambda x x)" "+ (lambda x x) 1" "(and (= 2 3) (= 2 2))"  "(and (not (= 2 3)) (= 2 2))" )
+exprs=( "x" "X" "(lambda x x)" "(lambda x y)" "(lambda x (lambda y y))" "(lambda x (lambda y x))" "(lambda x (lambda y y) z)" "x y" "x (lambda y y)" "(lambda x x) y" "(lambda x x) (lambda y y)" "(lambda x x) (lambda y y) z" "(lambda x x) (lambda y y) 1" "(lambda x x x)" "(lambda x (lambda x x))" "(lambda x (lambda y x))" "(lambda x (lambda y y))" "(lambda p (lambda q p q p))" "(lambda p (lambda q p p q))" "(lambda p (lambda a (lambda b p b a)))" "(lambda p (lambda a (lambda b p a b)))" "(lambda x (lambda y (lambda f f x y)))" "(lambda p p (lambda x (lambda y x)))" "(lambda p p (lambda x (lambda y y)))" "(lambda x (lambda y (lambda z y)))" "(lambda p (lambda x (lambda y (lambda a (lambda b b)))))" "(x)" "((lambda x x))" "((x))" "((lambda x x) y)" "(x x)" "((x x))" "(((lambda x x) u) v)" "(u ((lambda x x) v))" "((lambda x x) ((lambda y y) z))" "((lambda x x) ((lambda y y) 1))" "(lambda f (lambda x f (f x)))" "(lambda f (lambda x f (f (f x))))" "(lambda n (lambda f (lambda x f (n f x))))" "(lambda m (lambda n (lambda f (lambda x m f (n f x)))))" "(lambda n (lambda f (lambda x n (lambda g (lambda h h (g f))) (lambda u x) (lambda u u))))" "(lambda g (lambda x g (x x)) (lambda x g (x x)))" "A" "ab" "abc" "aAa" "AB" "ABC" "AaZ" "var" "_" "__" "_a" "a_" "A_a" "_a_" "(lambda name name)" "say hello" "_ _" "-1" "-50" "0" "100" "(lambda x 10)" "(lambda x x) 1" "(lambda x x) -10" "+ 1 1" "(+ 2 2)" "+ 1" "+ -1 +1" "(lambda x + x 1)" "+" "(lambda x (lambda y + x y))" "- 1 1" "* 1 1" "/ 1 1" "% 1 1" "+ (+ 1 2) 3"  "+ y" "* (+ 1 2) 3" "^ 2 4" "< 1 2" "> 1 2" "= 2 2" "<= 1 2" ">= 1 2" "!= 2 2" "1 1" "x 1" "+ 9223372036854775807 1" "^ 2 100" "/ (^ 2 100) (^ 2 40)" "% (^ 10 30) 7" "= (^ 2 70) (* (^ 2 35) (^ 2 35))" "123456789012345678901234567890" "/ 1 0" "% 1 0" "(lambda x (lambda y + (* x x) (* y y))) 3 4" "(lambda x (lambda y y x)) 1 (lambda x x)" "(lambda x (lambda y x (x y)) (x 1)) (lambda x x)" "+ (lambda x x) 1" "(and (= 2 3) (= 2 2))"  "(and (not (= 2 3)) (= 2 2))" "(lambda x (lambda x x)) 1 2" "(lambda x (lambda y x)) 1 2" "(lambda x (lambda y y x)) 1" "Y (lambda f (lambda n ((<= n 0) (lambda d 1) (lambda d * n (f (- n 1)))) 0)) 5" "(lambda b (lambda z b)) (< 1 2)" "(lambda x x" "(lambda x
+  x))" )
 
 ERROR_CODE=5
-for expr in "${exprs[@]}"
+for options in "-e cek" "-e bytecode" "-e cc" "-e ck" "-e krivine" "-s need" "-p 2" "-g 4" "-s need -g 4"
 do
-    valgrind --tool=memcheck --leak-check=yes --error-exitcode=$ERROR_CODE ./test "$expr"
-    if [ $? -eq $ERROR_CODE ]
-    then
-        echo "Memory leaks when evaluating: $expr"
-        exit
-    fi
+    for expr in "${exprs[@]}"
+    do
+        valgrind --tool=memcheck --leak-check=yes --error-exitcode=$ERROR_CODE ./test $options "$expr"
+        if [ $? -eq $ERROR_CODE ]
+        then
+            echo "Memory leaks when evaluating with $options: $expr"
+            exit
+        fi
+    done
 done
 
 echo "Success! No memory leak found."
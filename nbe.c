@@ -0,0 +1,810 @@
+/******************************************************************/
+/* File: nbe.c                                                    */
+/* Implementation of the normalization by evaluation engine.      */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include "globals.h"
+#include "util.h"
+#include "pool.h"
+#include "symbol.h"
+#include "primitive.h"
+#include "cek_machine.h"
+#include "debruijn.h"
+#include "eval.h"
+#include "nbe.h"
+
+/* Kinds of semantic values. */
+typedef enum {
+    NumV,       /* a constant */
+    ClosureV,   /* an abstraction and its environment */
+    VarV,       /* a fresh variable, identified by its binder level */
+    AppV,       /* a neutral term applied to an argument */
+    PrimV,      /* a primitive on operands that are not both constants */
+    ThunkV      /* a delayed argument */
+} ValueKind;
+
+struct frameStruct;
+
+/*
+ * Values are reference counted. A thunk holds its expression and
+ * environment until it is forced, then only its value in children[0].
+ */
+typedef struct valueStruct {
+    ValueKind kind;
+    int refCount;
+    int64_t number;             /* constant or binder level */
+    BigNum *big;                /* only for NumV beyond 64 bits */
+    const char *name;           /* primitive name, only for PrimV */
+    TreeNode *expr;             /* only for ClosureV and delayed ThunkV */
+    struct frameStruct *env;    /* only for ClosureV and delayed ThunkV */
+    struct valueStruct *children[2];
+} Value;
+
+/* An environment frame binding one argument. */
+typedef struct frameStruct {
+    Value *value;
+    struct frameStruct *parent;
+    int refCount;
+} Frame;
+
+/* A binder around the value being read back, by level. */
+typedef struct {
+    int binder;     /* the index of its name */
+    int shadowed;   /* level of the enclosing binder with the same name, or -1 */
+} Scope;
+
+/* How the binders of the result use a name. */
+typedef struct {
+    int level;      /* the innermost binder around the readback with it, or -1 */
+    int used;       /* if any binder of the result has it */
+    int suffix;     /* the next suffix to try for new names made from it */
+} NameUse;
+
+/* State of one evaluation. */
+typedef struct {
+    Environment *globals;
+    Value *booleans[2];         /* closures of false and true */
+    Value **numbers;            /* shared integers, built on first use */
+    Stack names;                /* names of the binders of the result */
+    Stack scopes;               /* Scope of the binders around the readback */
+    NameUse *uses;              /* by symbol id */
+    int useCapacity;
+    Meter meter;                /* a step per expression and value read back */
+    long depth;                 /* values waiting to be read back */
+} Machine;
+
+/* Kinds of continuations of the evaluation. */
+typedef enum {
+    ArgumentC,  /* apply the value to the argument of expr */
+    OperandC,   /* evaluate the second operand of expr */
+    PrimitiveC, /* apply the primitive of expr to value and the value */
+    UpdateC     /* remember the value of the delayed argument in value */
+} NbeContinuationKind;
+
+/* The work left once the expression being evaluated has a value. */
+typedef struct {
+    NbeContinuationKind kind;
+    TreeNode *expr;
+    Frame *env;
+    Value *value;
+} NbeContinuation;
+
+/* A value to read back into place, or the scope at level to close. */
+typedef struct {
+    Value *value;
+    int level;
+    TreeNode **place;
+} ReadbackItem;
+
+static THREAD_LOCAL NbeStats stats;
+
+static Value * eval(Machine *m, TreeNode *expr, Frame *env);
+
+static Value * newValue(ValueKind kind) {
+    Value *value = pool_alloc(sizeof(Value));
+    value->kind = kind;
+    value->refCount = 1;
+    value->number = 0;
+    value->big = NULL;
+    value->name = NULL;
+    value->expr = NULL;
+    value->env = NULL;
+    value->children[0] = NULL;
+    value->children[1] = NULL;
+    return value;
+}
+
+static Value * retainValue(Value *value) {
+    value->refCount += 1;
+    return value;
+}
+
+/*
+ * Releases the value and the frame. What they held alone is released
+ * next, from a stack instead of recursing, so long chains of values don't
+ * overflow the C stack.
+ */
+static void release(Value *value, Frame *frame) {
+    Stack stack;
+    Value **item;
+    initStack(&stack,sizeof(Value*));
+    for(;;) {
+        while(frame!=NULL && --frame->refCount==0) {
+            Frame *parent = frame->parent;
+            // without memory for the stack, the value is leaked
+            if((item = pushStack(&stack))!=NULL) *item = frame->value;
+            pool_free(frame,sizeof(Frame));
+            frame = parent;
+        }
+        frame = NULL;
+        if(value!=NULL && --value->refCount==0) {
+            if(value->expr!=NULL) {
+                deleteTree(value->expr);
+            }
+            big_release(value->big);
+            frame = value->env;
+            if(value->children[0]!=NULL && (item = pushStack(&stack))!=NULL) {
+                *item = value->children[0];
+            }
+            if(value->children[1]!=NULL && (item = pushStack(&stack))!=NULL) {
+                *item = value->children[1];
+            }
+            pool_free(value,sizeof(Value));
+            value = NULL;
+            continue;
+        }
+        if((item = popStack(&stack))==NULL) break;
+        value = *item;
+    }
+    freeStack(&stack);
+}
+
+static void releaseValue(Value *value) {
+    if(value!=NULL) {
+        release(value,NULL);
+    }
+}
+
+static Frame * newFrame(Value *value, Frame *parent) {
+    Frame *frame = pool_alloc(sizeof(Frame));
+    frame->value = value;
+    frame->parent = parent;
+    frame->refCount = 1;
+    return frame;
+}
+
+static Frame * retainFrame(Frame *frame) {
+    if(frame!=NULL) {
+        frame->refCount += 1;
+    }
+    return frame;
+}
+
+static void releaseFrame(Frame *frame) {
+    if(frame!=NULL) {
+        release(NULL,frame);
+    }
+}
+
+static Value * newClosure(TreeNode *abs, Frame *env) {
+    Value *value = newValue(ClosureV);
+    value->expr = retainTree(abs);
+    value->env = retainFrame(env);
+    return value;
+}
+
+static Value * newThunk(TreeNode *expr, Frame *env) {
+    Value *value = newValue(ThunkV);
+    value->expr = retainTree(expr);
+    value->env = retainFrame(env);
+    return value;
+}
+
+/*
+ * Gets the value of the integer, taking over the reference to its big
+ * number. The integers from SHARED_MIN to SHARED_MAX are shared.
+ */
+static Value * numberValue(Machine *m, Number number) {
+    Value **shared = NULL;
+    if(number.big==NULL && number.value>=SHARED_MIN && number.value<=SHARED_MAX) {
+        if(m->numbers==NULL) {
+            m->numbers = calloc(SHARED_MAX-SHARED_MIN+1,sizeof(Value*));
+        }
+        shared = &m->numbers[number.value-SHARED_MIN];
+        if(*shared!=NULL) {
+            return retainValue(*shared);
+        }
+    }
+    Value *value = newValue(NumV);
+    value->number = number.value;
+    value->big = number.big;
+    if(shared!=NULL) {
+        *shared = retainValue(value);
+    }
+    return value;
+}
+
+/*
+ * Gets the value of the identifier without forcing it, so a delayed
+ * argument passed on is shared. Returns NULL if it is not defined.
+ */
+static Value * lookup(Machine *m, TreeNode *id, Frame *env) {
+    int n = id->index;
+    if(n<0) return NULL;
+    for(;env!=NULL && n>0;n--) {
+        env = env->parent;
+    }
+    if(env!=NULL) {
+        return retainValue(env->value);
+    }
+    Environment *global = m->globals;
+    for(;global!=NULL && n>0;n--) {
+        global = global->parent;
+    }
+    if(global==NULL) return NULL;
+    // globals are closed, and delayed unless they are functions
+    if(global->closure.expr->kind==AbsK) {
+        return newClosure(global->closure.expr,NULL);
+    }
+    return newThunk(global->closure.expr,NULL);
+}
+
+/*
+ * Remembers the value of the delayed argument. Both are consumed. Returns
+ * a new reference to the value.
+ */
+static Value * update(Value *thunk, Value *value) {
+    if(thunk->children[0]==NULL) {
+        stats.forced++;
+        thunk->children[0] = retainValue(value);
+        deleteTree(thunk->expr);
+        thunk->expr = NULL;
+        releaseFrame(thunk->env);
+        thunk->env = NULL;
+    }
+    releaseValue(thunk);
+    return value;
+}
+
+/* Evaluates the delayed argument once. Returns a new reference. */
+static Value * force(Machine *m, Value *value) {
+    if(value->kind!=ThunkV) {
+        return retainValue(value);
+    }
+    if(value->children[0]==NULL) {
+        Value *result = eval(m,value->expr,value->env);
+        if(result==NULL) return NULL;
+        return update(retainValue(value),result);
+    }
+    return retainValue(value->children[0]);
+}
+
+/* Delays the argument expression, unless it is cheap to evaluate. */
+static Value * delay(Machine *m, TreeNode *expr, Frame *env) {
+    Value *value = NULL;
+    switch(expr->kind) {
+        case IdK:
+            value = lookup(m,expr,env);
+            if(value==NULL) {
+                fprintf(errOut, "Error: %s is not a defined variable or function.\n", expr->name);
+            }
+            return value;
+        case ConstK:
+            return numberValue(m,(Number){expr->value,big_retain(expr->big)});
+        case AbsK:
+            return newClosure(expr,env);
+        default:
+            return newThunk(expr,env);
+    }
+}
+
+/*
+ * Applies the function to the argument. Both are consumed. The body of a
+ * closure is evaluated by a machine of its own, so eval() applies closures
+ * itself.
+ */
+static Value * apply(Machine *m, Value *fun, Value *arg) {
+    Value *result = NULL;
+    Frame *frame = NULL;
+    switch(fun->kind) {
+        case ClosureV:
+            stats.betaSteps++;
+            frame = newFrame(arg,retainFrame(fun->env));
+            result = eval(m,fun->expr->children[1],frame);
+            releaseFrame(frame);
+            releaseValue(fun);
+            return result;
+        case VarV:
+        case AppV:
+        case PrimV:
+            result = newValue(AppV);
+            result->children[0] = fun;
+            result->children[1] = arg;
+            return result;
+        default:
+            fprintf(errOut, "Error: cannot apply a constant to any argument.\n");
+            fprintf(errOut, "Expression:\t");
+            printNumber((Number){fun->number,fun->big},errOut);
+            fprintf(errOut, "\n");
+            releaseValue(fun);
+            releaseValue(arg);
+            return NULL;
+    }
+}
+
+/* Applies the primitive to the operands. Both are consumed. */
+static Value * applyPrim(Machine *m, TreeNode *prim, Value *x, Value *y) {
+    Value *result = NULL;
+    Number value;
+    PrimResultKind kind;
+    if(x->kind==ClosureV || y->kind==ClosureV) {
+        fprintf(errOut, "Error: %s can only be applied on constants.\n", prim->name);
+    } else if(x->kind==NumV && y->kind==NumV) {
+        stats.primSteps++;
+        kind = applyPrimitive(lookupPrimitive(prim->name),(Number){x->number,x->big},
+                (Number){y->number,y->big},&value);
+        switch(kind) {
+            case PrimNumber:
+                result = numberValue(m,value);
+                break;
+            case PrimBoolean:
+                result = retainValue(m->booleans[value.value!=0]);
+                break;
+            default:
+                primitiveError(kind,prim->name);
+        }
+    } else {
+        // stuck on a fresh variable
+        result = newValue(PrimV);
+        result->name = prim->name;
+        result->children[0] = x;
+        result->children[1] = y;
+        return result;
+    }
+    releaseValue(x);
+    releaseValue(y);
+    return result;
+}
+
+static int pushContinuation(Stack *stack, NbeContinuationKind kind, TreeNode *expr,
+        Frame *env, Value *value) {
+    NbeContinuation *k = pushStack(stack);
+    if(k==NULL) return 0;
+    k->kind = kind;
+    k->expr = retainTree(expr);
+    k->env = retainFrame(env);
+    k->value = value;
+    return 1;
+}
+
+static void dropContinuation(NbeContinuation *k) {
+    deleteTree(k->expr);
+    releaseFrame(k->env);
+    releaseValue(k->value);
+}
+
+/*
+ * Evaluates the expression to a value which is not delayed. The work left
+ * is kept on a stack of continuations instead of recursing, so the depth
+ * of the terms is only bounded by the budget: a step per expression, and
+ * the continuations and the values waiting to be read back as frames.
+ * Returns a new reference, or NULL on errors and once the budget is
+ * exhausted.
+ */
+static Value * eval(Machine *m, TreeNode *expr, Frame *env) {
+    Stack stack;
+    NbeContinuation *top, k;
+    Value *value = NULL, *arg = NULL;
+    initStack(&stack,sizeof(NbeContinuation));
+    // the machine holds a reference to the expression and the environment
+    retainTree(expr);
+    retainFrame(env);
+    for(;;) {
+        if(expr!=NULL) {
+            TreeNode *next = NULL;
+            Frame *nextEnv = NULL;
+            if(!meterStep(&m->meter,m->depth+stack.size+1)) goto failed;
+            switch(expr->kind) {
+                case IdK:
+                    value = lookup(m,expr,env);
+                    if(value==NULL) {
+                        fprintf(errOut, "Error: %s is not a defined variable or function.\n", expr->name);
+                        goto failed;
+                    }
+                    if(value->kind==ThunkV && value->children[0]==NULL) {
+                        // evaluate the delayed argument, then remember its value
+                        if(!pushContinuation(&stack,UpdateC,NULL,NULL,value)) goto failed;
+                        next = retainTree(value->expr);
+                        nextEnv = retainFrame(value->env);
+                        value = NULL;
+                    } else {
+                        arg = force(m,value);
+                        releaseValue(value);
+                        value = arg;
+                    }
+                    break;
+                case ConstK:
+                    value = numberValue(m,(Number){expr->value,big_retain(expr->big)});
+                    break;
+                case AbsK:
+                    value = newClosure(expr,env);
+                    break;
+                case AppK:
+                case PrimiK:
+                    if(!pushContinuation(&stack,expr->kind==AppK ? ArgumentC : OperandC,
+                            expr,env,NULL)) {
+                        goto failed;
+                    }
+                    next = retainTree(expr->children[0]);
+                    nextEnv = retainFrame(env);
+                    break;
+                default:
+                    fprintf(errOut,"Unknown expression type.\n");
+                    goto failed;
+            }
+            deleteTree(expr);
+            releaseFrame(env);
+            expr = next;
+            env = nextEnv;
+            if(expr!=NULL) continue;
+        }
+
+        // pass the value to the continuation on the top
+        if((top = popStack(&stack))==NULL) break;
+        k = *top;
+        switch(k.kind) {
+            case ArgumentC:
+                arg = delay(m,k.expr->children[1],k.env);
+                if(arg==NULL) {
+                    dropContinuation(&k);
+                    goto failed;
+                }
+                if(value->kind==ClosureV) {
+                    stats.betaSteps++;
+                    expr = retainTree(value->expr->children[1]);
+                    env = newFrame(arg,retainFrame(value->env));
+                    releaseValue(value);
+                    value = NULL;
+                } else {
+                    value = apply(m,value,arg);
+                }
+                break;
+            case OperandC:
+                if(!pushContinuation(&stack,PrimitiveC,k.expr,NULL,value)) {
+                    dropContinuation(&k);
+                    goto failed;
+                }
+                expr = retainTree(k.expr->children[1]);
+                env = retainFrame(k.env);
+                value = NULL;
+                break;
+            case PrimitiveC:
+                value = applyPrim(m,k.expr,k.value,value);
+                k.value = NULL;
+                break;
+            case UpdateC:
+                value = update(k.value,value);
+                k.value = NULL;
+                break;
+        }
+        dropContinuation(&k);
+        if(expr==NULL && value==NULL) goto failed;
+    }
+    freeStack(&stack);
+    return value;
+
+failed:
+    releaseValue(value);
+    deleteTree(expr);
+    releaseFrame(env);
+    while((top = popStack(&stack))!=NULL) {
+        dropContinuation(top);
+    }
+    freeStack(&stack);
+    return NULL;
+}
+
+/* Gets the use of the interned name, or NULL if there is not enough memory. */
+static NameUse * nameUse(Machine *m, const char *name) {
+    int id = sym_id(name);
+    if(id>=m->useCapacity) {
+        int capacity = m->useCapacity==0 ? 256 : m->useCapacity;
+        while(capacity<=id) {
+            capacity *= 2;
+        }
+        NameUse *uses = realloc(m->uses,capacity*sizeof(NameUse));
+        if(uses==NULL) {
+            fprintf(errOut,"Out of memory.\n");
+            return NULL;
+        }
+        int i;
+        for(i=m->useCapacity;i<capacity;i++) {
+            uses[i].level = -1;
+            uses[i].used = 0;
+            uses[i].suffix = 0;
+        }
+        m->uses = uses;
+        m->useCapacity = capacity;
+    }
+    return &m->uses[id];
+}
+
+static Scope * scopeAt(Machine *m, int level) {
+    return (Scope*)m->scopes.items+level;
+}
+
+static const char ** nameAt(Machine *m, int binder) {
+    return (const char**)m->names.items+binder;
+}
+
+/*
+ * Opens the scope of a binder at the level, under its own name. Returns
+ * the index of its name, or -1 if there is not enough memory.
+ */
+static int bindName(Machine *m, const char *name, int level) {
+    NameUse *use = nameUse(m,name);
+    const char **slot = pushStack(&m->names);
+    m->scopes.size = level;
+    Scope *scope = pushStack(&m->scopes);
+    if(use==NULL || slot==NULL || scope==NULL) return -1;
+    *slot = name;
+    scope->binder = m->names.size-1;
+    scope->shadowed = use->level;
+    use->level = level;
+    use->used = 1;
+    return scope->binder;
+}
+
+/* Closes the scope of the binder at the level. */
+static void unbindName(Machine *m, int level) {
+    Scope *scope = scopeAt(m,level);
+    m->uses[sym_id(*nameAt(m,scope->binder))].level = scope->shadowed;
+    m->scopes.size = level;
+}
+
+/*
+ * Renames the innermost binder with its name, at the level, because it
+ * would capture a variable of an enclosing one. The new name is its name
+ * with a suffix which no binder of the result has: '_', then '_' and
+ * letters. Returns 0 if there is not enough memory.
+ */
+static int renameBinder(Machine *m, int level) {
+    Scope *scope = scopeAt(m,level);
+    const char **name = nameAt(m,scope->binder);
+    int len = strlen(*name);
+    int suffix = m->uses[sym_id(*name)].suffix;
+    char *candidate = malloc(len+16);
+    const char *fresh = NULL;
+    NameUse *use = NULL;
+    if(candidate==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return 0;
+    }
+    do {
+        int i, n = suffix++;
+        sprintf(candidate,"%s_",*name);
+        for(i=len+1;n>0;n=(n-1)/26) {
+            candidate[i++] = 'a'+(n-1)%26;
+        }
+        candidate[i] = '\0';
+        fresh = sym_intern(candidate);
+        use = fresh==NULL ? NULL : nameUse(m,fresh);
+    } while(use!=NULL && use->used);
+    free(candidate);
+    if(use==NULL) return 0;
+
+    NameUse *old = &m->uses[sym_id(*name)];
+    old->level = scope->shadowed;
+    old->suffix = suffix;
+    scope->shadowed = use->level;
+    use->level = level;
+    use->used = 1;
+    *name = fresh;
+    return 1;
+}
+
+/*
+ * Reads back the variable of the binder at the level. The inner binders
+ * with the same name would capture it, so they are renamed. Its name is
+ * filled in by nameBinders(), since it may still change.
+ */
+static TreeNode * readbackVar(Machine *m, int level) {
+    int binder = scopeAt(m,level)->binder;
+    int inner;
+    while((inner = m->uses[sym_id(*nameAt(m,binder))].level)>level) {
+        if(!renameBinder(m,inner)) return NULL;
+    }
+    TreeNode *var = newTreeNode(IdK);
+    if(var!=NULL) {
+        var->index = binder;
+    }
+    return var;
+}
+
+/* Gives the binders and the variables of the result their final names. */
+static void nameBinders(Machine *m, TreeNode *expr) {
+    Stack stack;
+    TreeNode **item;
+    initStack(&stack,sizeof(TreeNode*));
+    item = pushStack(&stack);
+    *item = expr;
+    while((item = popStack(&stack))!=NULL) {
+        expr = *item;
+        if(expr->kind==IdK) {
+            expr->name = *nameAt(m,expr->index);
+        } else if(expr->kind==AbsK || expr->kind==AppK || expr->kind==PrimiK) {
+            item = pushStack(&stack);
+            *item = expr->children[0];
+            item = pushStack(&stack);
+            *item = expr->children[1];
+        }
+    }
+    freeStack(&stack);
+}
+
+static int pushReadback(Stack *stack, Value *value, int level, TreeNode **place) {
+    ReadbackItem *item = pushStack(stack);
+    if(item==NULL) return 0;
+    item->value = value;
+    item->level = level;
+    item->place = place;
+    return 1;
+}
+
+/*
+ * Reads the value back as a tree in normal form. The value is consumed.
+ * A closure is applied to the variable of its binder, and the result read
+ * back under it. The values waiting to be read back are kept on a stack
+ * instead of recursing. Returns NULL on errors and once the budget is
+ * exhausted.
+ */
+static TreeNode * readback(Machine *m, Value *value) {
+    TreeNode *result = NULL, *node = NULL;
+    Stack stack;
+    ReadbackItem *top, item;
+    Value *body = NULL;
+    initStack(&stack,sizeof(ReadbackItem));
+    if(!pushReadback(&stack,value,0,&result)) {
+        releaseValue(value);
+        return NULL;
+    }
+    while((top = popStack(&stack))!=NULL) {
+        item = *top;
+        value = item.value;
+        if(value==NULL) {
+            unbindName(m,item.level);
+            continue;
+        }
+        m->depth = stack.size;
+        if(!meterStep(&m->meter,m->depth+1)) {
+            releaseValue(value);
+            goto failed;
+        }
+        switch(value->kind) {
+            case NumV:
+                *item.place = constantNode((Number){value->number,big_retain(value->big)});
+                releaseValue(value);
+                break;
+            case VarV:
+                *item.place = readbackVar(m,value->number);
+                releaseValue(value);
+                if(*item.place==NULL) goto failed;
+                break;
+            case ThunkV:
+                body = force(m,value);
+                releaseValue(value);
+                if(body==NULL) goto failed;
+                if(!pushReadback(&stack,body,item.level,item.place)) {
+                    releaseValue(body);
+                    goto failed;
+                }
+                break;
+            case ClosureV:
+                node = *item.place = newTreeNode(AbsK);
+                node->children[0] = newTreeNode(IdK);
+                node->children[0]->index = bindName(m,value->expr->children[0]->name,
+                        item.level);
+                if(node->children[0]->index<0) {
+                    releaseValue(value);
+                    goto failed;
+                }
+                body = newValue(VarV);
+                body->number = item.level;
+                body = apply(m,value,body);
+                if(body==NULL) goto failed;
+                // the scope closes once the body is read back
+                if(!pushReadback(&stack,NULL,item.level,NULL)
+                        || !pushReadback(&stack,body,item.level+1,&node->children[1])) {
+                    releaseValue(body);
+                    goto failed;
+                }
+                break;
+            case AppV:
+            case PrimV:
+                node = *item.place = newTreeNode(value->kind==AppV ? AppK : PrimiK);
+                node->name = value->name;
+                // the first operand is read back first
+                if(!pushReadback(&stack,retainValue(value->children[1]),item.level,
+                        &node->children[1])) {
+                    releaseValue(value->children[1]);
+                    releaseValue(value);
+                    goto failed;
+                }
+                if(!pushReadback(&stack,retainValue(value->children[0]),item.level,
+                        &node->children[0])) {
+                    releaseValue(value->children[0]);
+                    releaseValue(value);
+                    goto failed;
+                }
+                releaseValue(value);
+                break;
+            default:
+                fprintf(errOut,"Unknown value kind.\n");
+                releaseValue(value);
+                goto failed;
+        }
+    }
+    freeStack(&stack);
+    return result;
+
+failed:
+    while((top = popStack(&stack))!=NULL) {
+        releaseValue(top->value);
+    }
+    freeStack(&stack);
+    deleteTree(result);
+    return NULL;
+}
+
+TreeNode * nbe_evaluate(TreeNode *expr, Environment *globals) {
+    Machine m;
+    m.globals = globals;
+    initStack(&m.names,sizeof(const char*));
+    initStack(&m.scopes,sizeof(Scope));
+    m.uses = NULL;
+    m.useCapacity = 0;
+    m.numbers = NULL;
+    m.depth = 0;
+    startMeter(&m.meter);
+    int i;
+    for(i=0;i<2;i++) {
+        TreeNode *boolean = booleanNode(i);
+        m.booleans[i] = newClosure(boolean,NULL);
+        deleteTree(boolean);
+    }
+
+    TreeNode *result = NULL;
+    if(db_resolve(expr,globals)) {
+        Value *value = eval(&m,expr,NULL);
+        if(value!=NULL) {
+            result = readback(&m,value);
+        }
+    }
+    deleteTree(expr);
+    if(result!=NULL) {
+        nameBinders(&m,result);
+        // no binder captures a variable, so names resolve to the right binders
+        if(!db_resolve(result,NULL)) {
+            deleteTree(result);
+            result = NULL;
+        }
+    }
+
+    releaseValue(m.booleans[0]);
+    releaseValue(m.booleans[1]);
+    if(m.numbers!=NULL) {
+        for(i=0;i<SHARED_MAX-SHARED_MIN+1;i++) {
+            releaseValue(m.numbers[i]);
+        }
+        free(m.numbers);
+    }
+    freeStack(&m.names);
+    freeStack(&m.scopes);
+    free(m.uses);
+    return result;
+}
+
+void nbe_getStats(NbeStats *s) {
+    *s = stats;
+}
@@ -0,0 +1,47 @@
+/******************************************************************/
+/* File: nbe.h                                                    */
+/* Interfaces of the normalization by evaluation engine.          */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _NBE_H_
+#define _NBE_H_
+
+/*
+ * The engine computes the full normal form of an expression, reducing
+ * under abstractions too. The expression is evaluated to a semantic value
+ * by a lazy environment machine: arguments are delayed and evaluated at
+ * most once, so the engine finds a normal form whenever normal order
+ * reduction does. The value is then read back as a tree, and a closure is
+ * read back by applying it to a fresh variable and reading back the
+ * result. Applications and primitives on fresh variables are kept as
+ * neutral terms.
+ *
+ * Free identifiers are replaced by the global functions, which are
+ * normalized as well. Binders keep their names, unless they would capture
+ * a variable of an enclosing binder with the same name. Then they get a
+ * name which no other binder of the result has: their name with '_'
+ * appended, then '_' and letters.
+ */
+
+/* Statistics of the engine, accumulated over the evaluations of a thread. */
+typedef struct {
+    size_t betaSteps;   /* Closures applied to arguments. */
+    size_t primSteps;   /* Primitive functions applied. */
+    size_t forced;      /* Delayed arguments evaluated. */
+} NbeStats;
+
+/*
+ * Evaluates the expression in the global environment and returns its
+ * normal form, or NULL on errors. The expression is consumed. The engine
+ * spends the budget of the context (see setBudget()), counting a step per
+ * expression evaluated and value read back, and the pending evaluations
+ * and values as frames. It keeps them on stacks of its own, so deep terms
+ * don't overflow the C stack. An expression without normal form fails
+ * once the budget is exhausted.
+ */
+TreeNode * nbe_evaluate(TreeNode *expr, Environment *globals);
+
+/* Gets the statistics of the engine. */
+void nbe_getStats(NbeStats *stats);
+#endif
@@ -0,0 +1,245 @@
+/******************************************************************/
+/* File: parallel.c                                               */
+/* Implementation of the work-stealing scheduler.                 */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include "globals.h"
+#include "pool.h"
+#include "parallel.h"
+
+/* Queued tasks per worker beyond which forking is refused. */
+#define MAX_QUEUED 4
+
+typedef enum {
+    TaskQueued, TaskRunning, TaskDone
+} TaskState;
+
+struct parTask {
+    TaskFun fun;
+    void *arg;
+    TaskState state;
+    int deque;                  /* where it is queued */
+    atomic_int cancelled;
+    struct parTask *parent;     /* the task that forked it, if any */
+};
+
+typedef struct {
+    ParTask **tasks;            /* oldest first */
+    int size;
+    int capacity;
+} Deque;
+
+/*
+ * One lock protects all the deques and task states. Tasks are large
+ * subterms, so it is taken rarely compared to the work done.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static pthread_t *threads = NULL;
+static Deque *deques = NULL;    /* deques[0] is shared by other threads */
+static int workerNum = 0;
+static int queued = 0;
+static int stopping = 0;
+static void (*exitHook)(void) = NULL;
+
+/* The deque of the thread, and the task it runs. */
+static THREAD_LOCAL int self = 0;
+static THREAD_LOCAL ParTask *running = NULL;
+
+/* Returns 0 if the deque cannot grow. */
+static int push(Deque *deque, ParTask *task) {
+    if(deque->size==deque->capacity) {
+        int capacity = deque->capacity==0 ? 16 : deque->capacity*2;
+        ParTask **tasks = realloc(deque->tasks,capacity*sizeof(ParTask*));
+        if(tasks==NULL) {
+            return 0;
+        }
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+    }
+    deque->tasks[deque->size++] = task;
+    return 1;
+}
+
+static void removeAt(Deque *deque, int i) {
+    memmove(&deque->tasks[i],&deque->tasks[i+1],(deque->size-i-1)*sizeof(ParTask*));
+    deque->size--;
+    queued--;
+}
+
+/* Takes the newest task of the own deque, or steals the oldest of another. */
+static ParTask * takeTask(void) {
+    ParTask *task = NULL;
+    Deque *deque = &deques[self];
+    int i;
+    if(deque->size>0) {
+        task = deque->tasks[deque->size-1];
+        removeAt(deque,deque->size-1);
+        return task;
+    }
+    for(i=1;i<=workerNum;i++) {
+        deque = &deques[(self+i)%(workerNum+1)];
+        if(deque->size>0) {
+            task = deque->tasks[0];
+            removeAt(deque,0);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static void * worker(void *arg) {
+    ParTask *task = NULL;
+    self = (int)(intptr_t)arg;
+    pthread_mutex_lock(&lock);
+    while(1) {
+        task = takeTask();
+        if(task==NULL) {
+            if(stopping) break;
+            pthread_cond_wait(&changed,&lock);
+            continue;
+        }
+        task->state = TaskRunning;
+        pthread_mutex_unlock(&lock);
+
+        running = task;
+        task->fun(task->arg);
+        running = NULL;
+
+        pthread_mutex_lock(&lock);
+        task->state = TaskDone;
+        pthread_cond_broadcast(&changed);
+    }
+    pthread_mutex_unlock(&lock);
+
+    if(exitHook!=NULL) {
+        exitHook();
+    }
+    pool_releaseAll();
+    return NULL;
+}
+
+int par_start(int workers, void (*exitFun)(void)) {
+    int i;
+    if(workerNum>0) {
+        par_stop();
+    }
+    exitHook = exitFun;
+    threads = malloc(workers*sizeof(pthread_t));
+    deques = calloc(workers+1,sizeof(Deque));
+    pthread_mutex_lock(&lock);
+    workerNum = workers;
+    pthread_mutex_unlock(&lock);
+    for(i=0;i<workers;i++) {
+        if(pthread_create(&threads[i],NULL,worker,(void*)(intptr_t)(i+1))!=0) {
+            break;
+        }
+    }
+    if(i<workers) {
+        fprintf(errOut,"Error: cannot start the worker threads.\n");
+        pthread_mutex_lock(&lock);
+        workerNum = i;
+        pthread_mutex_unlock(&lock);
+        par_stop();
+        return 0;
+    }
+    return 1;
+}
+
+void par_stop(void) {
+    int i;
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    for(i=0;i<workerNum;i++) {
+        pthread_join(threads[i],NULL);
+    }
+    if(deques!=NULL) {
+        for(i=0;i<=workerNum;i++) {
+            free(deques[i].tasks);
+        }
+    }
+    free(deques);
+    free(threads);
+    deques = NULL;
+    threads = NULL;
+    workerNum = 0;
+    stopping = 0;
+}
+
+int par_workers(void) {
+    return workerNum;
+}
+
+int par_isWorker(void) {
+    return self>0;
+}
+
+ParTask * par_fork(TaskFun fun, void *arg) {
+    if(workerNum==0) return NULL;
+    pthread_mutex_lock(&lock);
+    if(queued>=MAX_QUEUED*workerNum) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    ParTask *task = malloc(sizeof(ParTask));
+    if(task==NULL) {
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    task->fun = fun;
+    task->arg = arg;
+    task->state = TaskQueued;
+    task->deque = self;
+    atomic_init(&task->cancelled,0);
+    task->parent = running;
+    if(!push(&deques[self],task)) {
+        pthread_mutex_unlock(&lock);
+        free(task);
+        return NULL;
+    }
+    queued++;
+    pthread_cond_broadcast(&changed);
+    pthread_mutex_unlock(&lock);
+    return task;
+}
+
+int par_join(ParTask *task) {
+    int ran = 1;
+    int i;
+    pthread_mutex_lock(&lock);
+    if(task->state==TaskQueued) {
+        // take it back, it is most likely the newest task of the deque
+        Deque *deque = &deques[task->deque];
+        for(i=deque->size-1;deque->tasks[i]!=task;i--);
+        removeAt(deque,i);
+        ran = 0;
+    } else {
+        while(task->state!=TaskDone) {
+            pthread_cond_wait(&changed,&lock);
+        }
+    }
+    pthread_mutex_unlock(&lock);
+    free(task);
+    return ran;
+}
+
+int par_cancel(ParTask *task) {
+    atomic_store(&task->cancelled,1);
+    return par_join(task);
+}
+
+int par_cancelled(void) {
+    ParTask *task = NULL;
+    for(task=running;task!=NULL;task=task->parent) {
+        if(atomic_load(&task->cancelled)) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+/******************************************************************/
+/* File: parallel.h                                               */
+/* Definition of the work-stealing scheduler used to evaluate     */
+/* independent subterms in parallel.                              */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+/*
+ * Every worker thread has a deque of tasks. A task forked by a worker goes
+ * to the bottom of its own deque, and tasks forked by other threads go to
+ * a shared one. An idle worker takes the newest task of its own deque, or
+ * steals the oldest task of another deque, which is usually the largest.
+ *
+ * Tasks only run on the workers. A thread joining a task that no worker
+ * has started takes it back and does the work itself, so forking costs
+ * little when all the workers are busy, and a waiting thread never waits
+ * for queued work.
+ */
+
+/* A task runs the function on the argument. */
+typedef void (*TaskFun)(void *arg);
+typedef struct parTask ParTask;
+
+/*
+ * Starts the worker threads. Each worker calls exitFun, if it isn't NULL,
+ * before it exits. Returns 0 if the threads can't be created.
+ */
+int par_start(int workers, void (*exitFun)(void));
+
+/* Stops the workers, after the tasks they run are finished. */
+void par_stop(void);
+
+/* Returns the number of workers, 0 if they are not started. */
+int par_workers(void);
+
+/* Returns whether the calling thread is a worker. */
+int par_isWorker(void);
+
+/*
+ * Forks a task. Returns NULL if the workers are not started, enough
+ * tasks are queued already or memory runs out, in which case the caller
+ * should do the work itself.
+ */
+ParTask * par_fork(TaskFun fun, void *arg);
+
+/*
+ * Waits for the task and frees it. Returns 1 if a worker ran it, or 0 if
+ * it was taken back before it started.
+ */
+int par_join(ParTask *task);
+
+/*
+ * Like par_join(), but asks a running task to stop first. The function of
+ * the task should check par_cancelled() now and then.
+ */
+int par_cancel(ParTask *task);
+
+/*
+ * Returns whether the task the calling worker runs, or the task which
+ * forked it, was cancelled.
+ */
+int par_cancelled(void);
+#endif
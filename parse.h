@@ -0,0 +1,44 @@
+/******************************************************************/
+/* File: parse.h                                                  */
+/* Interfaces of the reentrant scanner and parser.                */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _PARSE_H_
+#define _PARSE_H_
+
+/*
+ * The scanner and the parser keep no global state: everything is in the
+ * parse context and the scanner object in it. A context must be used by
+ * one thread at a time, but different threads can parse with their own
+ * contexts at the same time. The context can be reused for many parses.
+ *
+ * Syntax errors are reported on errOut with their line and column, and
+ * the first one is also recorded in the context.
+ */
+typedef struct parseContext {
+    void *scanner;      /* The flex scanner. */
+    TreeNode *tree;     /* The result, set by the parser. */
+    int errors;         /* Number of syntax errors in the last parse. */
+    int line;           /* Position of the first syntax error. */
+    int column;
+} ParseContext;
+
+/* Initializes the context. */
+void parse_init(ParseContext *ctx);
+
+/* Frees the scanner of the context. */
+void parse_destroy(ParseContext *ctx);
+
+/* Parses the string. Returns NULL on syntax errors. */
+TreeNode * parse_string(ParseContext *ctx, const char *text);
+
+/*
+ * Parses the buffer in place instead of copying it. It must end with two
+ * NUL bytes, which are counted in the size. Returns NULL on syntax errors.
+ */
+TreeNode * parse_buffer(ParseContext *ctx, char *base, size_t size);
+
+/* Parses the string with a temporary context. */
+TreeNode * parse_expression(const char *text);
+#endif
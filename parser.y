@@ -9,54 +9,69 @@
 
 #include "globals.h"
 #include "util.h"
+#include "parse.h"
 
-#define YYSTYPE TreeNode *
-
-extern YYSTYPE tree;
+/*
+ * The stack of the parser is allocated on the heap and grows with the
+ * nesting of the expression, so deeply nested terms need more than the
+ * default limit of 10000.
+ */
+#define YYMAXDEPTH 10000000
 %}
 
+%code requires {
+struct parseContext;
+}
+
+%define api.pure full
+%define api.value.type {struct treeNode *}
+%locations
+%parse-param {void *scanner} {struct parseContext *ctx}
+%lex-param {void *scanner}
+
+%code {
+int yylex(YYSTYPE *lvalp, YYLTYPE *llocp, void *scanner);
+char * yyget_text(void *scanner);
+static void yyerror(YYLTYPE *loc, void *scanner, ParseContext *ctx, const char *message);
+}
+
 %token  LAMBDA
 %token  INT
 %token  ID
 
-%start expression_list
+/* free the partial trees on syntax errors */
+%destructor { deleteTree($$); } INT ID expression expression_list
+
+%start program
 
 %%
 
+program         : expression_list
+                    {
+                        ctx->tree = $1;
+                    }
+                ;
+
 expression_list : expression_list expression
                     {
                         $$ = newTreeNode(AppK);
                         $$->children[0] = $1;
                         $$->children[1] = $2;
-                        tree = $$;
                     }
                 |
                  expression
                     {
-                        tree = $1;
+                        $$ = $1;
                     }
                 ;
 
-expression      : ID    
-                    {
-                        $$ = newTreeNode(IdK);
-                        $$->name = stringCopy(yytext);
-                    }
+expression      : ID
                 | INT
-                    {
-                        $$ = newTreeNode(ConstK);
-                        $$->value = atoi(yytext);
-                    }
-                | '(' LAMBDA ID 
-                    {
-                        $$ = newTreeNode(IdK);
-                        $$->name = stringCopy(yytext);
-                    } 
-                    expression_list ')'
+                | '(' LAMBDA ID expression_list ')'
                     {
                         $$ = newTreeNode(AbsK);
-                        $$->children[0] = $4;
-                        $$->children[1] = $5;
+                        $$->children[0] = $3;
+                        $$->children[1] = $4;
                     }
                 | '(' expression_list ')'
                     {
@@ -66,8 +81,11 @@ expression      : ID
 
 %%
 
-int yyerror(char *message) {
-    fprintf(errOut,"%s\n",message);
-    fprintf(errOut,"\ttoken: %s\n",yytext);
-    return 0;
+static void yyerror(YYLTYPE *loc, void *scanner, ParseContext *ctx, const char *message) {
+    if(ctx->errors++==0) {
+        ctx->line = loc->first_line;
+        ctx->column = loc->first_column;
+    }
+    fprintf(errOut,"%s at line %d, column %d\n",message,loc->first_line,loc->first_column);
+    fprintf(errOut,"\ttoken: %s\n",yyget_text(scanner));
 }
@@ -0,0 +1,141 @@
+/******************************************************************/
+/* File: pool.c                                                   */
+/* Implementation of the size-class pool allocator.               */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include "globals.h"
+#include "pool.h"
+
+#define CLASSES (POOL_MAX_SIZE/POOL_ALIGN)
+
+/* A free block, linked through its first word. */
+typedef struct blockStruct {
+    struct blockStruct *next;
+} Block;
+
+/* Header of a chunk, padded to keep the blocks aligned. */
+typedef union chunkStruct {
+    union chunkStruct *next;
+    char pad[POOL_ALIGN];
+} Chunk;
+
+// every thread has its own pool
+static THREAD_LOCAL Block *freeLists[CLASSES];
+static THREAD_LOCAL Chunk *chunks = NULL;
+static THREAD_LOCAL char *cursor = NULL;    // unused part of the current chunk
+static THREAD_LOCAL char *limit = NULL;
+static THREAD_LOCAL PoolStats stats;
+
+static void recordAlloc(size_t size) {
+    stats.allocs++;
+    stats.bytesInUse += size;
+    if(stats.bytesInUse>stats.peakBytes) {
+        stats.peakBytes = stats.bytesInUse;
+    }
+}
+
+static void recordFree(size_t size) {
+    stats.frees++;
+    stats.bytesInUse -= size;
+}
+
+#ifdef POOL_USE_MALLOC
+
+void* pool_alloc(size_t size) {
+    void *ptr = malloc(size);
+    if(ptr==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+    }else {
+        recordAlloc(size);
+    }
+    return ptr;
+}
+
+void pool_free(void* ptr, size_t size) {
+    if(ptr==NULL) return;
+    recordFree(size);
+    free(ptr);
+}
+
+void pool_releaseAll(void) {
+}
+
+#else
+
+/* Gets a new chunk and makes it the current one. */
+static int newChunk(void) {
+    Chunk *chunk = malloc(POOL_CHUNK_SIZE);
+    if(chunk==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return 0;
+    }
+    chunk->next = chunks;
+    chunks = chunk;
+    cursor = (char*)(chunk+1);
+    limit = (char*)chunk+POOL_CHUNK_SIZE;
+    stats.chunks++;
+    return 1;
+}
+
+void* pool_alloc(size_t size) {
+    if(size==0) size = 1;
+    if(size>POOL_MAX_SIZE) {
+        void *ptr = malloc(size);
+        if(ptr==NULL) {
+            fprintf(errOut,"Out of memory.\n");
+        }else {
+            recordAlloc(size);
+        }
+        return ptr;
+    }
+
+    int c = (size-1)/POOL_ALIGN;
+    size_t bytes = (c+1)*POOL_ALIGN;
+    Block *block = freeLists[c];
+    if(block!=NULL) {
+        freeLists[c] = block->next;
+    }else {
+        if(cursor==NULL || cursor+bytes>limit) {
+            if(!newChunk()) return NULL;
+        }
+        block = (Block*)cursor;
+        cursor += bytes;
+    }
+    recordAlloc(size);
+    return block;
+}
+
+void pool_free(void* ptr, size_t size) {
+    if(ptr==NULL) return;
+    if(size==0) size = 1;
+    recordFree(size);
+    if(size>POOL_MAX_SIZE) {
+        free(ptr);
+        return;
+    }
+
+    int c = (size-1)/POOL_ALIGN;
+    Block *block = (Block*)ptr;
+    block->next = freeLists[c];
+    freeLists[c] = block;
+}
+
+void pool_releaseAll(void) {
+    Chunk *chunk = NULL;
+    while((chunk=chunks)!=NULL) {
+        chunks = chunk->next;
+        free(chunk);
+    }
+    int c;
+    for(c=0;c<CLASSES;c++) {
+        freeLists[c] = NULL;
+    }
+    cursor = limit = NULL;
+}
+
+#endif
+
+void pool_getStats(PoolStats *s) {
+    *s = stats;
+}
@@ -0,0 +1,53 @@
+/******************************************************************/
+/* File: pool.h                                                   */
+/* Definition of the size-class pool allocator used for trees,    */
+/* strings and the machine data structures.                       */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+/*
+ * Requests are rounded up to a multiple of POOL_ALIGN and served from the
+ * free list of that size class, or carved from the current chunk. Freed
+ * blocks go back to their free list, so allocating and freeing the same
+ * kind of object again and again never reaches malloc. Requests larger
+ * than POOL_MAX_SIZE go to malloc directly.
+ *
+ * Every thread has its own pool, so allocating never takes a lock. A
+ * block freed by another thread goes to the pool of that thread, so
+ * objects should stay in the thread that allocated them. A thread must
+ * call pool_releaseAll() before it exits, or its chunks are lost.
+ *
+ * Compile with POOL_USE_MALLOC defined to use plain malloc and free
+ * instead, e.g. to compare the two or to run under Valgrind.
+ */
+#define POOL_ALIGN 16
+#define POOL_MAX_SIZE 256
+#define POOL_CHUNK_SIZE (64*1024)
+
+/* Allocation statistics. */
+typedef struct {
+    size_t allocs;      /* Number of allocations. */
+    size_t frees;       /* Number of frees. */
+    size_t bytesInUse;  /* Bytes currently allocated. */
+    size_t peakBytes;   /* Maximum of bytesInUse. */
+    size_t chunks;      /* Number of chunks obtained from malloc. */
+} PoolStats;
+
+/* Allocates size bytes. */
+void* pool_alloc(size_t size);
+
+/* Frees memory allocated by pool_alloc. The size must be the same. */
+void pool_free(void* ptr, size_t size);
+
+/*
+ * Releases all chunks of the thread at once. Everything allocated from
+ * its pool must not be used afterwards.
+ */
+void pool_releaseAll(void);
+
+/* Gets the allocation statistics of the thread. */
+void pool_getStats(PoolStats *stats);
+#endif
@@ -4,137 +4,366 @@
 /* Author: Minjie Zha                                                */
 /*********************************************************************/
 
+#include <pthread.h>
+#include <inttypes.h>
 #include "globals.h"
 #include "util.h"
+#include "symbol.h"
+#include "cek_machine.h"
+#include "debruijn.h"
 #include "primitive.h"
 
-// primitive functions
-static TreeNode* plus(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    result->value = node->children[0]->value + node->children[1]->value;
-    return result;
+/* Arithmetic on 64 bits, returning nonzero if the result overflows. */
+#if defined(__GNUC__)
+#define addOverflow(x,y,result) __builtin_add_overflow(x,y,result)
+#define subOverflow(x,y,result) __builtin_sub_overflow(x,y,result)
+#define mulOverflow(x,y,result) __builtin_mul_overflow(x,y,result)
+#else
+static int addOverflow(int64_t x, int64_t y, int64_t *result) {
+    if((y>0 && x>INT64_MAX-y) || (y<0 && x<INT64_MIN-y)) return 1;
+    *result = x + y;
+    return 0;
 }
 
-static TreeNode* minus(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    result->value = node->children[0]->value - node->children[1]->value;
-    return result;
+static int subOverflow(int64_t x, int64_t y, int64_t *result) {
+    if((y<0 && x>INT64_MAX+y) || (y>0 && x<INT64_MIN+y)) return 1;
+    *result = x - y;
+    return 0;
 }
 
-static TreeNode* times(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    result->value = node->children[0]->value * node->children[1]->value;
-    return result;
+static int mulOverflow(int64_t x, int64_t y, int64_t *result) {
+    if(x!=0 && y!=0) {
+        if(x>0 ? (y>0 ? x>INT64_MAX/y : y<INT64_MIN/x)
+               : (y>0 ? x<INT64_MIN/y : x<INT64_MAX/y)) {
+            return 1;
+        }
+    }
+    *result = x * y;
+    return 0;
 }
+#endif
 
-static TreeNode* over(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    result->value = node->children[0]->value / node->children[1]->value;
-    return result;
+/*
+ * The primitive functions on 64 bits. They return PrimError if the result
+ * doesn't fit, to compute it again with big numbers.
+ */
+static PrimResultKind plus(int64_t x, int64_t y, int64_t *result) {
+    return addOverflow(x,y,result) ? PrimError : PrimNumber;
 }
 
-static TreeNode* mod(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    result->value = node->children[0]->value % node->children[1]->value;
-    return result;
+static PrimResultKind minus(int64_t x, int64_t y, int64_t *result) {
+    return subOverflow(x,y,result) ? PrimError : PrimNumber;
 }
 
-static TreeNode* power(TreeNode* node) {
-    TreeNode* result = newTreeNode(ConstK);
-    int b = node->children[0]->value;
-    int p = node->children[1]->value;
-    int i;
-    for(i=0,result->value=1;i<p;i++) {
-        result->value *= b;
+static PrimResultKind times(int64_t x, int64_t y, int64_t *result) {
+    return mulOverflow(x,y,result) ? PrimError : PrimNumber;
+}
+
+static PrimResultKind over(int64_t x, int64_t y, int64_t *result) {
+    if(y==0) return PrimDivisionByZero;
+    if(x==INT64_MIN && y==-1) return PrimError;
+    *result = x / y;
+    return PrimNumber;
+}
+
+static PrimResultKind mod(int64_t x, int64_t y, int64_t *result) {
+    if(y==0) return PrimDivisionByZero;
+    *result = y==-1 ? 0 : x % y;
+    return PrimNumber;
+}
+
+/*
+ * Raises b to the power p by repeated squaring. A negative power is
+ * truncated toward zero like a division.
+ */
+static PrimResultKind power(int64_t b, int64_t p, int64_t *result) {
+    if(p<0) {
+        if(b==0) return PrimDivisionByZero;
+        *result = b==1 ? 1 : b==-1 ? (p%2==0 ? 1 : -1) : 0;
+        return PrimNumber;
     }
-    return result;
+    *result = 1;
+    while(p>0) {
+        if((p & 1) && mulOverflow(*result,b,result)) return PrimError;
+        p >>= 1;
+        if(p>0 && mulOverflow(b,b,&b)) return PrimError;
+    }
+    return PrimNumber;
 }
 
-// util functions for construct true/false trees
-static TreeNode* boolNode(const char* ret) {
-    TreeNode* result = newTreeNode(AbsK);
-    result->children[0] = newTreeNode(IdK);
-    result->children[0]->name = stringCopy("x");
+static PrimResultKind lt(int64_t x, int64_t y, int64_t *result) {
+    *result = x<y;
+    return PrimBoolean;
+}
 
-    TreeNode* body = newTreeNode(AbsK);
-    body->children[0] = newTreeNode(IdK);
-    body->children[0]->name = stringCopy("y");
-    body->children[1] = newTreeNode(IdK);
-    body->children[1]->name = stringCopy(ret);
+static PrimResultKind eq(int64_t x, int64_t y, int64_t *result) {
+    *result = x==y;
+    return PrimBoolean;
+}
 
-    result->children[1] = body;
-    return result;
+static PrimResultKind gt(int64_t x, int64_t y, int64_t *result) {
+    *result = x>y;
+    return PrimBoolean;
 }
 
-static TreeNode* trueNode() {
-    return boolNode("x");
+static PrimResultKind le(int64_t x, int64_t y, int64_t *result) {
+    *result = x<=y;
+    return PrimBoolean;
 }
 
-static TreeNode* falseNode() {
-    return boolNode("y");
+static PrimResultKind ne(int64_t x, int64_t y, int64_t *result) {
+    *result = x!=y;
+    return PrimBoolean;
 }
 
-static TreeNode* lt(TreeNode* node) {
-    if(node->children[0]->value<node->children[1]->value) {
-        return trueNode();
-    }
-    return falseNode();
+static PrimResultKind ge(int64_t x, int64_t y, int64_t *result) {
+    *result = x>=y;
+    return PrimBoolean;
 }
 
-static TreeNode* eq(TreeNode* node) {
-    if(node->children[0]->value==node->children[1]->value) {
-        return trueNode();
+/* Stores the big result, as a small one if it fits. It is consumed. */
+static PrimResultKind bigResult(BigNum *big, Number *result) {
+    if(big==NULL) return PrimTooLarge;
+    if(big_toInt(big,&result->value)) {
+        big_release(big);
+    } else {
+        result->big = big;
     }
-    return falseNode();
+    return PrimNumber;
+}
+
+// the primitive functions on big numbers
+static PrimResultKind bigPlus(BigNum *x, BigNum *y, Number *result) {
+    return bigResult(big_add(x,y),result);
+}
+
+static PrimResultKind bigMinus(BigNum *x, BigNum *y, Number *result) {
+    return bigResult(big_subtract(x,y),result);
 }
 
-static TreeNode* gt(TreeNode* node) {
-    if(node->children[0]->value>node->children[1]->value) {
-        return trueNode();
+static PrimResultKind bigTimes(BigNum *x, BigNum *y, Number *result) {
+    return bigResult(big_multiply(x,y),result);
+}
+
+static PrimResultKind bigOver(BigNum *x, BigNum *y, Number *result) {
+    BigNum *quotient = NULL;
+    if(!big_divide(x,y,&quotient,NULL)) return PrimDivisionByZero;
+    return bigResult(quotient,result);
+}
+
+static PrimResultKind bigMod(BigNum *x, BigNum *y, Number *result) {
+    BigNum *remainder = NULL;
+    if(!big_divide(x,y,NULL,&remainder)) return PrimDivisionByZero;
+    return bigResult(remainder,result);
+}
+
+static PrimResultKind bigPower(BigNum *b, BigNum *p, Number *result) {
+    int64_t base = 0, exponent = 0;
+    if(big_toInt(b,&base) && base>=-1 && base<=1) {
+        // only the sign and the parity of the power matter
+        BigNum *two = big_fromInt(2);
+        BigNum *parity = NULL;
+        big_divide(p,two,NULL,&parity);
+        exponent = big_sign(p)*(big_sign(parity)==0 ? 2 : 1);
+        big_release(parity);
+        big_release(two);
+        return power(base,exponent,&result->value);
     }
-    return falseNode();
+    if(big_sign(p)<0) {
+        result->value = 0;
+        return PrimNumber;
+    }
+    // a base of 2 or more needs a bit per unit of the power
+    if(!big_toInt(p,&exponent) || exponent>BIG_MAX_BITS) {
+        return PrimTooLarge;
+    }
+    return bigResult(big_power(b,exponent),result);
+}
+
+static PrimResultKind bigLt(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)<0;
+    return PrimBoolean;
+}
+
+static PrimResultKind bigEq(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)==0;
+    return PrimBoolean;
+}
+
+static PrimResultKind bigGt(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)>0;
+    return PrimBoolean;
 }
 
-static TreeNode* le(TreeNode* node) {
-    if(node->children[0]->value<=node->children[1]->value) {
-        return trueNode();
+static PrimResultKind bigLe(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)<=0;
+    return PrimBoolean;
+}
+
+static PrimResultKind bigNe(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)!=0;
+    return PrimBoolean;
+}
+
+static PrimResultKind bigGe(BigNum *x, BigNum *y, Number *result) {
+    result->value = big_compare(x,y)>=0;
+    return PrimBoolean;
+}
+// end of primitive functions
+
+// util functions for construct true/false trees
+static TreeNode* boolNode(const char* ret) {
+    TreeNode* result = newTreeNode(AbsK);
+    result->children[0] = newTreeNode(IdK);
+    result->children[0]->name = sym_intern("x");
+
+    TreeNode* body = newTreeNode(AbsK);
+    body->children[0] = newTreeNode(IdK);
+    body->children[0]->name = sym_intern("y");
+    body->children[1] = newTreeNode(IdK);
+    body->children[1]->name = sym_intern(ret);
+
+    result->children[1] = body;
+    return result;
+}
+
+/*
+ * The trees of the booleans and of the integers from SHARED_MIN to
+ * SHARED_MAX are built on first use and pinned by the reference kept here,
+ * so primitives on constants don't allocate. Reference counts are not
+ * atomic, so every thread has its own.
+ */
+static THREAD_LOCAL TreeNode *sharedBooleans[2];
+static THREAD_LOCAL TreeNode *sharedNumbers[SHARED_MAX-SHARED_MIN+1];
+
+TreeNode* booleanNode(int value) {
+    TreeNode **shared = &sharedBooleans[value!=0];
+    if(*shared==NULL) {
+        *shared = boolNode(value ? "x" : "y");
+        db_resolve(*shared,NULL);
     }
-    return falseNode();
+    return retainTree(*shared);
 }
 
-static TreeNode* ne(TreeNode* node) {
-    if(node->children[0]->value!=node->children[1]->value) {
-        return trueNode();
+TreeNode* constantNode(Number number) {
+    TreeNode **shared = NULL;
+    TreeNode *node = NULL;
+    if(number.big==NULL && number.value>=SHARED_MIN && number.value<=SHARED_MAX) {
+        shared = &sharedNumbers[number.value-SHARED_MIN];
+        if(*shared!=NULL) {
+            return retainTree(*shared);
+        }
+    }
+    node = newTreeNode(ConstK);
+    node->value = number.value;
+    node->big = number.big;
+    node->freeDepth = 0;
+    if(shared!=NULL) {
+        *shared = retainTree(node);
     }
-    return falseNode();
+    return node;
 }
 
-static TreeNode* ge(TreeNode* node) {
-    if(node->children[0]->value>=node->children[1]->value) {
-        return trueNode();
+void releaseSharedConstants(void) {
+    int i;
+    for(i=0;i<2;i++) {
+        deleteTree(sharedBooleans[i]);
+        sharedBooleans[i] = NULL;
+    }
+    for(i=0;i<SHARED_MAX-SHARED_MIN+1;i++) {
+        deleteTree(sharedNumbers[i]);
+        sharedNumbers[i] = NULL;
     }
-    return falseNode();
 }
-// end of primitive functions
 
 #define NUM 12
-typedef TreeNode* (*PrimiFun)(TreeNode* node);
+typedef PrimResultKind (*PrimiFun)(int64_t x, int64_t y, int64_t *result);
+typedef PrimResultKind (*BigFun)(BigNum *x, BigNum *y, Number *result);
 static struct {
     char* name;
     PrimiFun fun;
+    BigFun bigFun;
+    const char* symbol;     // interned name, set on first use
 } primitiveFunctions[NUM] = {
-    {"+",plus},{"-",minus},{"*",times},{"/",over},{"%",mod},{"^",power},
-    {"<",lt},{"=",eq},{">",gt},{"<=",le},{"!=",ne},{">=",ge}
+    {"+",plus,bigPlus},{"-",minus,bigMinus},{"*",times,bigTimes},
+    {"/",over,bigOver},{"%",mod,bigMod},{"^",power,bigPower},
+    {"<",lt,bigLt},{"=",eq,bigEq},{">",gt,bigGt},
+    {"<=",le,bigLe},{"!=",ne,bigNe},{">=",ge,bigGe}
 };
+static pthread_once_t interned = PTHREAD_ONCE_INIT;
+
+static void internNames(void) {
+    int i;
+    for(i=0;i<NUM;i++) {
+        primitiveFunctions[i].symbol = sym_intern(primitiveFunctions[i].name);
+    }
+}
 
-TreeNode* evalPrimitive(TreeNode *node) {
+int lookupPrimitive(const char *name) {
     int i;
+    pthread_once(&interned,internNames);
     for(i=0;i<NUM;i++) {
-        if(strcmp(node->name,primitiveFunctions[i].name)==0) {
-            return (primitiveFunctions[i].fun)(node);
+        if(name==primitiveFunctions[i].symbol) {
+            return i;
         }
     }
+    return -1;
+}
 
-    fprintf(errOut,"Unsupported primitive function: %s\n",node->name);
-    return node;
+PrimResultKind applyPrimitive(int prim, Number x, Number y, Number *result) {
+    PrimResultKind kind = PrimError;
+    if(prim<0 || prim>=NUM) {
+        return PrimError;
+    }
+    result->big = NULL;
+    if(x.big==NULL && y.big==NULL) {
+        kind = (primitiveFunctions[prim].fun)(x.value,y.value,&result->value);
+        if(kind!=PrimError) return kind;
+    }
+    // an operand or the result doesn't fit in 64 bits
+    BigNum *bx = x.big!=NULL ? big_retain(x.big) : big_fromInt(x.value);
+    BigNum *by = y.big!=NULL ? big_retain(y.big) : big_fromInt(y.value);
+    kind = (primitiveFunctions[prim].bigFun)(bx,by,result);
+    big_release(bx);
+    big_release(by);
+    return kind;
+}
+
+void primitiveError(PrimResultKind kind, const char *name) {
+    switch(kind) {
+        case PrimDivisionByZero:
+            fprintf(errOut,"Error: division by zero in %s.\n",name);
+            break;
+        case PrimTooLarge:
+            fprintf(errOut,"Error: the result of %s is too large.\n",name);
+            break;
+        default:
+            fprintf(errOut,"Unsupported primitive function: %s\n",name);
+    }
+}
+
+void printNumber(Number number, FILE *stream) {
+    if(number.big!=NULL) {
+        big_print(number.big,stream);
+    } else {
+        fprintf(stream,"%" PRId64,number.value);
+    }
+}
+
+TreeNode* evalPrimitive(const char *name, TreeNode *x, TreeNode *y) {
+    Number value;
+    TreeNode *result = NULL;
+    PrimResultKind kind = applyPrimitive(lookupPrimitive(name),
+            (Number){x->value,x->big},(Number){y->value,y->big},&value);
+    switch(kind) {
+        case PrimNumber:
+            result = constantNode(value);
+            break;
+        case PrimBoolean:
+            result = booleanNode(value.value);
+            break;
+        default:
+            primitiveError(kind,name);
+    }
+    return result;
 }
@@ -6,7 +6,67 @@
 
 #ifndef _PRIMITIVE_H_
 #define _PRIMITIVE_H_
+#include "bignum.h"
 
-/* Evaluates the primitve node. */
-TreeNode* evalPrimitive(TreeNode* node);
+/* Kind of the result of a primitive function. */
+typedef enum {
+    PrimError, PrimNumber, PrimBoolean, PrimDivisionByZero, PrimTooLarge
+} PrimResultKind;
+
+/*
+ * An integer operand or result. Integers which fit in 64 bits are never
+ * big, so arithmetic on them doesn't allocate and equal integers have
+ * equal fields.
+ */
+typedef struct {
+    int64_t value;
+    BigNum *big;        /* NULL if the integer fits in value */
+} Number;
+
+/*
+ * Looks up the primitive function by its interned name. Returns its id,
+ * or -1 if the name is not a primitive function.
+ */
+int lookupPrimitive(const char *name);
+
+/*
+ * Applies the primitive function with the id to the operands x and y.
+ * The number, or 1 for true and 0 for false, is stored in result. A big
+ * result is a new reference. Results which overflow 64 bits are computed
+ * again with big numbers.
+ */
+PrimResultKind applyPrimitive(int prim, Number x, Number y, Number *result);
+
+/* Reports the error of applying the primitive function with the name. */
+void primitiveError(PrimResultKind kind, const char *name);
+
+/* Prints the integer in decimal. */
+void printNumber(Number number, FILE *stream);
+
+/* The integers whose trees are shared, see constantNode(). */
+#define SHARED_MIN -128
+#define SHARED_MAX 1023
+
+/*
+ * Gets the Church boolean (lambda x (lambda y x)) or (lambda x (lambda y y)),
+ * resolved. The tree is shared, so it must not be changed.
+ */
+TreeNode* booleanNode(int value);
+
+/*
+ * Gets the resolved tree of the integer, taking over the reference to its
+ * big number. Trees of integers from SHARED_MIN to SHARED_MAX are shared,
+ * so they must not be changed.
+ */
+TreeNode* constantNode(Number number);
+
+/* Drops the shared trees of the thread, which are built again when needed. */
+void releaseSharedConstants(void);
+
+/*
+ * Applies the primitive function to the constant operands x and y, and
+ * returns a resolved tree for the result, which may be shared. Returns NULL
+ * on errors.
+ */
+TreeNode* evalPrimitive(const char *name, TreeNode* x, TreeNode* y);
 #endif
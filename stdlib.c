@@ -5,6 +5,7 @@
 /*********************************************************************/
 
 #include "globals.h"
+#include "parse.h"
 #include "stdlib.h"
 
 #define FUNCTION_NUM 4
@@ -26,12 +27,8 @@ StandardFun* lookupStandardFun(const char* name) {
     return NULL;
 }
 
-extern TreeNode* tree;  // use the tree for parser
 TreeNode* expandStandardFun(StandardFun* fun) {
-    useStringBuffer(fun->expr);
-    yyparse();
-    deleteStringBuffer();
-    return tree;
+    return parse_expression(fun->expr);
 }
 
 StandardFun* standardFuns(int *size) {
@@ -0,0 +1,158 @@
+/******************************************************************/
+/* File: symbol.c                                                 */
+/* Implementation of the symbol table.                            */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#include <stddef.h>
+#include <pthread.h>
+#include "globals.h"
+#include "symbol.h"
+
+#define INITIAL_SIZE 256
+#define CACHE_SIZE 256
+
+/* An interned name. The name is stored inline after the header. */
+typedef struct symbolStruct {
+    struct symbolStruct *next;
+    int id;
+    char name[];
+} Symbol;
+
+static Symbol **table = NULL;
+static int tableSize = 0;
+static int count = 0;
+static Symbol **byId = NULL;    // symbols indexed by id, same size as table
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Each thread remembers the names it interned last, so interning a name
+ * again doesn't take the lock. The cache is dropped when the generation
+ * changes, i.e. after sym_cleanup().
+ */
+static int generation = 0;
+static THREAD_LOCAL const char *cache[CACHE_SIZE];
+static THREAD_LOCAL int cacheGeneration = 0;
+
+/* FNV-1a hash of the name. */
+static unsigned int hash(const char *name) {
+    unsigned int h = 2166136261u;
+    for(;*name!='\0';name++) {
+        h ^= (unsigned char)*name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Doubles the table and rehashes all symbols. */
+static int grow(void) {
+    int newSize = tableSize==0 ? INITIAL_SIZE : tableSize*2;
+    Symbol **newTable = calloc(newSize,sizeof(Symbol*));
+    Symbol **newById = realloc(byId,newSize*sizeof(Symbol*));
+    if(newTable==NULL || newById==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        free(newTable);
+        if(newById!=NULL) byId = newById;
+        return 0;
+    }
+    byId = newById;
+    int i;
+    for(i=0;i<tableSize;i++) {
+        Symbol *sym = table[i];
+        while(sym!=NULL) {
+            Symbol *next = sym->next;
+            unsigned int h = hash(sym->name) & (newSize-1);
+            sym->next = newTable[h];
+            newTable[h] = sym;
+            sym = next;
+        }
+    }
+    free(table);
+    table = newTable;
+    tableSize = newSize;
+    return 1;
+}
+
+/* Looks up or adds the name. The lock must be held. */
+static const char * intern(const char *name, unsigned int fullHash) {
+    if(count>=tableSize && !grow()) return NULL;
+
+    unsigned int h = fullHash & (tableSize-1);
+    Symbol *sym = table[h];
+    for(;sym!=NULL;sym=sym->next) {
+        if(strcmp(sym->name,name)==0) {
+            return sym->name;
+        }
+    }
+
+    sym = malloc(sizeof(Symbol)+strlen(name)+1);
+    if(sym==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return NULL;
+    }
+    strcpy(sym->name,name);
+    sym->id = count++;
+    byId[sym->id] = sym;
+    sym->next = table[h];
+    table[h] = sym;
+    return sym->name;
+}
+
+const char * sym_intern(const char *name) {
+    if(name==NULL) return NULL;
+    unsigned int h = hash(name);
+    const char **slot = &cache[h & (CACHE_SIZE-1)];
+    if(cacheGeneration!=generation) {
+        memset(cache,0,sizeof(cache));
+        cacheGeneration = generation;
+    }
+    if(*slot!=NULL && strcmp(*slot,name)==0) {
+        return *slot;
+    }
+
+    pthread_mutex_lock(&lock);
+    const char *symbol = intern(name,h);
+    pthread_mutex_unlock(&lock);
+    *slot = symbol;
+    return symbol;
+}
+
+int sym_id(const char *symbol) {
+    const Symbol *sym = (const Symbol*)(symbol-offsetof(Symbol,name));
+    return sym->id;
+}
+
+const char * sym_name(int id) {
+    pthread_mutex_lock(&lock);
+    const char *name = byId[id]->name;
+    pthread_mutex_unlock(&lock);
+    return name;
+}
+
+int sym_count(void) {
+    pthread_mutex_lock(&lock);
+    int n = count;
+    pthread_mutex_unlock(&lock);
+    return n;
+}
+
+void sym_cleanup(void) {
+    pthread_mutex_lock(&lock);
+    generation++;
+    int i;
+    for(i=0;i<tableSize;i++) {
+        Symbol *sym = table[i];
+        while(sym!=NULL) {
+            Symbol *next = sym->next;
+            free(sym);
+            sym = next;
+        }
+    }
+    free(table);
+    free(byId);
+    table = NULL;
+    byId = NULL;
+    tableSize = 0;
+    count = 0;
+    pthread_mutex_unlock(&lock);
+}
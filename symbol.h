@@ -0,0 +1,37 @@
+/******************************************************************/
+/* File: symbol.h                                                 */
+/* Definition of the symbol table for interned identifiers.       */
+/* Author: Minjie Zha                                             */
+/******************************************************************/
+
+#ifndef _SYMBOL_H_
+#define _SYMBOL_H_
+
+/*
+ * The table is shared by all threads and can be used from any of them,
+ * except sym_cleanup(), which must be called when no other thread uses
+ * interned names any more.
+ */
+
+/*
+ * Returns the interned copy of the name. Interning the same name again
+ * returns the same pointer, so interned names are compared with == and
+ * never copied or freed. The copy lives until sym_cleanup() is called.
+ */
+const char * sym_intern(const char *name);
+
+/*
+ * Returns the id of an interned name. Ids are small consecutive integers
+ * starting from 0, in the order the names were interned.
+ */
+int sym_id(const char *symbol);
+
+/* Returns the interned name with the id. */
+const char * sym_name(int id);
+
+/* Returns the number of interned names. */
+int sym_count(void);
+
+/* Frees all interned names. */
+void sym_cleanup(void);
+#endif
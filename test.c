@@ -7,18 +7,19 @@
 #include "globals.h"
 #include "util.h"
 #include "eval.h"
+#include "symbol.h"
+#include "parse.h"
+#include "hashcons.h"
 
 /*
  * Evaluates the expressions in the array.
  */
 static void evaluateExpressions(char *exprs[], int size);
 
-TreeNode * tree = NULL;
+THREAD_LOCAL FILE* out;
+THREAD_LOCAL FILE* errOut;
 
-FILE* out;
-FILE* errOut;
-
-#define SIZE 95
+#define SIZE 110
 char* exprs[] = {"x","X","(lambda x x)","(lambda x y)",
                 "(lambda x (lambda y y))",
                 "(lambda x (lambda y x))",
@@ -67,11 +68,19 @@ char* exprs[] = {"x","X","(lambda x x)","(lambda x y)",
                 "- 1 1","* 1 1","/ 1 1","% 1 1","+ (+ 1 2) 3", "+ y",
                 "* (+ 1 2) 3","^ 2 4","< 1 2","> 1 2","= 2 2","<= 1 2",
                 ">= 1 2","!= 2 2","1 1","x 1",
+                "+ 9223372036854775807 1","^ 2 100","/ (^ 2 100) (^ 2 40)",
+                "% (^ 10 30) 7","= (^ 2 70) (* (^ 2 35) (^ 2 35))",
+                "123456789012345678901234567890","/ 1 0","% 1 0",
                 "(lambda x (lambda y + (* x x) (* y y))) 3 4",
                 "(lambda x (lambda y y x)) 1 (lambda x x)",
                 "(lambda x (lambda y x (x y)) (x 1)) (lambda x x)",
                 "+ (lambda x x) 1",
-                "(and (= 2 3) (= 2 2))", "(and (not (= 2 3)) (= 2 2))"
+                "(and (= 2 3) (= 2 2))", "(and (not (= 2 3)) (= 2 2))",
+                "(lambda x (lambda x x)) 1 2", "(lambda x (lambda y x)) 1 2",
+                "(lambda x (lambda y y x)) 1",
+                "Y (lambda f (lambda n ((<= n 0) (lambda d 1) (lambda d * n (f (- n 1)))) 0)) 5",
+                "(lambda b (lambda z b)) (< 1 2)",
+                "(lambda x x", "(lambda x\n  x))"
                 };
 
 #define SIZE1 10
@@ -83,10 +92,73 @@ char *exprs1[] = {"(lambda x (lambda x x))",
         "(lambda a_ (lambda a__ a_))"
         };
 
+#define SIZE2 8
+char *exprs2[] = {"(lambda x 1) ((lambda x x x) (lambda x x x))",
+        "(lambda x 1) y", "(lambda x x) y",
+        "(lambda x + x x) (* 3 4)", "(lambda x (lambda y x)) ((lambda z z) 7)",
+        "(lambda f (lambda x f (x x)) (lambda x f (x x))) (lambda f (lambda n ((<= n 0) 1 (* n (f (- n 1)))))) 5",
+        "Y (lambda f (lambda n ((<= n 0) 1 (* n (f (- n 1)))))) 5",
+        "(lambda f (lambda x f (x x)) (lambda x f (x x))) (lambda f (lambda x 1)) 2"
+        };
+
+#define SIZE3 11
+char *exprs3[] = {"(lambda x x) (lambda y y)", "(lambda f (lambda x f x)) (lambda y y)",
+        "(lambda y (lambda x (lambda y x)) y)", "(lambda x + x 1)", "+",
+        "(lambda x (lambda y + (* x x) (* y y))) 3 4",
+        "(lambda x 1) ((lambda x x x) (lambda x x x))",
+        "(lambda b (lambda z b)) (< 1 2)",
+        "(lambda m (lambda n (lambda f (lambda x m f (n f x))))) (lambda f (lambda x f (f x))) (lambda f (lambda x f (f (f x))))",
+        "(lambda m (lambda n (lambda f m (n f)))) (lambda f (lambda x f (f x))) (lambda f (lambda x f (f (f x))))",
+        "(lambda f (lambda x f (f x))) (lambda f (lambda x f (f (f x))))"
+        };
+
+#define SIZE5 2
+char *exprs5[] = {"(lambda f (lambda x f (f x))) (lambda g (lambda y g (g y)))",
+        "(lambda m (lambda n m n)) (lambda f (lambda x f (f x))) (lambda g (lambda y g (g (g y))))"
+        };
+
+#define SIZE4 3
+char *exprs4[] = {"(lambda x x x) (lambda x x x)", "+ 1 2",
+        "Y (lambda f (lambda n ((<= n 0) (lambda d 1) (lambda d * n (f (- n 1)))) 0)) 5"
+        };
+
 int main(int argc, char* argv[]) {
     out = stdout;
     errOut = stderr;
     
+    // -e selects the evaluation engine, e.g. "-e bytecode",
+    // -s the evaluation strategy, "value" or "need",
+    // -p the number of workers of the parallel evaluation, and
+    // -g the size of the heap collecting the environments.
+    while(argc>2) {
+        if(strcmp(argv[1],"-e")==0) {
+            Engine *engine = lookupEngine(argv[2]);
+            if(engine==NULL) {
+                fprintf(errOut,"Unknown engine: %s\n",argv[2]);
+                return 1;
+            }
+            setEngine(engine);
+        } else if(strcmp(argv[1],"-s")==0) {
+            if(strcmp(argv[2],"value")==0) {
+                setStrategy(CallByValue);
+            } else if(strcmp(argv[2],"need")==0) {
+                setStrategy(CallByNeed);
+            } else {
+                fprintf(errOut,"Unknown strategy: %s\n",argv[2]);
+                return 1;
+            }
+        } else if(strcmp(argv[1],"-p")==0) {
+            // fork even the small test cases
+            setParallel(atoi(argv[2]),2);
+        } else if(strcmp(argv[1],"-g")==0) {
+            setHeapSize(atol(argv[2]));
+        } else {
+            break;
+        }
+        argv += 2;
+        argc -= 2;
+    }
+
     if(argc>1) {    // if arguments provided, evaluate them.
         evaluateExpressions(&argv[1],argc-1);
     }else { // if no argument provided, evaluate the test cases.
@@ -96,11 +168,9 @@ int main(int argc, char* argv[]) {
         int i;
         for(i=0;i<SIZE1;i++) {
             fprintf(out,"Expression: %s\n",exprs1[i]);
-            useStringBuffer(exprs1[i]);
-            yyparse();
-            deleteStringBuffer();
-            tree = alphaConversion(tree);
+            TreeNode *tree = parse_expression(exprs1[i]);
             if(tree!=NULL) {
+                tree = alphaConversion(tree);
                 fprintf(out,"->  ");
                 printExpression(tree,out);
                 fprintf(out,"\n");
@@ -109,9 +179,82 @@ int main(int argc, char* argv[]) {
             }
             fprintf(out,"\n");
         }
+
+        fprintf(out,"\nTest call-by-need:\n");
+        setEngine(lookupEngine("cek"));     // the only lazy engine
+        setStrategy(CallByNeed);
+        evaluateExpressions(exprs2,SIZE2);
+
+        fprintf(out,"\nTest normal forms:\n");
+        Budget budget = {1000000, 0, 0.0, 0};    // Y has no normal form
+        setEngine(lookupEngine("nbe"));
+        setBudget(&budget);
+        evaluateExpressions(exprs,SIZE);
+        evaluateExpressions(exprs3,SIZE3);
+        setBudget(NULL);
+
+        fprintf(out,"\nTest budgets:\n");
+        budget.steps = 1000;
+        setEngine(lookupEngine("cek"));
+        setStrategy(CallByValue);
+        setBudget(&budget);
+        evaluateExpressions(exprs4,SIZE4);
+        setEngine(lookupEngine("bytecode"));
+        evaluateExpressions(exprs4,SIZE4);
+        setEngine(lookupEngine("cek"));
+        setBudget(NULL);
+
+        // run the last one again, in turns of 50 steps
+        budget.steps = 50;
+        Evaluation *evaluation = startEvaluation(parse_expression(exprs4[SIZE4-1]));
+        int turns = 0;
+        while(resumeEvaluation(evaluation,&budget)==EvalSuspended) {
+            turns++;
+        }
+        TreeNode *tree = evaluationResult(evaluation);
+        fprintf(out,"Resumed %d times, %ld steps\n->  ",turns,evaluationSteps(evaluation));
+        printExpression(tree,out);
+        fprintf(out,"\n");
+        deleteTree(tree);
+        deleteEvaluation(evaluation);
+
+        fprintf(out,"\nTest garbage collection:\n");
+        setHeapSize(4);     // collect every few steps
+        evaluateExpressions(exprs4+1,SIZE4-1);  // the first one never ends
+        setStrategy(CallByNeed);
+        evaluateExpressions(exprs2,SIZE2);
+        setStrategy(CallByValue);
+        setHeapSize(0);
+
+        fprintf(out,"\nTest substitution machines:\n");
+        setEngine(lookupEngine("cc"));
+        evaluateExpressions(exprs,SIZE);
+        evaluateExpressions(exprs4+1,SIZE4-1);
+        setEngine(lookupEngine("ck"));
+        evaluateExpressions(exprs,SIZE);
+        evaluateExpressions(exprs4+1,SIZE4-1);
+
+        fprintf(out,"\nTest call-by-name:\n");
+        setEngine(lookupEngine("krivine"));
+        evaluateExpressions(exprs2,SIZE2);
+
+        fprintf(out,"\nTest hash-consing:\n");
+        setEngine(lookupEngine("cek"));
+        setStrategy(CallByNeed);    // exprs3 has an unused diverging argument
+        setHashConsing(1);
+        evaluateExpressions(exprs3,SIZE3);
+        // the numerals differ only in bound names, so they are shared
+        evaluateExpressions(exprs5,SIZE5);
+        HashConsStats hashCons;
+        hc_getStats(&hashCons);
+        hc_printStats(&hashCons,out);
+        setHashConsing(0);
+        setStrategy(CallByValue);
     }
 
-    yylex_destroy(); /* Destroy the buffer */
+    setParallel(0,0);
+    releaseGlobalEnvironment();
+    sym_cleanup();
     return 0;
 }
 
@@ -119,9 +262,11 @@ static void evaluateExpressions(char *exprs[], int size) {
     int i;
     for(i=0;i<size;i++) {
         fprintf(out,"Expression: %s\n",exprs[i]);
-        useStringBuffer(exprs[i]);
-        yyparse();
-        deleteStringBuffer();
+        TreeNode *tree = parse_expression(exprs[i]);
+        if(tree==NULL) {
+            fprintf(out,"\n");
+            continue;
+        }
         #ifdef DEBUG
             fprintf(errOut,"Parse tree =>\n");
             printTree(tree,errOut);
@@ -6,14 +6,27 @@
 
 #include "globals.h"
 #include "util.h"
+#include "pool.h"
+#include "hashcons.h"
+#include "varset.h"
+#include "eval.h"
+#include "primitive.h"
 
 TreeNode * newTreeNode(ExprKind kind) {
-    TreeNode * node = (TreeNode *) malloc(sizeof(TreeNode));
+    TreeNode * node = (TreeNode *) pool_alloc(sizeof(TreeNode));
     if(node == NULL) {
         fprintf(errOut,"Out of memory.\n");
     }else {
+        EVAL_COUNT(nodesAllocated);
         node->kind = kind;
         node->name = NULL;
+        node->value = 0;
+        node->big = NULL;
+        node->index = -1;
+        node->refCount = 1;
+        node->hash = 0;
+        node->freeDepth = INT_MAX;  // unknown until resolved
+        node->fv = NULL;
         int i;
         for(i=0;i<MAXCHILDREN;i++) {
             node->children[i] = NULL;
@@ -22,54 +35,113 @@ TreeNode * newTreeNode(ExprKind kind) {
     return node;
 }
 
-void deleteTree(TreeNode* tree) {
+TreeNode * retainTree(TreeNode *tree) {
     if(tree!=NULL) {
-        deleteTree(tree->children[0]);
-        tree->children[0] = NULL;
-        deleteTree(tree->children[1]);
-        tree->children[1] = NULL;
-        if(tree->name!=NULL) {
-            free(tree->name);
-            tree->name=NULL;
+        tree->refCount += 1;
+    }
+    return tree;
+}
+
+void deleteTree(TreeNode* tree) {
+    Stack stack;
+    TreeNode **top;
+    int i;
+    if(tree==NULL) return;
+    tree->refCount -= 1;
+    if(tree->refCount>0) return;
+    // a child which loses its last reference is deleted next, and the
+    // other one waits on the stack
+    initStack(&stack,sizeof(TreeNode*));
+    while(tree!=NULL) {
+        TreeNode *next = NULL;
+        if(tree->hash!=0) {
+            hc_forget(tree);
         }
-        free(tree);
+        deleteVarSet(tree->fv);
+        big_release(tree->big);
+        for(i=0;i<MAXCHILDREN;i++) {
+            TreeNode *child = tree->children[i];
+            if(child!=NULL && --child->refCount==0) {
+                if(next!=NULL) {
+                    // without memory for the stack, the subtree is leaked
+                    TreeNode **slot = pushStack(&stack);
+                    if(slot!=NULL) *slot = next;
+                }
+                next = child;
+            }
+        }
+        EVAL_COUNT(nodesFreed);
+        pool_free(tree,sizeof(TreeNode));
+        if(next==NULL && (top = popStack(&stack))!=NULL) {
+            next = *top;
+        }
+        tree = next;
     }
+    freeStack(&stack);
 }
 
 void deleteTreeNode(TreeNode *node) {
     if(node!=NULL) {
-        if(node->name!=NULL) {
-            free(node->name);
+        if(node->hash!=0) {
+            hc_forget(node);
         }
-        free(node);
+        deleteVarSet(node->fv);
+        big_release(node->big);
+        EVAL_COUNT(nodesFreed);
+        pool_free(node,sizeof(TreeNode));
     }
 }
 
+/* A node to copy, and where its copy goes. */
+typedef struct {
+    TreeNode *tree;
+    TreeNode **copy;
+} CopyItem;
+
 TreeNode *duplicateTree(TreeNode* tree) {
-    if(tree!=NULL) {
-        TreeNode *result = newTreeNode(tree->kind);
-        result->name = stringCopy(tree->name);
-        result->value = tree->value;
-        result->children[0] = duplicateTree(tree->children[0]);
-        result->children[1] = duplicateTree(tree->children[1]);
-        return result;
+    TreeNode *result = NULL;
+    Stack stack;
+    CopyItem *item;
+    int failed = 0;
+    int i;
+    if(tree==NULL) return NULL;
+    initStack(&stack,sizeof(CopyItem));
+    item = pushStack(&stack);
+    item->tree = tree;
+    item->copy = &result;
+    while(!failed && (item = popStack(&stack))!=NULL) {
+        tree = item->tree;
+        TreeNode *copy = newTreeNode(tree->kind);
+        *item->copy = copy;
+        if(copy==NULL) {
+            failed = 1;
+            break;
+        }
+        copy->name = tree->name;
+        copy->value = tree->value;
+        copy->big = big_retain(tree->big);
+        copy->index = tree->index;
+        copy->freeDepth = tree->freeDepth;
+        // the first child is copied first, as it was when this recursed
+        for(i=MAXCHILDREN-1;i>=0 && !failed;i--) {
+            if(tree->children[i]!=NULL) {
+                item = pushStack(&stack);
+                if(item==NULL) {
+                    failed = 1;
+                    break;
+                }
+                item->tree = tree->children[i];
+                item->copy = &copy->children[i];
+            }
+        }
     }
-    return NULL;
-}
-
-char * stringCopy(const char* s) {
-    char* t;
-
-    if(s == NULL) {
+    freeStack(&stack);
+    if(failed) {
+        // the children not copied yet are NULL
+        deleteTree(result);
         return NULL;
     }
-    t = malloc(strlen(s)+1);
-    if(t == NULL) {
-        fprintf(errOut, "Out of memory.\n");
-    }else {
-        strcpy(t,s);
-    }
-    return t;
+    return result;
 }
 
 static void printSpaces(int n, FILE* stream) {
@@ -79,99 +151,176 @@ static void printSpaces(int n, FILE* stream) {
     }
 }
 
+/* A node to print, and its indentation. */
+typedef struct {
+    TreeNode *tree;
+    int indent;
+} PrintItem;
+
 void printTree(TreeNode * tree, FILE* stream) {
-    static int indentno = 0;
+    Stack stack;
+    PrintItem *item;
     int i;
     if(tree==NULL) return;
-
-    switch(tree->kind) {
-        case IdK:
-            fprintf(stream,"Identifier: %s\n",tree->name);
-            break;
-        case ConstK:
-            fprintf(stream,"Constant: %d\n",tree->value);
-            break;
-        case AbsK:
-            fprintf(stream,"Abstraction:\n");
-            break;
-        case AppK:
-            fprintf(stream,"Application:\n");
-            break;
-        case PrimiK:
-            fprintf(stream,"Primitive: %s\n",tree->name);
-            break;
-        default:
-            fprintf(stream,"Unknown expression kind.\n");
-    }
-    for(i=0;i<MAXCHILDREN;i++) {
-        indentno+=2;
-        if(tree->children[i]!=NULL) {
-            printSpaces(indentno,stream);
-            printTree(tree->children[i],stream);
+    initStack(&stack,sizeof(PrintItem));
+    item = pushStack(&stack);
+    item->tree = tree;
+    item->indent = 0;
+    while((item = popStack(&stack))!=NULL) {
+        int indent = item->indent;
+        tree = item->tree;
+        printSpaces(indent,stream);
+        switch(tree->kind) {
+            case IdK:
+                fprintf(stream,"Identifier: %s\n",tree->name);
+                break;
+            case ConstK:
+                fprintf(stream,"Constant: ");
+                printNumber((Number){tree->value,tree->big},stream);
+                fprintf(stream,"\n");
+                break;
+            case AbsK:
+                fprintf(stream,"Abstraction:\n");
+                break;
+            case AppK:
+                fprintf(stream,"Application:\n");
+                break;
+            case PrimiK:
+                fprintf(stream,"Primitive: %s\n",tree->name);
+                break;
+            default:
+                fprintf(stream,"Unknown expression kind.\n");
+        }
+        for(i=MAXCHILDREN-1;i>=0;i--) {
+            if(tree->children[i]!=NULL) {
+                item = pushStack(&stack);
+                if(item==NULL) {
+                    // out of memory, the rest isn't printed
+                    freeStack(&stack);
+                    return;
+                }
+                item->tree = tree->children[i];
+                item->indent = indent+2;
+            }
         }
-        indentno-=2;
     }
+    freeStack(&stack);
+}
+
+/*
+ * What is left to print of an expression: either a subexpression or a
+ * piece of text between them.
+ */
+typedef struct {
+    TreeNode *expr;
+    const char *text;
+} PrintTask;
+
+/* The pushes return 0 if there is not enough memory. */
+static int pushExpression(Stack *stack, TreeNode *expr) {
+    PrintTask *task = pushStack(stack);
+    if(task==NULL) return 0;
+    task->expr = expr;
+    task->text = NULL;
+    return 1;
+}
+
+static int pushText(Stack *stack, const char *text) {
+    PrintTask *task = pushStack(stack);
+    if(task==NULL) return 0;
+    task->expr = NULL;
+    task->text = text;
+    return 1;
+}
+
+/* Pushes an operand, in parentheses if it is an application. */
+static int pushOperand(Stack *stack, TreeNode *expr) {
+    if(expr->kind==AppK || expr->kind==PrimiK) {
+        return pushText(stack,")") && pushExpression(stack,expr)
+            && pushText(stack,"(");
+    }
+    return pushExpression(stack,expr);
 }
 
 void printExpression(TreeNode* expr, FILE* stream) {
+    Stack stack;
+    PrintTask *task;
     if(expr==NULL) return;
-
-    switch(expr->kind) {
-        case IdK:
-            fprintf(stream,"%s",expr->name);
-            break;
-        case ConstK:
-            fprintf(stream,"%d", expr->value);
-            break;
-        case AbsK:
-            fprintf(stream,"(lambda ");
-            printExpression(expr->children[0],stream);
-            fprintf(stream," ");
-            printExpression(expr->children[1],stream);
-            fprintf(stream,")");
-            break;
-        case AppK:
-            printExpression(expr->children[0],stream);
-            fprintf(stream," ");
-            if(expr->children[1]->kind==AppK
-                || expr->children[1]->kind==PrimiK) {
-                fprintf(stream,"(");
-            }
-            printExpression(expr->children[1],stream);
-            if(expr->children[1]->kind==AppK
-                || expr->children[1]->kind==PrimiK) {
-                fprintf(stream,")");
-            }
-            break;
-        case PrimiK:
-            if(expr->children[0]->kind==AppK 
-                || expr->children[0]->kind==PrimiK) {
-                fprintf(stream,"(");
-            }
-            printExpression(expr->children[0],stream);
-            if(expr->children[0]->kind==AppK
-                || expr->children[0]->kind==PrimiK) {
-                fprintf(stream,")");
-            }
-            fprintf(stream," ");
-            fprintf(stream,"`%s`",expr->name);
-            fprintf(stream," ");
-            if(expr->children[1]->kind==AppK 
-                || expr->children[1]->kind==PrimiK) {
-                fprintf(stream,"(");
-            }
-            printExpression(expr->children[1],stream);
-            if(expr->children[1]->kind==AppK
-                || expr->children[1]->kind==PrimiK) {
-                fprintf(stream,")");
-            }
-            break;
-        default:
-            fprintf(stream,"Unknown expression kind.\n");
+    initStack(&stack,sizeof(PrintTask));
+    // the pieces are pushed in reverse, so they are printed in order; if
+    // there is no memory to push them, the rest isn't printed
+    int pushed = pushExpression(&stack,expr);
+    while(pushed && (task = popStack(&stack))!=NULL) {
+        if(task->text!=NULL) {
+            fputs(task->text,stream);
+            continue;
+        }
+        expr = task->expr;
+        switch(expr->kind) {
+            case IdK:
+                fprintf(stream,"%s",expr->name);
+                break;
+            case ConstK:
+                printNumber((Number){expr->value,expr->big},stream);
+                break;
+            case AbsK:
+                fprintf(stream,"(lambda ");
+                pushed = pushText(&stack,")") && pushExpression(&stack,expr->children[1])
+                    && pushText(&stack," ") && pushExpression(&stack,expr->children[0]);
+                break;
+            case AppK:
+                pushed = pushOperand(&stack,expr->children[1]) && pushText(&stack," ")
+                    && pushExpression(&stack,expr->children[0]);
+                break;
+            case PrimiK:
+                pushed = pushOperand(&stack,expr->children[1]) && pushText(&stack,"` ")
+                    && pushText(&stack,expr->name) && pushText(&stack," `")
+                    && pushOperand(&stack,expr->children[0]);
+                break;
+            default:
+                fprintf(stream,"Unknown expression kind.\n");
+        }
     }
+    freeStack(&stack);
 }
 
 int isValue(TreeNode *expr) {
     return expr!=NULL 
         && (expr->kind==ConstK || expr->kind==AbsK);
 }
+
+void initStack(Stack *stack, size_t itemSize) {
+    stack->items = (char *)stack->local;
+    stack->itemSize = itemSize;
+    stack->size = 0;
+    stack->capacity = sizeof(stack->local)/itemSize;
+}
+
+void freeStack(Stack *stack) {
+    if(stack->items!=(char *)stack->local) {
+        free(stack->items);
+    }
+    stack->items = (char *)stack->local;
+    stack->size = 0;
+    stack->capacity = sizeof(stack->local)/stack->itemSize;
+}
+
+int growStack(Stack *stack) {
+    int capacity = stack->capacity==0 ? 16 : stack->capacity*2;
+    char *items;
+    if(stack->items==(char *)stack->local) {
+        items = malloc(capacity*stack->itemSize);
+        if(items!=NULL) {
+            memcpy(items,stack->items,stack->size*stack->itemSize);
+        }
+    } else {
+        items = realloc(stack->items,capacity*stack->itemSize);
+    }
+    if(items==NULL) {
+        fprintf(errOut,"Out of memory.\n");
+        return 0;
+    }
+    stack->items = items;
+    stack->capacity = capacity;
+    return 1;
+}
@@ -10,20 +10,33 @@
 /* allocates a memory space for tree node. */
 TreeNode * newTreeNode(ExprKind kind);
 
-/* reallocates the memory space for a tree. */
+/*
+ * Trees are shared: every parent node and every other holder of a tree
+ * keeps a reference to it. A shared tree must not be changed.
+ */
+
+/* adds a reference to the tree and returns it. */
+TreeNode * retainTree(TreeNode *tree);
+
+/*
+ * drops a reference to the tree. The memory space is reallocated when the
+ * last reference is dropped, and the references to the children with it.
+ */
 void deleteTree(TreeNode *tree);
 
 /*
- * Deletes a single tree node. Doesn't delete children nodes recursively.
+ * Deletes a single tree node regardless of its references. Doesn't delete
+ * children nodes recursively.
  */
 void deleteTreeNode(TreeNode *node);
 
-/* duplicates the tree by allocating a new memory space. */
+/*
+ * duplicates the tree by allocating a new memory space, so the copy can
+ * be changed. Names are interned and shared with the original tree.
+ * Returns NULL if there is not enough memory.
+ */
 TreeNode * duplicateTree(TreeNode *tree);
 
-/* copies a string. */
-char * stringCopy(const char* s);
-
 /* prints the syntax tree. */
 void printTree(TreeNode * tree, FILE* stream);
 
@@ -32,4 +45,58 @@ void printExpression(TreeNode *expr, FILE* stream);
 
 /* Tests if the expression is a value. */
 int isValue(TreeNode *expr);
+
+/*
+ * The traversals of trees and environments keep their pending work on a
+ * stack of their own instead of recursing, so deep terms don't overflow
+ * the C stack. Items have a fixed size. The first ones are kept in the
+ * structure itself, so shallow traversals don't allocate.
+ */
+#define STACK_LOCAL 32
+
+typedef struct {
+    char *items;
+    size_t itemSize;
+    int size;
+    int capacity;
+    union { void *pointer; int64_t number; } local[STACK_LOCAL];
+} Stack;
+
+/* Initializes an empty stack of items of the size. */
+void initStack(Stack *stack, size_t itemSize);
+
+/* Frees the memory of the stack. */
+void freeStack(Stack *stack);
+
+/*
+ * Doubles the capacity of the stack. Returns 0 if there is not enough
+ * memory, leaving the stack as it was.
+ */
+int growStack(Stack *stack);
+
+/*
+ * Pushes an item and returns it, to be filled in. Returns NULL if there is
+ * not enough memory, so the traversal must give up.
+ */
+static inline void * pushStack(Stack *stack) {
+    if(stack->size==stack->capacity && !growStack(stack)) {
+        return NULL;
+    }
+    return stack->items+(size_t)stack->size++*stack->itemSize;
+}
+
+/*
+ * Pops the item on the top and returns it, or NULL if the stack is empty.
+ * It is valid until the next push.
+ */
+static inline void * popStack(Stack *stack) {
+    if(stack->size==0) return NULL;
+    return stack->items+(size_t)--stack->size*stack->itemSize;
+}
+
+/* Returns the item on the top without popping it, or NULL. */
+static inline void * topStack(Stack *stack) {
+    if(stack->size==0) return NULL;
+    return stack->items+(size_t)(stack->size-1)*stack->itemSize;
+}
 #endif
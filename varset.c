@@ -7,170 +7,171 @@
 #include "globals.h"
 #include "util.h"
 #include "varset.h"
+#include "symbol.h"
+#include "pool.h"
 
-#define SHIFT 4
+#define WORD_BITS 64
 
-/* Hash function. */
-static int hash(const char * str) {
-    int temp = 0;
+/* Number of words needed for a bitset holding the id. */
+static int wordsFor(int id) {
+    return id/WORD_BITS+1;
+}
+
+/* Grows the bitset to hold at least the given number of words. */
+static void growBits(VarSet *set, int words) {
+    if(words<=set->words) return;
+    unsigned long long *bits = pool_alloc(words*sizeof(unsigned long long));
+    memcpy(bits,set->u.bits,set->words*sizeof(unsigned long long));
+    memset(bits+set->words,0,(words-set->words)*sizeof(unsigned long long));
+    pool_free(set->u.bits,set->words*sizeof(unsigned long long));
+    set->u.bits = bits;
+    set->words = words;
+}
+
+/* Turns a small set into a bitset with at least the given words. */
+static void toBits(VarSet *set, int words) {
+    int ids[VS_INLINE];
     int i;
-    for(i=0;str[i]!='\0';i++) {
-        temp = (temp << (SHIFT + str[i])) % SIZE;
+    if(set->words>0) {
+        growBits(set,words);
+        return;
+    }
+    // the largest id is the last one, since ids are sorted
+    if(set->count>0 && wordsFor(set->u.ids[set->count-1])>words) {
+        words = wordsFor(set->u.ids[set->count-1]);
+    }
+    memcpy(ids,set->u.ids,sizeof(ids));
+    set->u.bits = pool_alloc(words*sizeof(unsigned long long));
+    memset(set->u.bits,0,words*sizeof(unsigned long long));
+    set->words = words;
+    for(i=0;i<set->count;i++) {
+        set->u.bits[ids[i]/WORD_BITS] |= 1ULL << (ids[i]%WORD_BITS);
     }
-    return temp;
 }
 
-VarSet * newVarSet(void) {
-    VarSet * set = (VarSet *) malloc(sizeof(VarSet));
-    if(set==NULL) {
-        fprintf(errOut,"Out of memory.\n");
-    }else {
-        int i;
-        for(i=0;i<SIZE;i++) {
-            set->hashset[i] = NULL;
+static int containsId(VarSet *set, int id) {
+    int i;
+    if(set->words>0) {
+        return id/WORD_BITS<set->words
+            && (set->u.bits[id/WORD_BITS] >> (id%WORD_BITS) & 1);
+    }
+    for(i=0;i<set->count && set->u.ids[i]<=id;i++) {
+        if(set->u.ids[i]==id) return 1;
+    }
+    return 0;
+}
+
+static void addId(VarSet *set, int id) {
+    int i;
+    if(containsId(set,id)) return;
+    if(set->words==0 && set->count<VS_INLINE) {
+        // insert keeping the ids sorted
+        for(i=set->count;i>0 && set->u.ids[i-1]>id;i--) {
+            set->u.ids[i] = set->u.ids[i-1];
         }
+        set->u.ids[i] = id;
+        set->count++;
+        return;
+    }
+    toBits(set,wordsFor(id));
+    set->u.bits[id/WORD_BITS] |= 1ULL << (id%WORD_BITS);
+    set->count++;
+}
+
+/* Adds all variables in the source set. */
+static void addAll(VarSet *des, VarSet *source) {
+    int i;
+    if(source->words==0) {
+        for(i=0;i<source->count;i++) {
+            addId(des,source->u.ids[i]);
+        }
+        return;
+    }
+    toBits(des,source->words);
+    unsigned long long *d = des->u.bits;
+    const unsigned long long *s = source->u.bits;
+    int count = 0;
+    for(i=0;i<source->words;i++) {
+        d[i] |= s[i];
+    }
+    for(i=0;i<des->words;i++) {
+        count += __builtin_popcountll(d[i]);
+    }
+    des->count = count;
+}
+
+VarSet * newVarSet(void) {
+    VarSet * set = (VarSet *) pool_alloc(sizeof(VarSet));
+    if(set!=NULL) {
+        set->count = 0;
+        set->words = 0;
     }
     return set;
 }
 
 void deleteVarSet(VarSet * set) {
     if(set!=NULL) {
-        int i;
-        // free the bucket list
-        for(i=0;i<SIZE;i++) {
-            BucketList bucket = set->hashset[i];
-            while(bucket!=NULL) {
-                BucketList tmp = bucket;
-                bucket = bucket->next;
-                free(tmp->name);
-                tmp->name = NULL;
-                free(tmp);
-                tmp = NULL;
-            }
-            set->hashset[i] = NULL;
+        if(set->words>0) {
+            pool_free(set->u.bits,set->words*sizeof(unsigned long long));
         }
-        // free the set
-        free(set);
-        set = NULL;
+        pool_free(set,sizeof(VarSet));
     }
 }
 
 void addVar(VarSet* set, const char *var) {
-    int h = hash(var);
-    BucketList bucket = set->hashset[h];
-    if(bucket==NULL) {
-        bucket = (BucketList) malloc(sizeof(struct bucketList));
-        if(bucket==NULL) {
-            fprintf(errOut,"Out of memory.\n");
-        }else {
-            bucket->name = stringCopy(var);
-            bucket->next = NULL;
-            set->hashset[h] = bucket;
-        }
-    }else {
-        while(bucket!=NULL) {
-            if(strcmp(bucket->name,var)==0) {
-                break;
-            }
-            bucket = bucket->next;
-        }
-        if(bucket==NULL) {  // var not exists
-            bucket = (BucketList) malloc(sizeof(struct bucketList));
-            if(bucket==NULL) {
-                fprintf(errOut,"Out of memory.\n");
-            }else {
-                bucket->name = stringCopy(var);
-                bucket->next = set->hashset[h];
-                set->hashset[h] = bucket;
-            }
-        }
-    }
+    addId(set,sym_id(var));
 }
 
 void deleteVar(VarSet* set, const char *var) {
-    int h = hash(var);
-    BucketList bucket = set->hashset[h];
-    if(bucket!=NULL) {
-        BucketList pre = NULL;
-        while(bucket!=NULL) {
-            if(strcmp(bucket->name,var)==0) {
-                break;
-            }
-            pre = bucket;
-            bucket = bucket->next;
-        }
-        if(bucket!=NULL) {  // var found
-            if(pre==NULL) {
-                set->hashset[h] = bucket->next;
-            }else {
-                pre->next = bucket->next;
-                bucket->next = NULL;
-            }
-            free(bucket->name);
-            free(bucket);
+    int id = sym_id(var);
+    int i;
+    if(!containsId(set,id)) return;
+    if(set->words>0) {
+        set->u.bits[id/WORD_BITS] &= ~(1ULL << (id%WORD_BITS));
+    }else {
+        for(i=0;set->u.ids[i]!=id;i++);
+        for(;i<set->count-1;i++) {
+            set->u.ids[i] = set->u.ids[i+1];
         }
     }
+    set->count--;
 }
 
-static void copyVarSet(VarSet* des, VarSet* source) {
-    int i;
-    for(i=0;i<SIZE;i++) {
-        BucketList bucket = source->hashset[i];
-        while(bucket!=NULL) {
-            addVar(des,bucket->name);
-            bucket = bucket->next;
-        }
-    }
+VarSet * vs_copy(VarSet* set) {
+    VarSet *result = newVarSet();
+    addAll(result,set);
+    return result;
 }
 
 void unionVarSet(VarSet* newSet, VarSet* set1, VarSet* set2) {
-    copyVarSet(newSet,set1);
-    copyVarSet(newSet,set2);
+    addAll(newSet,set1);
+    addAll(newSet,set2);
 }
 
 int contains(VarSet* set, const char *var) {
-    int h = hash(var);
-    BucketList bucket = set->hashset[h];
-    if(bucket!=NULL) {
-        while(bucket!=NULL) {
-            if(strcmp(bucket->name,var)==0) {
-                return 1;
-            }
-            bucket = bucket->next;
-        }
-    }
-    return 0;
+    return containsId(set,sym_id(var));
 }
 
 int vs_empty(VarSet* set) {
-    int i;
-    for(i=0;i<SIZE;i++) {
-        if(set->hashset[i]!=NULL) {
-            return 0;
-        }
-    }
-    return 1;
+    return set->count==0;
 }
 
 VarSetList* vs_asList(VarSet* set) {
     VarSetList *list = NULL;
     VarSetList *cur = NULL;
+    int n = set->words>0 ? set->words*WORD_BITS : set->count;
     int i;
-    for(i=0;i<SIZE;i++) {
-        if(set->hashset[i]!=NULL) {
-            BucketList bucket = set->hashset[i];
-            while(bucket!=NULL) {
-                VarSetList *l = malloc(sizeof(VarSetList));
-                l->name = stringCopy(bucket->name);
-                l->next = NULL;
-                if(list==NULL) {
-                    cur = list = l;
-                }else {
-                    cur->next = l;
-                    cur = cur->next;
-                }
-                bucket = bucket->next;
-            }
+    for(i=0;i<n;i++) {
+        int id = set->words>0 ? i : set->u.ids[i];
+        if(set->words>0 && !containsId(set,id)) continue;
+        VarSetList *l = malloc(sizeof(VarSetList));
+        l->name = sym_name(id);
+        l->next = NULL;
+        if(list==NULL) {
+            cur = list = l;
+        }else {
+            cur->next = l;
+            cur = cur->next;
         }
     }
     return list;
@@ -181,7 +182,6 @@ void vs_deleteVarSetList(VarSetList *list) {
     while(list!=NULL) {
         l = list;
         list = list->next;
-        free(l->name);
         free(l);
     }
 }
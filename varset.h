@@ -7,23 +7,28 @@
 #ifndef _VARSET_H_
 #define _VARSET_H_
 
-/* Size of the hash table. */
-#define SIZE 211
+/* Number of variables kept inline before switching to a bitset. */
+#define VS_INLINE 4
 
-/* Bucket in the hash table. */
-typedef struct bucketList {
-    char * name;
-    struct bucketList * next;
-} * BucketList;
-
-/* Free variable set. */
+/*
+ * Free variable set. Variables are identified by their symbol id (see
+ * symbol.h). A small set keeps up to VS_INLINE ids in a sorted inline
+ * array, so it needs no allocation besides the set itself. A larger set
+ * is a dense bitset indexed by symbol id, whose union is a word by word
+ * OR.
+ */
 typedef struct varset {
-    BucketList hashset[SIZE];
+    int count;      /* Number of variables in the set. */
+    int words;      /* Number of words in the bitset, 0 for a small set. */
+    union {
+        int ids[VS_INLINE];
+        unsigned long long *bits;
+    } u;
 } VarSet;
 
 /* Free variable list. */
 typedef struct varsetlist {
-    char *name;
+    const char *name;   /* interned */
     struct varsetlist *next;
 } VarSetList;
 
@@ -33,12 +38,20 @@ VarSet * newVarSet(void);
 /* Deallocate the variable set. */
 void deleteVarSet(VarSet * varSet);
 
+/* 
+ * Variables in a set are interned names (see symbol.h). They are compared
+ * by symbol id and not copied.
+ */
+
 /* Add a variable to set. */
 void addVar(VarSet* varSet, const char * var);
 
 /* Delete a variable from set. */
 void deleteVar(VarSet* varSet, const char *var);
 
+/* Returns a copy of the set. */
+VarSet * vs_copy(VarSet* set);
+
 /* Take the union of two sets. */
 void unionVarSet(VarSet* newSet, VarSet* set1, VarSet* set2);
 